@@ -0,0 +1,833 @@
+//==================================================================
+/// jsfluid_bench.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+// Headless benchmark of the solver: whole steps and the single
+//  kernels, over a sweep of grid sizes, with the original solver as
+//  the baseline. Results go out as JSON.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include "FluidSolver.h"
+#include "FluidSolver3D.h"
+
+//==================================================================
+// from JSFluid_Original/jsfluid_solver.cpp
+void set_bnd( int N, int b, float *x );
+void lin_solve( int N, int b, float *x, float *x0, float a, float c );
+void advect( int N, int b, float *d, float *d0, float *u, float *v, float dt );
+void project( int N, float *u, float *v, float *p, float *div );
+void dens_step( int N, float *x, float *x0, float *u, float *v, float diff, float dt );
+void vel_step( int N, float *u, float *v, float *u0, float *v0, float visc, float dt );
+
+//==================================================================
+static const float TIME_DELTA = 0.1f;
+static const float DIFFUSION  = 0.0001f;
+static const float VISCOSITY  = 0.0001f;
+
+struct Options
+{
+    // default for 2D, or 3D
+    std::vector<int>    sizes;
+    double              minTimeS = 0.25;
+    int                 threadsN = 0;   // 0 = hardware
+    bool                useRB = true;
+    FluidSolverBase::PressureSolver psolver = FluidSolverBase::PSOLVER_RELAX;
+    float               relaxTol = 0;
+    // no viscosity and diffusion in the steps, with the solver policy
+    //  that leaves them out
+    bool                isIdeal = false;
+    // passive scalars of the steps, the density being the first
+    int                 scalarsN = 1;
+    // cells per side of the scalar grid over the velocity one
+    int                 scalarScale = 1;
+    // sparse steps, with the fluid seeded in a small disc
+    bool                isSparse = false;
+    // storage of the scalars of the steps
+    FluidStorage        scalStorage = FLUIDSTORAGE_F32;
+    // layout of the fields of the steps
+    FluidLayout         gridLayout = FLUIDLAYOUT_LINEAR;
+    // steps of FluidSolver3D on N^3 grids, rather than the 2D ones
+    bool                is3D = false;
+    bool                doBaseline = true;
+    const char          *pOutFName {};
+    const char          *pTraceFName {};
+};
+
+struct Result
+{
+    const char  *pImpl;
+    const char  *pKernel;
+    int         n;
+    double      nsPerCell;
+    double      gbPerSec;
+    int         iters;
+    int         reps;
+};
+
+//==================================================================
+/// Runs fn until at least minTimeS seconds have passed, after a
+/// warm-up call. Returns the seconds per call.
+template <typename F>
+static double timeIt( double minTimeS, int &out_reps, const F &fn )
+{
+    using clock = std::chrono::steady_clock;
+
+    fn();
+
+    int reps = 0;
+    const auto t0 = clock::now();
+    double elapsed = 0;
+    do
+    {
+        fn();
+        ++reps;
+        elapsed = std::chrono::duration<double>( clock::now() - t0 ).count();
+    } while ( elapsed < minTimeS || reps < 3 );
+
+    out_reps = reps;
+    return elapsed / reps;
+}
+
+//==================================================================
+// smooth swirl, moving the cells by a few cells per step, plus some
+//  divergence for the projection to remove
+static void fillVelocity( int n, int stride, float *u, float *v )
+{
+    for (int j=0; j < n+2; ++j)
+    {
+        for (int i=0; i < n+2; ++i)
+        {
+            const float x = (float)i / (n+1) * 6.2831853f;
+            const float y = (float)j / (n+1) * 6.2831853f;
+            u[i + stride * j] =  0.2f * (sinf( y ) + 0.5f * sinf( x )) * 4.f / n;
+            v[i + stride * j] = -0.2f * (sinf( x ) - 0.5f * sinf( y )) * 4.f / n;
+        }
+    }
+}
+
+static void fillDensity( int n, int stride, float *d )
+{
+    for (int j=0; j < n+2; ++j)
+        for (int i=0; i < n+2; ++i)
+            d[i + stride * j] = ((i / 8 + j / 8) & 1) ? 1.f : 0.f;
+}
+
+//==================================================================
+/// Estimated memory traffic in bytes per interior cell, counting
+/// each field streamed once per pass
+//==================================================================
+static const double BYTES_LINSOLVE_ITER = 3 * 4;    // x0, x in, x out
+static const double BYTES_ADVECT        = 4 * 4;    // u, v, d0, d
+static const double BYTES_ADVECT3       = 8 * 4;    // u, v, 3 x (d0, d)
+static const double BYTES_PROJECT_FIXED = 3*4 + 5*4;// divergence + gradient
+
+// emitters of a batch of AddSplats()
+static const int    SPLATS_N     = 4096;
+static const float  SPLAT_RADIUS = 4.f;
+
+static const double BYTES_ADVECT3D        = 5 * 4;        // u, v, w, d0, d
+static const double BYTES_ADVECT3D_VEL    = 9 * 4;        // u, v, w, 3 x d
+static const double BYTES_PROJECT3D_FIXED = 4*4 + 7*4;    // divergence + gradient
+
+// u, v, fieldsN x (d0, d). Fields stored at 16 bits count as half a field
+static double advectNBytes( double fieldsN ) { return (2 + 2 * fieldsN) * 4; }
+static double projectSolveBytes( FluidSolverBase::PressureSolver ps, int iters )
+{
+    switch ( ps )
+    {
+    // sweeps of pre/post smoothing and the residual, over the levels
+    case FluidSolverBase::PSOLVER_MULTIGRID: return iters * (5 * 3*4) * 4.0 / 3.0;
+    // matrix-vector, 3 updates, 2 dot products, preconditioner
+    case FluidSolverBase::PSOLVER_PCG:       return iters * (2*4 + 3*3*4 + 2*2*4 + 4*4);
+    default:                                 return iters * BYTES_LINSOLVE_ITER;
+    }
+}
+
+//==================================================================
+/// Internal kernels of FluidSolverT, which is a friend
+//==================================================================
+struct FluidBenchAccess
+{
+    template <typename SOLVER>
+    static void Run( SOLVER &s, const Options &opt, std::vector<Result> &out )
+    {
+        using BT = typename SOLVER::BType;
+
+        const int n = s.GetNX();
+        const int stride = s.mLayout.RowStride();
+        const auto cellsN = s.mLayout.GetCellsN();
+        const double interN = (double)n * n;
+
+        FluidField u( cellsN ), v( cellsN ), d( cellsN ), d0( cellsN );
+        FluidField p( cellsN ), div( cellsN );
+        fillVelocity( n, stride, u.data(), v.data() );
+        fillDensity( n, stride, d0.data() );
+
+        auto add = [&]( const char *pKernel, double sec, int reps, int iters, double bytesPerCell )
+        {
+            out.push_back( { "new", pKernel, n,
+                             sec * 1e9 / interN,
+                             bytesPerCell * interN / sec * 1e-9,
+                             iters, reps } );
+        };
+
+        int reps = 0;
+
+        // lin_solve, as used by the diffusion
+        {
+            const float a = TIME_DELTA * DIFFUSION * n * n;
+            int iters = 0;
+            const auto sec = timeIt( opt.minTimeS, reps, [&]()
+            {
+                iters = s.lin_solve( BT::BTYPE_EXPAND, d.data(), d0.data(), a, 1 + 4*a );
+            });
+            add( "lin_solve", sec, reps, iters, iters * BYTES_LINSOLVE_ITER );
+        }
+
+        {
+            const auto sec = timeIt( opt.minTimeS, reps, [&]()
+            {
+                s.advect( d.data(), d0.data(), u.data(), v.data(), TIME_DELTA );
+            });
+            add( "advect", sec, reps, 1, BYTES_ADVECT );
+        }
+
+        // velocity and density along the same trace, as in Step()
+        {
+            FluidField du( cellsN ), dv( cellsN );
+            float       *const ppD[]  = { du.data(), dv.data(), d.data() };
+            const float *const ppD0[] = { u.data(), v.data(), d0.data() };
+            const auto sec = timeIt( opt.minTimeS, reps, [&]()
+            {
+                s.advect( ppD, ppD0, 3, u.data(), v.data(), TIME_DELTA );
+            });
+            add( "advect3", sec, reps, 1, BYTES_ADVECT3 );
+        }
+
+        // on copies, so that each run starts from the same divergence,
+        //  and from zero pressure, or the runs after the first one
+        //  would have nothing to solve
+        {
+            s.SetWarmStartPressure( false );
+
+            FluidField uc( cellsN ), vc( cellsN );
+            const auto sec = timeIt( opt.minTimeS, reps, [&]()
+            {
+                uc = u;
+                vc = v;
+                s.project( uc.data(), vc.data(), p.data(), div.data() );
+            });
+            const int iters = s.GetLastPressureItersN();
+            add( "project", sec, reps, iters,
+                    BYTES_PROJECT_FIXED + projectSolveBytes( opt.psolver, iters ) );
+
+            s.SetWarmStartPressure( true );
+        }
+
+        {
+            const auto sec = timeIt( opt.minTimeS, reps, [&]()
+            {
+                s.setBoundary( BT::BTYPE_REPEL0, u.data() );
+            });
+            // all 4 sides, read and written
+            add( "setBoundary", sec, reps, 1, 4.0 * (2 * 4 * n) / interN );
+        }
+    }
+};
+
+//==================================================================
+static void setupSolver( FluidSolverBase &s, const Options &opt, ThreadPool *pPool )
+{
+    if ( opt.useRB )
+        s.SetRelaxMode( FluidSolverBase::RELAX_RED_BLACK );
+
+    s.SetThreadPool( pPool );
+    s.SetPressureSolver( opt.psolver );
+
+    auto relaxPar = s.GetRelaxParams();
+    relaxPar.tolerance = opt.relaxTol;
+    s.SetRelaxParams( relaxPar );
+}
+
+//==================================================================
+static void benchSteps(
+        FluidSolverBase &s,
+        const Options &opt,
+        std::vector<Result> &out )
+{
+    const int n = s.GetNX();
+    const double interN = (double)n * n;
+    // dens_step and step are per velocity cell, with this many
+    //  scalar cells each
+    const int ss = s.GetScalarScale();
+    const double scalPerCell = (double)ss * ss;
+
+    const float visc = opt.isIdeal ? 0.f : VISCOSITY;
+    const float diff = opt.isIdeal ? 0.f : DIFFUSION;
+
+    // the seeded part of the domain, in cells of the velocity grid
+    auto isSeeded = [&]( int i, int j )
+    {
+        if ( !opt.isSparse )
+            return true;
+
+        const float x = (i - 0.5f) / n - 0.5f;
+        const float y = (j - 0.5f) / n - 0.5f;
+        return x*x + y*y < 0.1f * 0.1f;
+    };
+
+    // seed a swirl and some density, then keep stepping it
+    for (int j=1; j <= n; ++j)
+    {
+        for (int i=1; i <= n; ++i)
+        {
+            if ( !isSeeded( i, j ) )
+                continue;
+            s.SMPVel<0>( i, j ) =  0.2f * sinf( j * 6.2831853f / n ) * 4.f / n;
+            s.SMPVel<1>( i, j ) = -0.2f * sinf( i * 6.2831853f / n ) * 4.f / n;
+        }
+    }
+    for (int j=1; j <= s.GetScalarNY(); ++j)
+        for (int i=1; i <= s.GetScalarNX(); ++i)
+            for (int c=0; c < s.GetScalarsN(); ++c)
+                if ( isSeeded( (i-1)/ss + 1, (j-1)/ss + 1 ) )
+                    s.SMPScalar( c, i, j ) = (((i/ss + 4*c) / 8 + j/ss / 8) & 1) ? 1.f : 0.f;
+
+    const int scalN = s.GetScalarsN();
+    // scalars in floats worth of traffic
+    const double scalF = scalN * FluidStorageCellSize( s.GetScalarStorage() ) / 4.0;
+
+    // the sweeps of a diffusion, taken as those of a dens_step
+    s.dens_step( diff, TIME_DELTA );
+    const int diffIters = s.GetLastRelaxItersN();
+
+    int reps = 0;
+    {
+        const auto sec = timeIt( opt.minTimeS, reps, [&]() { s.vel_step( visc, TIME_DELTA ); } );
+        const int iters = s.GetLastPressureItersN();
+        // 2 diffusions, 2 advections, 2 projections
+        const double bytes = 2 * diffIters * BYTES_LINSOLVE_ITER +
+                             2 * BYTES_ADVECT +
+                             2 * (BYTES_PROJECT_FIXED + projectSolveBytes( opt.psolver, iters ));
+        out.push_back( { "new", "vel_step", n, sec * 1e9 / interN,
+                         bytes * interN / sec * 1e-9, iters, reps } );
+    }
+    {
+        const auto sec = timeIt( opt.minTimeS, reps, [&]() { s.dens_step( diff, TIME_DELTA ); } );
+        const int iters = s.GetLastRelaxItersN();
+        // plus the interpolated velocity, with a scalar grid
+        const double bytes = (scalF * iters * BYTES_LINSOLVE_ITER + advectNBytes( scalF ) +
+                              (ss > 1 ? 2 * 4 : 0)) * scalPerCell;
+        out.push_back( { "new", "dens_step", n, sec * 1e9 / interN,
+                         bytes * interN / sec * 1e-9, iters, reps } );
+    }
+    {
+        const auto sec = timeIt( opt.minTimeS, reps, [&]() { s.Step( visc, diff, TIME_DELTA ); } );
+        const int iters = s.GetLastPressureItersN();
+        // 2 + scalN diffusions, 1 fused advection, 2 projections. With
+        //  a scalar grid, vel_step and dens_step
+        const double projBytes = 2 * (BYTES_PROJECT_FIXED + projectSolveBytes( opt.psolver, iters ));
+        const double bytes = ss == 1
+            ? (2 + scalF) * diffIters * BYTES_LINSOLVE_ITER + advectNBytes( 2 + scalF ) + projBytes
+            : 2 * diffIters * BYTES_LINSOLVE_ITER + 2 * BYTES_ADVECT + projBytes +
+              (scalF * diffIters * BYTES_LINSOLVE_ITER + advectNBytes( scalF ) + 2 * 4) * scalPerCell;
+        out.push_back( { "new", "step", n, sec * 1e9 / interN,
+                         bytes * interN / sec * 1e-9, iters, reps } );
+
+        // the same step a slice per call, for the cost of resuming.
+        //  The iterations are the slices of a step
+        int slicesN = 0;
+        const auto secSliced = timeIt( opt.minTimeS, reps, [&]()
+        {
+            slicesN = 1;
+            while ( !s.StepSliced( visc, diff, TIME_DELTA, FluidSolverBase::StepClock::time_point() ) )
+                ++slicesN;
+        });
+        out.push_back( { "new", "step_sliced", n, secSliced * 1e9 / interN,
+                         bytes * interN / secSliced * 1e-9, slicesN, reps } );
+    }
+    {
+        // a batch of emitters over the domain, alternating density and
+        //  velocity. Amounts cancel out over two batches
+        std::vector<FluidSolverBase::Splat> splats( SPLATS_N );
+        for (int k=0; k < SPLATS_N; ++k)
+        {
+            auto &sp = splats[k];
+            sp.pos[0]  = (float)n * (float)((k * 37) % SPLATS_N) / SPLATS_N;
+            sp.pos[1]  = (float)n * (float)((k * 91) % SPLATS_N) / SPLATS_N;
+            sp.radius  = SPLAT_RADIUS;
+            sp.falloff = 1;
+            sp.target  = (k & 1) ? FluidSolverBase::Splat::TARGET_VELOCITY : 0;
+            sp.amount[0] = 1e-3f;
+            sp.amount[1] = -1e-3f;
+        }
+        int batchesN = 0;
+        const auto sec = timeIt( opt.minTimeS, reps, [&]()
+        {
+            const float sign = (batchesN++ & 1) ? -1.f : 1.f;
+            for (auto &sp : splats)
+            {
+                sp.amount[0] = sign * fabsf( sp.amount[0] );
+                sp.amount[1] = sign * fabsf( sp.amount[1] );
+            }
+            s.AddSplats( splats.data(), splats.size() );
+        });
+        // read and write of the covered cells, of 1 or 2 fields
+        const double bytes = SPLATS_N * 3.14159 * SPLAT_RADIUS * SPLAT_RADIUS * 8 * 1.5;
+        out.push_back( { "new", "splats", n, sec * 1e9 / interN,
+                         bytes / sec * 1e-9, 0, reps } );
+    }
+    {
+        // a restart from a checkpoint of the state, the file being in
+        //  the page cache after the save
+        std::error_code ec;
+        const auto fname = (std::filesystem::temp_directory_path( ec ) / "jsfluid_bench.ckpt").string();
+        if ( s.SaveCheckpoint( fname.c_str() ) )
+        {
+            bool ok = true;
+            const auto sec = timeIt( opt.minTimeS, reps, [&]()
+            {
+                ok = s.LoadCheckpoint( fname.c_str() ) && ok;
+            });
+            // read from the mapping and written to the fields
+            const double bytes = 2.0 * (double)std::filesystem::file_size( fname, ec );
+            if ( ok )
+                out.push_back( { "new", "checkpoint_load", n, sec * 1e9 / interN,
+                                 bytes / sec * 1e-9, 0, reps } );
+        }
+        std::filesystem::remove( fname, ec );
+    }
+}
+
+//==================================================================
+template <int N>
+static bool benchFixed( int n, const Options &opt, ThreadPool *pPool, std::vector<Result> &out )
+{
+    if ( n != N )
+        return false;
+
+    auto oS = std::make_unique<FluidSolver<N,true>>();
+    setupSolver( *oS, opt, pPool );
+    FluidBenchAccess::Run( *oS, opt, out );
+    return true;
+}
+
+static void benchNew( int n, const Options &opt, ThreadPool *pPool, std::vector<Result> &out )
+{
+    // the kernels of the sizes that have a fast path in CreateFluidSolver
+    if (!(benchFixed<64>( n, opt, pPool, out ) ||
+          benchFixed<128>( n, opt, pPool, out ) ||
+          benchFixed<256>( n, opt, pPool, out ) ||
+          benchFixed<512>( n, opt, pPool, out ) ||
+          benchFixed<1024>( n, opt, pPool, out )) )
+    {
+        auto oS = std::make_unique<FluidSolverT<0,0,true>>( n, n );
+        setupSolver( *oS, opt, pPool );
+        FluidBenchAccess::Run( *oS, opt, out );
+    }
+
+    const unsigned policy = opt.isIdeal
+                            ? FluidSolverBase::POLICY_INVISCID | FluidSolverBase::POLICY_NO_DIFFUSION
+                            : 0;
+    auto oS = CreateFluidSolver( n, n, true, policy, opt.scalStorage, opt.gridLayout );
+    setupSolver( *oS, opt, pPool );
+    oS->SetScalarScale( opt.scalarScale );
+    oS->SetSparse( opt.isSparse );
+    oS->SetScalarsN( opt.scalarsN );
+    benchSteps( *oS, opt, out );
+}
+
+//==================================================================
+/// Steps of FluidSolver3D, per cell of the n^3 grid
+//==================================================================
+static void bench3D( int n, const Options &opt, ThreadPool *pPool, std::vector<Result> &out )
+{
+    FluidSolver3D s( n, n, n, true );
+    s.SetThreadPool( pPool );
+
+    const double interN = (double)n * n * n;
+    const float visc = opt.isIdeal ? 0.f : VISCOSITY;
+    const float diff = opt.isIdeal ? 0.f : DIFFUSION;
+
+    // the swirl of the 2D steps on each plane, plus a flow along z
+    for (int k=1; k <= n; ++k)
+    {
+        for (int j=1; j <= n; ++j)
+        {
+            for (int i=1; i <= n; ++i)
+            {
+                s.SMPVel<0>( i, j, k ) =  0.2f * sinf( j * 6.2831853f / n ) * 4.f / n;
+                s.SMPVel<1>( i, j, k ) = -0.2f * sinf( i * 6.2831853f / n ) * 4.f / n;
+                s.SMPVel<2>( i, j, k ) =  0.1f * sinf( (i + j) * 6.2831853f / n ) * 4.f / n;
+                s.SMPDen( i, j, k ) = ((i / 8 + j / 8 + k / 8) & 1) ? 1.f : 0.f;
+            }
+        }
+    }
+
+    const int iters = s.GetRelaxItersN();
+    auto add = [&]( const char *pKernel, double sec, int reps, double bytesPerCell )
+    {
+        out.push_back( { "new3d", pKernel, n, sec * 1e9 / interN,
+                         bytesPerCell * interN / sec * 1e-9, iters, reps } );
+    };
+
+    int reps = 0;
+    {
+        const auto sec = timeIt( opt.minTimeS, reps, [&]() { s.vel_step( visc, TIME_DELTA ); } );
+        // 3 diffusions, 3 advections along u, v, w, 2 projections
+        add( "vel_step", sec, reps, 3 * iters * BYTES_LINSOLVE_ITER +
+                                    BYTES_ADVECT3D_VEL +
+                                    2 * (BYTES_PROJECT3D_FIXED + iters * BYTES_LINSOLVE_ITER) );
+    }
+    {
+        const auto sec = timeIt( opt.minTimeS, reps, [&]() { s.dens_step( diff, TIME_DELTA ); } );
+        add( "dens_step", sec, reps, iters * BYTES_LINSOLVE_ITER + BYTES_ADVECT3D );
+    }
+}
+
+//==================================================================
+static void benchOriginal( int n, const Options &opt, std::vector<Result> &out )
+{
+    const auto cellsN = (size_t)(n+2) * (n+2);
+    const double interN = (double)n * n;
+    const int stride = n+2;
+
+    std::vector<float> u( cellsN ), v( cellsN ), u0( cellsN ), v0( cellsN );
+    std::vector<float> d( cellsN ), d0( cellsN ), p( cellsN ), div( cellsN );
+    fillVelocity( n, stride, u.data(), v.data() );
+    fillDensity( n, stride, d0.data() );
+
+    auto add = [&]( const char *pKernel, double sec, int reps, int iters, double bytesPerCell )
+    {
+        out.push_back( { "original", pKernel, n,
+                         sec * 1e9 / interN,
+                         bytesPerCell * interN / sec * 1e-9,
+                         iters, reps } );
+    };
+
+    int reps = 0;
+    const int ITERS = 20; // hard-coded there
+
+    const float visc = opt.isIdeal ? 0.f : VISCOSITY;
+    const float diff = opt.isIdeal ? 0.f : DIFFUSION;
+
+    {
+        const float a = TIME_DELTA * DIFFUSION * n * n;
+        const auto sec = timeIt( opt.minTimeS, reps, [&]()
+        {
+            lin_solve( n, 0, d.data(), d0.data(), a, 1 + 4*a );
+        });
+        add( "lin_solve", sec, reps, ITERS, ITERS * BYTES_LINSOLVE_ITER );
+    }
+    {
+        const auto sec = timeIt( opt.minTimeS, reps, [&]()
+        {
+            advect( n, 0, d.data(), d0.data(), u.data(), v.data(), TIME_DELTA );
+        });
+        add( "advect", sec, reps, 1, BYTES_ADVECT );
+    }
+    {
+        auto uc = u;
+        auto vc = v;
+        const auto sec = timeIt( opt.minTimeS, reps, [&]()
+        {
+            uc = u;
+            vc = v;
+            project( n, uc.data(), vc.data(), p.data(), div.data() );
+        });
+        add( "project", sec, reps, ITERS, BYTES_PROJECT_FIXED + ITERS * BYTES_LINSOLVE_ITER );
+    }
+    {
+        const auto sec = timeIt( opt.minTimeS, reps, [&]() { set_bnd( n, 1, u.data() ); } );
+        add( "setBoundary", sec, reps, 1, 4.0 * (2 * 4 * n) / interN );
+    }
+
+    // the steps add the "previous" fields as sources and then use them
+    //  as scratch, so they're cleared each time, as the demo does
+    {
+        const auto sec = timeIt( opt.minTimeS, reps, [&]()
+        {
+            std::fill( u0.begin(), u0.end(), 0.f );
+            std::fill( v0.begin(), v0.end(), 0.f );
+            vel_step( n, u.data(), v.data(), u0.data(), v0.data(), visc, TIME_DELTA );
+        });
+        const double bytes = 2 * ITERS * BYTES_LINSOLVE_ITER +
+                             2 * BYTES_ADVECT +
+                             2 * (BYTES_PROJECT_FIXED + ITERS * BYTES_LINSOLVE_ITER);
+        add( "vel_step", sec, reps, ITERS, bytes );
+    }
+    {
+        const auto sec = timeIt( opt.minTimeS, reps, [&]()
+        {
+            std::fill( d0.begin(), d0.end(), 0.f );
+            dens_step( n, d.data(), d0.data(), u.data(), v.data(), diff, TIME_DELTA );
+        });
+        add( "dens_step", sec, reps, ITERS, ITERS * BYTES_LINSOLVE_ITER + BYTES_ADVECT );
+    }
+}
+
+//==================================================================
+static void writeJSON( FILE *pFile, const Options &opt, int threadsN, const std::vector<Result> &results )
+{
+    static const char *psolverNames[] = { "relax", "multigrid", "pcg" };
+    static const char *storageNames[] = { "f32", "f16", "bf16" };
+    static const char *layoutNames[] = { "linear", "tiled" };
+
+    fprintf( pFile, "{\n" );
+    fprintf( pFile, "  \"isa\": \"%s\",\n", GetFluidKernels( DetectFluidISA() )->pName );
+    fprintf( pFile, "  \"threads\": %i,\n", threadsN );
+    fprintf( pFile, "  \"relax_mode\": \"%s\",\n", opt.useRB ? "red_black" : "gauss_seidel" );
+    fprintf( pFile, "  \"pressure_solver\": \"%s\",\n", psolverNames[ opt.psolver ] );
+    fprintf( pFile, "  \"relax_tolerance\": %g,\n", opt.relaxTol );
+    fprintf( pFile, "  \"ideal\": %s,\n", opt.isIdeal ? "true" : "false" );
+    fprintf( pFile, "  \"scalars\": %i,\n", opt.scalarsN );
+    fprintf( pFile, "  \"scalar_scale\": %i,\n", opt.scalarScale );
+    fprintf( pFile, "  \"sparse\": %s,\n", opt.isSparse ? "true" : "false" );
+    fprintf( pFile, "  \"storage\": \"%s\",\n", storageNames[ opt.scalStorage ] );
+    fprintf( pFile, "  \"layout\": \"%s\",\n", layoutNames[ opt.gridLayout ] );
+    fprintf( pFile, "  \"dims\": %i,\n", opt.is3D ? 3 : 2 );
+    fprintf( pFile, "  \"time_delta\": %g,\n", TIME_DELTA );
+    fprintf( pFile, "  \"results\": [\n" );
+
+    for (size_t i=0; i < results.size(); ++i)
+    {
+        const auto &r = results[i];
+        fprintf( pFile,
+            "    { \"impl\": \"%s\", \"kernel\": \"%s\", \"n\": %i, "
+            "\"ns_per_cell\": %.4f, \"gb_per_s\": %.3f, \"iterations\": %i, \"reps\": %i }%s\n",
+            r.pImpl, r.pKernel, r.n, r.nsPerCell, r.gbPerSec, r.iters, r.reps,
+            i+1 < results.size() ? "," : "" );
+    }
+
+    fprintf( pFile, "  ]\n" );
+    fprintf( pFile, "}\n" );
+}
+
+//==================================================================
+static void printUsage( const char *pExeName )
+{
+    fprintf( stderr,
+        "Usage: %s [options]\n"
+        "  --sizes N1,N2,...   grid sizes (default 64,128,256,512,1024, or\n"
+        "                      32,64,128 with --3d)\n"
+        "  --min-time S        seconds of runs per measure (default 0.25)\n"
+        "  --threads N         thread pool size, 1 is serial (default: all cores)\n"
+        "  --relax gs|rb       relaxation order (default rb)\n"
+        "  --psolver relax|mg|pcg  pressure solver (default relax)\n"
+        "  --relax-tol T       residual tolerance of the relaxation (default 0, off)\n"
+        "  --ideal             steps with no viscosity and diffusion\n"
+        "  --scalars N         passive scalars of the steps, 1 to %i (default 1)\n"
+        "  --scalar-scale K    scalars on a grid K times finer per side (default 1),\n"
+        "                      the steps are still timed per velocity cell\n"
+        "  --sparse            sparse steps, the fluid seeded in a disc of a tenth\n"
+        "                      of the domain size\n"
+        "  --storage f32|f16|bf16  storage of the scalars of the steps (default f32)\n"
+        "  --layout linear|tiled   layout of the fields of the steps (default linear)\n"
+        "  --3d                steps of the 3D solver on N^3 grids, with no\n"
+        "                      baseline\n"
+        "  --no-baseline       skip the original solver\n"
+        "  -o FILE             write the JSON to FILE rather than stdout\n"
+        "  --trace FILE        write the kernel timings of the new solver as\n"
+        "                      Chrome trace events (needs JSFLUID_ENABLE_TRACE)\n",
+        pExeName, FluidSolverBase::SCALARS_MAX );
+}
+
+static bool parseArgs( int argc, char **argv, Options &opt )
+{
+    for (int i=1; i < argc; ++i)
+    {
+        const char *pArg = argv[i];
+        const char *pVal = i+1 < argc ? argv[i+1] : nullptr;
+
+        auto needVal = [&]()
+        {
+            if ( !pVal )
+            {
+                fprintf( stderr, "Missing value for %s\n", pArg );
+                return false;
+            }
+            ++i;
+            return true;
+        };
+
+        if ( !strcmp( pArg, "--sizes" ) )
+        {
+            if ( !needVal() ) return false;
+            opt.sizes.clear();
+            for (const char *p=pVal; *p; )
+            {
+                char *pEnd {};
+                const int n = (int)strtol( p, &pEnd, 10 );
+                if ( pEnd == p || n < 1 )
+                {
+                    fprintf( stderr, "Bad sizes list: %s\n", pVal );
+                    return false;
+                }
+                opt.sizes.push_back( n );
+                p = *pEnd == ',' ? pEnd + 1 : pEnd;
+            }
+        }
+        else
+        if ( !strcmp( pArg, "--min-time" ) ) { if ( !needVal() ) return false; opt.minTimeS = atof( pVal ); }
+        else
+        if ( !strcmp( pArg, "--threads" ) )  { if ( !needVal() ) return false; opt.threadsN = atoi( pVal ); }
+        else
+        if ( !strcmp( pArg, "--relax" ) )
+        {
+            if ( !needVal() ) return false;
+            if ( !strcmp( pVal, "rb" ) ) opt.useRB = true;  else
+            if ( !strcmp( pVal, "gs" ) ) opt.useRB = false; else
+            {
+                fprintf( stderr, "Bad relaxation: %s\n", pVal );
+                return false;
+            }
+        }
+        else
+        if ( !strcmp( pArg, "--psolver" ) )
+        {
+            if ( !needVal() ) return false;
+            if ( !strcmp( pVal, "mg" ) )  opt.psolver = FluidSolverBase::PSOLVER_MULTIGRID; else
+            if ( !strcmp( pVal, "pcg" ) ) opt.psolver = FluidSolverBase::PSOLVER_PCG;       else
+            if ( !strcmp( pVal, "relax" ) ) opt.psolver = FluidSolverBase::PSOLVER_RELAX;   else
+            {
+                fprintf( stderr, "Bad pressure solver: %s\n", pVal );
+                return false;
+            }
+        }
+        else
+        if ( !strcmp( pArg, "--relax-tol" ) ) { if ( !needVal() ) return false; opt.relaxTol = (float)atof( pVal ); }
+        else
+        if ( !strcmp( pArg, "--ideal" ) ) opt.isIdeal = true;
+        else
+        if ( !strcmp( pArg, "--scalars" ) )
+        {
+            if ( !needVal() ) return false;
+            opt.scalarsN = atoi( pVal );
+            if ( opt.scalarsN < 1 || opt.scalarsN > FluidSolverBase::SCALARS_MAX )
+            {
+                fprintf( stderr, "Bad scalars count: %s\n", pVal );
+                return false;
+            }
+        }
+        else
+        if ( !strcmp( pArg, "--scalar-scale" ) )
+        {
+            if ( !needVal() ) return false;
+            opt.scalarScale = atoi( pVal );
+            if ( opt.scalarScale < 1 )
+            {
+                fprintf( stderr, "Bad scalar scale: %s\n", pVal );
+                return false;
+            }
+        }
+        else
+        if ( !strcmp( pArg, "--sparse" ) ) opt.isSparse = true;
+        else
+        if ( !strcmp( pArg, "--storage" ) )
+        {
+            if ( !needVal() ) return false;
+            if ( !strcmp( pVal, "f16" ) )  opt.scalStorage = FLUIDSTORAGE_F16;  else
+            if ( !strcmp( pVal, "bf16" ) ) opt.scalStorage = FLUIDSTORAGE_BF16; else
+            if ( !strcmp( pVal, "f32" ) )  opt.scalStorage = FLUIDSTORAGE_F32;  else
+            {
+                fprintf( stderr, "Bad storage: %s\n", pVal );
+                return false;
+            }
+        }
+        else
+        if ( !strcmp( pArg, "--layout" ) )
+        {
+            if ( !needVal() ) return false;
+            if ( !strcmp( pVal, "tiled" ) )  opt.gridLayout = FLUIDLAYOUT_TILED;  else
+            if ( !strcmp( pVal, "linear" ) ) opt.gridLayout = FLUIDLAYOUT_LINEAR; else
+            {
+                fprintf( stderr, "Bad layout: %s\n", pVal );
+                return false;
+            }
+        }
+        else
+        if ( !strcmp( pArg, "--3d" ) ) opt.is3D = true;
+        else
+        if ( !strcmp( pArg, "--no-baseline" ) ) opt.doBaseline = false;
+        else
+        if ( !strcmp( pArg, "-o" ) ) { if ( !needVal() ) return false; opt.pOutFName = pVal; }
+        else
+        if ( !strcmp( pArg, "--trace" ) ) { if ( !needVal() ) return false; opt.pTraceFName = pVal; }
+        else
+        {
+            printUsage( argv[0] );
+            return false;
+        }
+    }
+    return true;
+}
+
+//==================================================================
+int main( int argc, char **argv )
+{
+    Options opt;
+    if ( !parseArgs( argc, argv, opt ) )
+        return 1;
+
+    if ( opt.sizes.empty() )
+    {
+        if ( opt.is3D )
+            opt.sizes = { 32, 64, 128 };
+        else
+            opt.sizes = { 64, 128, 256, 512, 1024 };
+    }
+
+    std::unique_ptr<ThreadPool> oPool;
+    if ( opt.threadsN != 1 )
+        oPool = std::make_unique<ThreadPool>( opt.threadsN );
+
+    const int threadsN = oPool ? oPool->GetThreadsN() : 1;
+
+    std::vector<Result> results;
+    for (int n : opt.sizes)
+    {
+        fprintf( stderr, "N=%i...\n", n );
+
+        if ( opt.is3D )
+        {
+            bench3D( n, opt, oPool.get(), results );
+            continue;
+        }
+
+        benchNew( n, opt, oPool.get(), results );
+
+        if ( opt.doBaseline )
+            benchOriginal( n, opt, results );
+    }
+
+    if ( opt.pTraceFName && !FluidTraceWriteChrome( opt.pTraceFName ) )
+        fprintf( stderr, "Could not write the trace to %s (built with JSFLUID_ENABLE_TRACE ?)\n",
+                    opt.pTraceFName );
+
+    FILE *pFile = stdout;
+    if ( opt.pOutFName && !(pFile = fopen( opt.pOutFName, "w" )) )
+    {
+        fprintf( stderr, "Could not write %s\n", opt.pOutFName );
+        return 1;
+    }
+
+    writeJSON( pFile, opt, threadsN, results );
+
+    if ( pFile != stdout )
+        fclose( pFile );
+
+    return 0;
+}
+
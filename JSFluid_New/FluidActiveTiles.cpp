@@ -0,0 +1,164 @@
+//==================================================================
+/// FluidActiveTiles.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <assert.h>
+#include <algorithm>
+#include "FluidActiveTiles.h"
+
+//==================================================================
+void FluidActiveTiles::Setup( int nx, int ny )
+{
+    assert( nx > 0 && ny > 0 );
+
+    mNX = nx;
+    mNY = ny;
+    mBlocksX = (nx + BLOCK-1) / BLOCK;
+    mBlocksY = (ny + BLOCK-1) / BLOCK;
+
+    mMap.assign( (size_t)(mBlocksX * mBlocksY), 0 );
+    mTmpMap.assign( mMap.size(), 0 );
+    mHeldMap.assign( mMap.size(), 0 );
+    mDirtyMap.assign( mMap.size(), 1 );
+    mHaloMap.assign( mMap.size(), 0 );
+
+    Finalize( 0 );
+}
+
+//==================================================================
+void FluidActiveTiles::MarkDirty( int i0, int i1, int j0, int j1 )
+{
+    if ( mDirtyMap.empty() || i0 > i1 || j0 > j1 )
+        return;
+
+    // only blocks not set yet are written, so that writers of cells
+    //  already marked can run in parallel
+    const int bx1 = BlockX( i1 );
+    const int by1 = BlockY( j1 );
+    for (int by=BlockY( j0 ); by <= by1; ++by)
+    {
+        for (int bx=BlockX( i0 ); bx <= bx1; ++bx)
+        {
+            auto &m = mDirtyMap[ bx + mBlocksX * by ];
+            if ( !m )
+                m = 1;
+        }
+    }
+}
+
+//==================================================================
+void FluidActiveTiles::MarkAllDirty()
+{
+    std::fill( mDirtyMap.begin(), mDirtyMap.end(), 1 );
+}
+
+//==================================================================
+void FluidActiveTiles::BeginMap()
+{
+    for (size_t k=0; k < mMap.size(); ++k)
+        mHeldMap[k] = mMap[k] | mDirtyMap[k];
+
+    std::fill( mMap.begin(), mMap.end(), 0 );
+    std::fill( mDirtyMap.begin(), mDirtyMap.end(), 0 );
+}
+
+//==================================================================
+void FluidActiveTiles::KeepHeld()
+{
+    for (size_t k=0; k < mMap.size(); ++k)
+        mDirtyMap[k] |= mHeldMap[k];
+}
+
+//==================================================================
+void FluidActiveTiles::Finalize( int radiusN )
+{
+    dilate( mMap, mMap, radiusN );
+
+    // the inactive blocks that may hold values, and those next to the
+    //  active ones
+    dilate( mHaloMap, mMap, radiusN );
+    for (size_t k=0; k < mMap.size(); ++k)
+    {
+        mHaloMap[k] &= !mMap[k];
+        mTmpMap[k] = mHeldMap[k] & !mMap[k];
+    }
+
+    makeSpans( mSpans, mMap, true );
+    makeSpans( mGaps, mMap, false );
+    makeSpans( mStales, mTmpMap, true );
+    makeSpans( mHalos, mHaloMap, true );
+
+    mActiveN = (int)std::count( mMap.begin(), mMap.end(), 1 );
+}
+
+//==================================================================
+void FluidActiveTiles::dilate( std::vector<uint8_t> &dst, const std::vector<uint8_t> &src, int radiusN )
+{
+    if ( radiusN <= 0 )
+    {
+        dst = src;
+        return;
+    }
+
+    // separable, along x into the temp map, then along y
+    for (int by=0; by < mBlocksY; ++by)
+    {
+        for (int bx=0; bx < mBlocksX; ++bx)
+        {
+            uint8_t m = 0;
+            const int x0 = std::max( bx - radiusN, 0 );
+            const int x1 = std::min( bx + radiusN, mBlocksX-1 );
+            for (int x=x0; x <= x1 && !m; ++x)
+                m = src[ x + mBlocksX * by ];
+
+            mTmpMap[ bx + mBlocksX * by ] = m;
+        }
+    }
+    for (int by=0; by < mBlocksY; ++by)
+    {
+        for (int bx=0; bx < mBlocksX; ++bx)
+        {
+            uint8_t m = 0;
+            const int y0 = std::max( by - radiusN, 0 );
+            const int y1 = std::min( by + radiusN, mBlocksY-1 );
+            for (int y=y0; y <= y1 && !m; ++y)
+                m = mTmpMap[ bx + mBlocksX * y ];
+
+            dst[ bx + mBlocksX * by ] = m;
+        }
+    }
+}
+
+//==================================================================
+void FluidActiveTiles::makeSpans( SpanList &list, const std::vector<uint8_t> &map, bool isSet ) const
+{
+    list.spans.clear();
+    list.rowIdx.assign( (size_t)mBlocksY + 1, 0 );
+
+    auto isIn = [&]( int bx, int by ) { return (map[ bx + mBlocksX * by ] != 0) == isSet; };
+
+    for (int by=0; by < mBlocksY; ++by)
+    {
+        list.rowIdx[by] = (int)list.spans.size();
+
+        for (int bx=0; bx < mBlocksX; )
+        {
+            if ( !isIn( bx, by ) )
+            {
+                ++bx;
+                continue;
+            }
+            int bxEnd = bx + 1;
+            while ( bxEnd < mBlocksX && isIn( bxEnd, by ) )
+                ++bxEnd;
+
+            list.spans.push_back( { bx * BLOCK + 1, std::min( bxEnd * BLOCK, mNX ) } );
+            bx = bxEnd;
+        }
+    }
+    list.rowIdx[mBlocksY] = (int)list.spans.size();
+}
@@ -0,0 +1,129 @@
+//==================================================================
+/// FluidActiveTiles.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef FLUIDACTIVETILES_H
+#define FLUIDACTIVETILES_H
+
+#include <stdint.h>
+#include <vector>
+
+//==================================================================
+/// Map of the BLOCK x BLOCK cell blocks of a grid that hold fluid, so
+/// that the solver can skip the empty parts of the domain (see
+/// FluidSolverBase::SetSparse).
+/// Cells are marked, then Finalize() dilates the map and turns it into
+/// spans of consecutive active cells for each row of blocks, which is
+/// what the row kernels take. The gaps are the cells in between.
+/// A new map only needs to look at the blocks that may hold values:
+/// those active in the last one and those marked dirty since, by the
+/// writes from out of the steps.
+//==================================================================
+class FluidActiveTiles
+{
+public:
+    static const int BLOCK = 16;
+
+    // cells [i0,i1] of a row
+    struct Span
+    {
+        int i0;
+        int i1;
+    };
+
+    // runs of blocks of the same state, in cells. Those of the row of
+    //  blocks by start at rowIdx[by]
+    struct SpanList
+    {
+        std::vector<Span>   spans;
+        std::vector<int>    rowIdx;
+
+        template <typename F>
+        void ForEachInRow( int j, const F &fn ) const
+        {
+            const int by = (j-1) / BLOCK;
+            for (int k=rowIdx[by]; k < rowIdx[by+1]; ++k)
+                fn( spans[k].i0, spans[k].i1 );
+        }
+    };
+
+private:
+    int                     mNX {};
+    int                     mNY {};
+    int                     mBlocksX {};
+    int                     mBlocksY {};
+    int                     mActiveN {};
+
+    std::vector<uint8_t>    mMap;
+    std::vector<uint8_t>    mTmpMap;
+    // blocks that may hold values while making a map, and those written
+    //  since the last one
+    std::vector<uint8_t>    mHeldMap;
+    std::vector<uint8_t>    mDirtyMap;
+    std::vector<uint8_t>    mHaloMap;
+
+    SpanList                mSpans;
+    SpanList                mGaps;
+    SpanList                mStales;
+    SpanList                mHalos;
+
+public:
+    // cells [1,nx] x [1,ny], all inactive and all dirty
+    void Setup( int nx, int ny );
+
+    // cells of the padding mark the border blocks
+    int BlockX( int i ) const { return i <= 1 ? 0 : i > mNX ? mBlocksX-1 : (i-1) / BLOCK; }
+    int BlockY( int j ) const { return j <= 1 ? 0 : j > mNY ? mBlocksY-1 : (j-1) / BLOCK; }
+
+    // blocks of the cells [i0,i1] x [j0,j1], written out of the steps
+    void MarkDirty( int i0, int i1, int j0, int j1 );
+    void MarkAllDirty();
+
+    // starts a new map with no marked blocks, from the last one and the
+    //  dirty blocks
+    void BeginMap();
+    bool MayHoldValues( int bx, int by ) const { return mHeldMap[ bx + mBlocksX * by ] != 0; }
+    // the blocks that may hold values stay so for the next map, for
+    //  steps that leave some of the fields out
+    void KeepHeld();
+
+    bool IsMarked( int bx, int by ) const { return mMap[ bx + mBlocksX * by ] != 0; }
+    void Mark( int bx, int by ) { mMap[ bx + mBlocksX * by ] = 1; }
+
+    // adds the blocks within radiusN blocks of a marked one, and makes
+    //  the spans
+    void Finalize( int radiusN );
+
+    int GetBlocksX() const { return mBlocksX; }
+    int GetBlocksY() const { return mBlocksY; }
+    int GetActiveN() const { return mActiveN; }
+    bool IsAllActive() const { return mActiveN == mBlocksX * mBlocksY; }
+
+    // fn( i0, i1 ) for the active cells of row j, j in [1,NY]
+    template <typename F>
+    void ForEachSpan( int j, const F &fn ) const { mSpans.ForEachInRow( j, fn ); }
+
+    // fn( i0, i1 ) for the inactive cells of row j
+    template <typename F>
+    void ForEachGap( int j, const F &fn ) const { mGaps.ForEachInRow( j, fn ); }
+
+    // fn( i0, i1 ) for the inactive cells of row j that may hold values
+    template <typename F>
+    void ForEachStale( int j, const F &fn ) const { mStales.ForEachInRow( j, fn ); }
+
+    // fn( i0, i1 ) for the inactive cells of row j within the radius of
+    //  Finalize() of the active ones, as far as a step reads
+    template <typename F>
+    void ForEachHalo( int j, const F &fn ) const { mHalos.ForEachInRow( j, fn ); }
+
+private:
+    void dilate( std::vector<uint8_t> &dst, const std::vector<uint8_t> &src, int radiusN );
+    void makeSpans( SpanList &list, const std::vector<uint8_t> &map, bool isSet ) const;
+};
+
+#endif
+
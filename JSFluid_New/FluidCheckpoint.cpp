@@ -0,0 +1,380 @@
+//==================================================================
+/// FluidCheckpoint.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <stdio.h>
+#include <string.h>
+#include <filesystem>
+#include <system_error>
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+#include "FluidSolver.h"
+#include "FluidCheckpoint.h"
+
+static_assert( FluidCheckpointHeader::SCALARS_MAX == FluidSolverBase::SCALARS_MAX );
+
+//==================================================================
+namespace
+{
+
+//==================================================================
+/// Read-only mapping of a whole file
+//==================================================================
+class MappedFile
+{
+    const uint8_t   *mpData {};
+    size_t          mSize {};
+#if defined(_WIN32)
+    HANDLE          mhFile = INVALID_HANDLE_VALUE;
+    HANDLE          mhMapping {};
+#endif
+
+public:
+    MappedFile() = default;
+    MappedFile( const MappedFile & ) = delete;
+    MappedFile &operator=( const MappedFile & ) = delete;
+
+    ~MappedFile()
+    {
+#if defined(_WIN32)
+        if ( mpData ) UnmapViewOfFile( mpData );
+        if ( mhMapping ) CloseHandle( mhMapping );
+        if ( mhFile != INVALID_HANDLE_VALUE ) CloseHandle( mhFile );
+#else
+        if ( mpData ) munmap( (void *)mpData, mSize );
+#endif
+    }
+
+    bool Open( const char *pFName )
+    {
+#if defined(_WIN32)
+        mhFile = CreateFileA( pFName, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+        LARGE_INTEGER size {};
+        if ( mhFile == INVALID_HANDLE_VALUE || !GetFileSizeEx( mhFile, &size ) || !size.QuadPart )
+            return false;
+
+        mhMapping = CreateFileMappingA( mhFile, nullptr, PAGE_READONLY, 0, 0, nullptr );
+        if ( !mhMapping )
+            return false;
+
+        mpData = (const uint8_t *)MapViewOfFile( mhMapping, FILE_MAP_READ, 0, 0, 0 );
+        mSize = (size_t)size.QuadPart;
+#else
+        const int fd = open( pFName, O_RDONLY );
+        if ( fd < 0 )
+            return false;
+
+        // the mapping holds on to the file once made
+        struct stat st {};
+        if ( fstat( fd, &st ) == 0 && st.st_size > 0 )
+        {
+            auto *p = mmap( nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if ( p != MAP_FAILED )
+            {
+                mpData = (const uint8_t *)p;
+                mSize = (size_t)st.st_size;
+                // all of it is about to be read
+                posix_madvise( p, mSize, POSIX_MADV_WILLNEED );
+            }
+        }
+        close( fd );
+#endif
+        return mpData != nullptr;
+    }
+
+    const uint8_t *GetData() const { return mpData; }
+    size_t GetSize() const { return mSize; }
+};
+
+//==================================================================
+uint64_t alignUp( uint64_t x )
+{
+    return (x + FLUID_ALIGN-1) & ~(uint64_t)(FLUID_ALIGN-1);
+}
+
+//==================================================================
+bool writeCheckpoint(
+        const char *pFName,
+        const FluidCheckpointHeader &hdr,
+        const std::vector<FluidCheckpointBlock> &blocks,
+        const uint8_t *const *ppBlocksData )
+{
+    const auto tmpFName = std::string( pFName ) + ".tmp";
+
+    FILE *pFile = fopen( tmpFName.c_str(), "wb" );
+    if ( !pFile )
+        return false;
+
+    bool ok = fwrite( &hdr, sizeof(hdr), 1, pFile ) == 1 &&
+              fwrite( blocks.data(), sizeof(blocks[0]), blocks.size(), pFile ) == blocks.size();
+
+    // zeros up to the start of each block
+    static const uint8_t PAD[FLUID_ALIGN] {};
+    uint64_t pos = hdr.headerSize + blocks.size() * sizeof(blocks[0]);
+    for (size_t i=0; i < blocks.size() && ok; ++i)
+    {
+        const auto &b = blocks[i];
+        const auto padN = (size_t)(b.offset - pos);
+        ok = fwrite( PAD, 1, padN, pFile ) == padN &&
+             fwrite( ppBlocksData[i], 1, (size_t)b.size, pFile ) == (size_t)b.size;
+        pos = b.offset + b.size;
+    }
+
+    ok = fclose( pFile ) == 0 && ok;
+
+    std::error_code ec;
+    if ( ok )
+        std::filesystem::rename( tmpFName, pFName, ec );
+
+    if ( !ok || ec )
+    {
+        std::filesystem::remove( tmpFName, ec );
+        return false;
+    }
+    return true;
+}
+
+}
+
+//==================================================================
+void FluidSolverBase::getCheckpoint(
+        FluidCheckpointHeader &hdr,
+        std::vector<FluidCheckpointBlock> &blocks,
+        std::vector<const uint8_t *> &blocksData ) const
+{
+    hdr = {};
+    hdr.nx          = mNX;
+    hdr.ny          = mNY;
+    hdr.gridLayout  = (uint32_t)mGridLayout;
+    hdr.scalStorage = (uint32_t)mScalStorage;
+    hdr.policy      = mPolicy;
+    hdr.doBound     = mDoBound;
+    hdr.scalarsN    = GetScalarsN();
+    hdr.scalScale   = mScalScale;
+    hdr.openSides   = mOpenSides;
+    hdr.invH        = mInvH;
+    for (int c=0; c < hdr.scalarsN; ++c)
+        hdr.scalDiffSca[c] = GetScalarDiffusionScale( c );
+
+    blocks.clear();
+    blocksData.clear();
+    auto addBlock = [&]( FluidCheckpointBlock::Grid grid, int field, const void *p, size_t size )
+    {
+        FluidCheckpointBlock b;
+        b.field = (uint32_t)field;
+        b.grid  = grid;
+        b.size  = size;
+        blocks.push_back( b );
+        blocksData.push_back( (const uint8_t *)p );
+    };
+
+    for (int f=FIELD_VEL0; f < FIELD_DEN; ++f)
+        addBlock( FluidCheckpointBlock::GRID_SOLVER, f, getField( (Field)f ),
+                  mCurVel[0].size() * sizeof(float) );
+
+    // the channels here are unused with a scalar grid
+    const auto grid = moScalGrid ? FluidCheckpointBlock::GRID_SCALARS
+                                 : FluidCheckpointBlock::GRID_SOLVER;
+    const auto &scals = moScalGrid ? moScalGrid->mCurScal : mCurScal;
+    for (size_t c=0; c < scals.size(); ++c)
+        addBlock( grid, FIELD_DEN + (int)c, scals[c].data(), scals[c].size() );
+
+    // after the table, each on its own boundary
+    hdr.blocksN = (uint32_t)blocks.size();
+    uint64_t pos = hdr.headerSize + blocks.size() * sizeof(blocks[0]);
+    for (auto &b : blocks)
+    {
+        b.offset = alignUp( pos );
+        pos = b.offset + b.size;
+    }
+}
+
+//==================================================================
+bool FluidSolverBase::SaveCheckpoint( const char *pFName ) const
+{
+    FLUID_TRACE_SCOPE( "SaveCheckpoint" );
+
+    if ( mIsStepPending )
+        return false;
+
+    FluidCheckpointHeader hdr;
+    std::vector<FluidCheckpointBlock> blocks;
+    std::vector<const uint8_t *> blocksData;
+    getCheckpoint( hdr, blocks, blocksData );
+
+    return writeCheckpoint( pFName, hdr, blocks, blocksData.data() );
+}
+
+//==================================================================
+std::future<bool> FluidSolverBase::SaveCheckpointAsync( std::string fname ) const
+{
+    FLUID_TRACE_SCOPE( "SaveCheckpointAsync" );
+
+    auto failed = []()
+    {
+        std::promise<bool> prom;
+        prom.set_value( false );
+        return prom.get_future();
+    };
+
+    if ( mIsStepPending )
+        return failed();
+
+    FluidCheckpointHeader hdr;
+    std::vector<FluidCheckpointBlock> blocks;
+    std::vector<const uint8_t *> blocksData;
+    getCheckpoint( hdr, blocks, blocksData );
+
+    // the blocks as they'll be in the file, from the first one on. Left
+    //  uninitialized, as a FluidBuffer would clear it first
+    const auto base = blocks[0].offset;
+    const auto imageSize = (size_t)(blocks.back().offset + blocks.back().size - base);
+    std::shared_ptr<uint8_t> oImage( (uint8_t *)FluidAlignedAlloc( imageSize ), FluidAlignedFree );
+    if ( !oImage )
+        return failed();
+
+    for (size_t i=0; i < blocks.size(); ++i)
+        memcpy( oImage.get() + (blocks[i].offset - base), blocksData[i], (size_t)blocks[i].size );
+
+    return std::async( std::launch::async,
+        [fname=std::move(fname), hdr, blocks=std::move(blocks), oImage, base]()
+        {
+            std::vector<const uint8_t *> imageData;
+            for (const auto &b : blocks)
+                imageData.push_back( oImage.get() + (b.offset - base) );
+
+            return writeCheckpoint( fname.c_str(), hdr, blocks, imageData.data() );
+        });
+}
+
+//==================================================================
+bool FluidSolverBase::LoadCheckpoint( const char *pFName )
+{
+    FLUID_TRACE_SCOPE( "LoadCheckpoint" );
+
+    MappedFile file;
+    if ( !file.Open( pFName ) || file.GetSize() < sizeof(FluidCheckpointHeader) )
+        return false;
+
+    FluidCheckpointHeader hdr;
+    memcpy( &hdr, file.GetData(), sizeof(hdr) );
+
+    if ( hdr.magic != FluidCheckpointHeader::MAGIC ||
+         hdr.version != FluidCheckpointHeader::VERSION ||
+         hdr.headerSize != sizeof(hdr) )
+        return false;
+
+    // the solver has to be of the same kind, its type being fixed
+    if ( hdr.nx != mNX || hdr.ny != mNY ||
+         hdr.gridLayout != (uint32_t)mGridLayout ||
+         hdr.scalStorage != (uint32_t)mScalStorage ||
+         hdr.policy != mPolicy ||
+         hdr.doBound != (uint32_t)mDoBound )
+        return false;
+
+    // a scalar grid is only for solvers without open sides
+    if ( hdr.scalarsN < 1 || hdr.scalarsN > SCALARS_MAX || hdr.scalScale < 1 ||
+         (hdr.scalScale > 1 && hdr.openSides) )
+        return false;
+
+    const auto fileSize = (uint64_t)file.GetSize();
+    const auto tableEnd = (uint64_t)hdr.headerSize + (uint64_t)hdr.blocksN * sizeof(FluidCheckpointBlock);
+    if ( tableEnd > fileSize )
+        return false;
+
+    std::vector<FluidCheckpointBlock> blocks( hdr.blocksN );
+    memcpy( blocks.data(), file.GetData() + hdr.headerSize, blocks.size() * sizeof(blocks[0]) );
+
+    for (const auto &b : blocks)
+    {
+        if ( b.offset % FLUID_ALIGN || b.offset < tableEnd ||
+             b.size > fileSize || b.offset > fileSize - b.size )
+            return false;
+    }
+
+    // the blocks of the file have to be the fields that this will have
+    //  with its channels and scale, in the same order. Checked before
+    //  any change, for a file turned down to leave this as it was
+    std::vector<FluidCheckpointBlock> expBlocks;
+    auto addExpected = [&]( FluidCheckpointBlock::Grid grid, int field, size_t size )
+    {
+        FluidCheckpointBlock b;
+        b.field = (uint32_t)field;
+        b.grid  = grid;
+        b.size  = size;
+        expBlocks.push_back( b );
+    };
+
+    for (int f=FIELD_VEL0; f < FIELD_DEN; ++f)
+        addExpected( FluidCheckpointBlock::GRID_SOLVER, f, mCurVel[0].size() * sizeof(float) );
+
+    const auto scalGrid = hdr.scalScale > 1 ? FluidCheckpointBlock::GRID_SCALARS
+                                            : FluidCheckpointBlock::GRID_SOLVER;
+    const auto scalSize = hdr.scalScale > 1
+            ? FluidLayoutCellsN( mGridLayout, mNX * hdr.scalScale, mNY * hdr.scalScale ) *
+                    FluidStorageCellSize( mScalStorage )
+            : scalarFieldSize();
+    for (int c=0; c < hdr.scalarsN; ++c)
+        addExpected( scalGrid, FIELD_DEN + c, scalSize );
+
+    bool isMatch = expBlocks.size() == blocks.size();
+    for (size_t i=0; i < blocks.size() && isMatch; ++i)
+    {
+        isMatch = blocks[i].field == expBlocks[i].field &&
+                  blocks[i].grid  == expBlocks[i].grid &&
+                  blocks[i].size  == expBlocks[i].size;
+    }
+
+    if ( !isMatch )
+        return false;
+
+    // the channels and the parameters of the file. The scale first, as
+    //  a scalar grid is only changed without open sides
+    mIsStepPending = false;
+    mInvH = hdr.invH;
+    if ( hdr.scalScale != mScalScale )
+    {
+        mOpenSides = 0;
+        SetScalarScale( hdr.scalScale );
+    }
+    mOpenSides = hdr.openSides;
+    if ( moScalGrid )
+        moScalGrid->mInvH = mInvH * (float)mScalScale;
+
+    SetScalarsN( hdr.scalarsN );
+    for (int c=0; c < hdr.scalarsN; ++c)
+        SetScalarDiffusionScale( c, hdr.scalDiffSca[c] );
+
+    FluidCheckpointHeader curHdr;
+    std::vector<FluidCheckpointBlock> curBlocks;
+    std::vector<const uint8_t *> curData;
+    getCheckpoint( curHdr, curBlocks, curData );
+    assert( curBlocks.size() == blocks.size() );
+
+    // the fields are this solver's, it's only the getter that is const.
+    //  Blocks go over the pool, so that the pages are read in parallel
+    auto copyBlocks = [&]( int begin, int end )
+    {
+        for (int i=begin; i < end; ++i)
+            memcpy( (uint8_t *)curData[i], file.GetData() + blocks[i].offset, (size_t)blocks[i].size );
+    };
+
+    if ( mpPool )
+        mpPool->ParallelFor( 0, (int)blocks.size(), copyBlocks );
+    else
+        copyBlocks( 0, (int)blocks.size() );
+
+    markAllDirty();
+    return true;
+}
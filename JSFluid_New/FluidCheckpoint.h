@@ -0,0 +1,70 @@
+//==================================================================
+/// FluidCheckpoint.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef FLUIDCHECKPOINT_H
+#define FLUIDCHECKPOINT_H
+
+#include <stdint.h>
+
+//==================================================================
+/// File format of FluidSolverBase::SaveCheckpoint().
+/// A FluidCheckpointHeader, the table of the blocks, then the blocks,
+/// each one being the cells of a field as they are in memory, in the
+/// storage order of the layout and the type of the storage, starting
+/// on a FLUID_ALIGN boundary. A restore is then a copy of each block
+/// from the mapped file, with nothing to convert.
+/// Values are in the byte order of the machine that wrote them, and
+/// so is the magic number, which turns down the files of the other
+/// order. A new version is made for any change of the layout below.
+//==================================================================
+struct FluidCheckpointHeader
+{
+    static const uint32_t MAGIC   = 0x4B434C46; // "FLCK" in a little endian file
+    static const uint32_t VERSION = 1;
+
+    static const int SCALARS_MAX = 16;
+
+    uint32_t    magic   = MAGIC;
+    uint32_t    version = VERSION;
+    // bytes of the header, for the table to follow
+    uint32_t    headerSize = sizeof(FluidCheckpointHeader);
+    uint32_t    blocksN {};
+
+    // the solver, which has to be of the same kind to restore into
+    int32_t     nx {};
+    int32_t     ny {};
+    uint32_t    gridLayout {};  // FluidLayout
+    uint32_t    scalStorage {}; // FluidStorage
+    uint32_t    policy {};      // mask of FluidSolverBase::Policy
+    uint32_t    doBound {};
+
+    // the parameters that go with the fields
+    int32_t     scalarsN {};
+    int32_t     scalScale {};
+    int32_t     openSides {};
+    float       invH {};
+    float       scalDiffSca[SCALARS_MAX] {};
+};
+
+//==================================================================
+struct FluidCheckpointBlock
+{
+    enum Grid : uint32_t
+    {
+        GRID_SOLVER,    // the fields of the solver
+        GRID_SCALARS,   // the scalars of its scalar grid, if any
+    };
+
+    uint32_t    field {};   // FluidSolverBase::Field
+    uint32_t    grid {};
+    // from the start of the file, a multiple of FLUID_ALIGN
+    uint64_t    offset {};
+    uint64_t    size {};
+};
+
+#endif
@@ -0,0 +1,228 @@
+//==================================================================
+/// FluidDomain.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <assert.h>
+#include "FluidDomain.h"
+
+using FSB = FluidSolverBase;
+
+//==================================================================
+FluidDomain::FluidDomain(
+        int tilesX, int tilesY, int tileNX, int tileNY, bool doBound, unsigned policy,
+        FluidStorage scalStorage )
+    : mTilesX(tilesX)
+    , mTilesY(tilesY)
+    , mTileNX(tileNX)
+    , mTileNY(tileNY)
+{
+    assert( tilesX > 0 && tilesY > 0 );
+
+    for (int ty=0; ty < mTilesY; ++ty)
+    {
+        for (int tx=0; tx < mTilesX; ++tx)
+        {
+            auto oTile = CreateFluidSolver( tileNX, tileNY, doBound, policy, scalStorage );
+
+            int open = 0;
+            if ( tx > 0         ) open |= FSB::SIDE_LEFT;
+            if ( tx < mTilesX-1 ) open |= FSB::SIDE_RIGHT;
+            if ( ty > 0         ) open |= FSB::SIDE_BOTTOM;
+            if ( ty < mTilesY-1 ) open |= FSB::SIDE_TOP;
+            oTile->SetOpenSides( open );
+            oTile->SetDomainSize( GetNX(), GetNY() );
+
+            moTiles.push_back( std::move( oTile ) );
+        }
+    }
+}
+
+//==================================================================
+void FluidDomain::SetThreadPool( ThreadPool *pPool )
+{
+    mpPool = pPool;
+    for (auto &oTile : moTiles)
+        oTile->SetThreadPool( pPool );
+}
+
+//==================================================================
+void FluidDomain::Clear()
+{
+    mSlicedTileIdx = -1;
+    for (auto &oTile : moTiles)
+        oTile->Clear();
+}
+
+//==================================================================
+void FluidDomain::SetScalarsN( int n )
+{
+    for (auto &oTile : moTiles)
+        oTile->SetScalarsN( n );
+}
+
+//==================================================================
+template <typename F>
+void FluidDomain::forEachTile( const F &fn )
+{
+    auto doRange = [&]( int begin, int end )
+    {
+        for (int idx=begin; idx < end; ++idx)
+            fn( idx % mTilesX, idx / mTilesX );
+    };
+
+    // a tile's own ParallelFor() runs serially inside this one
+    if ( mpPool )
+        mpPool->ParallelFor( 0, (int)moTiles.size(), doRange );
+    else
+        doRange( 0, (int)moTiles.size() );
+}
+
+//==================================================================
+void FluidDomain::exchangeHalos( const FSB::Field *pFields, int fieldsN )
+{
+    FLUID_TRACE_SCOPE( "exchangeHalos" );
+
+    const int NX = mTileNX;
+    const int NY = mTileNY;
+
+    // each tile pulls the edges of its neighbors into its own ghost
+    //  cells. Only interior cells are read, so tiles don't race
+    forEachTile( [&]( int tx, int ty )
+    {
+        auto &t = GetTile( tx, ty );
+
+        std::vector<float> buff( (size_t)std::max( NX, NY ) );
+        auto *pBuff = buff.data();
+
+        const bool hasL = tx > 0;
+        const bool hasR = tx < mTilesX-1;
+        const bool hasB = ty > 0;
+        const bool hasT = ty < mTilesY-1;
+
+        for (int k=0; k < fieldsN; ++k)
+        {
+            const auto f = pFields[k];
+
+            // cells [si0,si1] x [sj0,sj1] of the neighbor to the same
+            //  size block at (di0,dj0) of this tile
+            auto pull = [&]( int ntx, int nty, int si0, int si1, int sj0, int sj1, int di0, int dj0 )
+            {
+                GetTile( ntx, nty ).CopyCellsOut( f, si0, si1, sj0, sj1, pBuff );
+                t.CopyCellsIn( f, di0, di0 + si1-si0, dj0, dj0 + sj1-sj0, pBuff );
+            };
+
+            if ( hasL ) pull( tx-1, ty  , NX, NX, 1 , NY, 0   , 1    );
+            if ( hasR ) pull( tx+1, ty  , 1 , 1 , 1 , NY, NX+1, 1    );
+            if ( hasB ) pull( tx  , ty-1, 1 , NX, NY, NY, 1   , 0    );
+            if ( hasT ) pull( tx  , ty+1, 1 , NX, 1 , 1 , 1   , NY+1 );
+
+            // corners, only sampled by the advection
+            if ( hasL && hasB ) pull( tx-1, ty-1, NX, NX, NY, NY, 0   , 0    );
+            if ( hasR && hasB ) pull( tx+1, ty-1, 1 , 1 , NY, NY, NX+1, 0    );
+            if ( hasL && hasT ) pull( tx-1, ty+1, NX, NX, 1 , 1 , 0   , NY+1 );
+            if ( hasR && hasT ) pull( tx+1, ty+1, 1 , 1 , 1 , 1 , NX+1, NY+1 );
+        }
+    });
+}
+
+//==================================================================
+void FluidDomain::applyEvents( const FluidEvent *pEvents, size_t eventsN )
+{
+    FLUID_TRACE_SCOPE( "applyEvents" );
+
+    // every tile takes all the events in its own cells, and drops
+    //  the splats out of them
+    for (int ty=0; ty < mTilesY; ++ty)
+    {
+        for (int tx=0; tx < mTilesX; ++tx)
+        {
+            mSplats.clear();
+            for (size_t k=0; k < eventsN; ++k)
+            {
+                const auto &e = pEvents[k];
+
+                FluidSolverBase::Splat s;
+                s.pos[0]    = e.pos[0] - (float)(tx * mTileNX);
+                s.pos[1]    = e.pos[1] - (float)(ty * mTileNY);
+                s.radius    = e.radius;
+                s.falloff   = e.falloff;
+                s.target    = e.type == FluidEvent::TYPE_FORCE
+                                ? FluidSolverBase::Splat::TARGET_VELOCITY
+                                : e.channel;
+                s.amount[0] = e.amount[0];
+                s.amount[1] = e.amount[1];
+                mSplats.push_back( s );
+            }
+            GetTile( tx, ty ).AddSplats( mSplats.data(), mSplats.size() );
+        }
+    }
+}
+
+//==================================================================
+void FluidDomain::beginStep()
+{
+    // all the events pushed so far, taken at once to free the queue
+    if ( mpEventQueue )
+    {
+        mEvents.clear();
+        mpEventQueue->PopAll( [&]( const FluidEvent &e ) { mEvents.push_back( e ); } );
+        applyEvents( mEvents.data(), mEvents.size() );
+    }
+
+    // a single exchange, as the tiles advect velocity and scalars in
+    //  the same pass
+    FSB::Field fields[4 + FSB::SCALARS_MAX] =
+    {
+        FSB::FIELD_VEL0, FSB::FIELD_VEL1, FSB::FIELD_PRE0, FSB::FIELD_PRE1
+    };
+    int fieldsN = 4;
+    for (int c=0; c < GetScalarsN(); ++c)
+        fields[fieldsN++] = (FSB::Field)(FSB::FIELD_DEN + c);
+
+    exchangeHalos( fields, fieldsN );
+}
+
+//==================================================================
+void FluidDomain::Step( float visc, float diff, float dt )
+{
+    FLUID_TRACE_SCOPE( "FluidDomain::Step" );
+
+    while ( IsStepPending() )
+        StepSliced( visc, diff, dt, FSB::StepClock::time_point() );
+
+    beginStep();
+
+    forEachTile( [&]( int tx, int ty ) { GetTile( tx, ty ).Step( visc, diff, dt ); } );
+}
+
+//==================================================================
+bool FluidDomain::StepSliced( float visc, float diff, float dt, FSB::StepClock::time_point deadline )
+{
+    FLUID_TRACE_SCOPE( "FluidDomain::StepSliced" );
+
+    if ( !IsStepPending() )
+    {
+        beginStep();
+        mSlicedTileIdx = 0;
+    }
+
+    // the tiles have open sides, so each one's step only reads its own
+    //  ghost cells, filled at the start
+    const int tilesN = (int)moTiles.size();
+    while ( mSlicedTileIdx < tilesN )
+    {
+        if ( !moTiles[ mSlicedTileIdx ]->StepSliced( visc, diff, dt, deadline ) )
+            return false;
+
+        if ( ++mSlicedTileIdx < tilesN && FSB::StepClock::now() >= deadline )
+            return false;
+    }
+
+    mSlicedTileIdx = -1;
+    return true;
+}
+
@@ -0,0 +1,170 @@
+//==================================================================
+/// FluidDomain.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef FLUIDDOMAIN_H
+#define FLUIDDOMAIN_H
+
+#include <memory>
+#include <vector>
+#include "FluidSolver.h"
+#include "SPSCQueue.h"
+
+//==================================================================
+/// Source of a scalar or force on the velocity, from another thread
+/// than the stepping one, see FluidDomain::SetEventQueue()
+//==================================================================
+struct FluidEvent
+{
+    enum Type : int
+    {
+        TYPE_SOURCE,    // amount[0] to the scalar channel
+        TYPE_FORCE,     // amount[0], amount[1] to the velocity
+    };
+
+    Type    type    = TYPE_SOURCE;
+    int     channel = 0;
+    // in cells of the domain, cell (i,j) covering [i-1,i) x [j-1,j)
+    float   pos[2] {};
+    // cells with the center within it, or only the one at pos if zero
+    float   radius  = 0;
+    // see FluidSolverBase::Splat
+    float   falloff = 0;
+    float   amount[2] {};
+    // of the producer, in seconds, for it to order or drop events
+    double  timestamp = 0;
+};
+
+using FluidEventQueue = SPSCQueue<FluidEvent>;
+
+//==================================================================
+/// A grid of solver tiles that behave as one domain.
+/// The sides between tiles are open: before each step the ghost
+/// cells of every tile are filled from the edges of its neighbors,
+/// so that fluid crosses from one tile to the next. The outer sides
+/// are the domain walls, handled by the tiles as usual.
+/// The halo is one cell wide, so the crossing is seamless as long as
+/// the flow moves less than a cell per step. The pressure of a tile
+/// sees the neighbors' one of the previous step.
+/// Tiles are stepped concurrently on the thread pool, each with its
+/// own workspace.
+//==================================================================
+class FluidDomain
+{
+    const int   mTilesX;
+    const int   mTilesY;
+    const int   mTileNX;
+    const int   mTileNY;
+
+    std::vector<std::unique_ptr<FluidSolverBase>> moTiles;
+
+    ThreadPool  *mpPool {};
+
+    FluidEventQueue         *mpEventQueue {};
+    std::vector<FluidEvent> mEvents;
+    std::vector<FluidSolverBase::Splat> mSplats;
+
+    // tile of the pending StepSliced(), -1 if none
+    int                     mSlicedTileIdx = -1;
+
+public:
+    // policy is a mask of FluidSolverBase::Policy, for all the tiles,
+    //  as is the type of the scalars
+    FluidDomain( int tilesX, int tilesY, int tileNX, int tileNY, bool doBound,
+                 unsigned policy=0, FluidStorage scalStorage=FLUIDSTORAGE_F32 );
+
+    int GetTilesX() const { return mTilesX; }
+    int GetTilesY() const { return mTilesY; }
+    int GetTileNX() const { return mTileNX; }
+    int GetTileNY() const { return mTileNY; }
+
+    // size of the whole domain, in cells
+    int GetNX() const { return mTilesX * mTileNX; }
+    int GetNY() const { return mTilesY * mTileNY; }
+
+          FluidSolverBase &GetTile( int tx, int ty )       { return *moTiles[ tx + mTilesX * ty ]; }
+    const FluidSolverBase &GetTile( int tx, int ty ) const { return *moTiles[ tx + mTilesX * ty ]; }
+
+    // also used by the tiles, where it runs serially
+    void SetThreadPool( ThreadPool *pPool );
+
+    void Clear();
+
+    // FluidSolverBase::SetScalarsN() of all the tiles
+    void SetScalarsN( int n );
+    int GetScalarsN() const { return moTiles[0]->GetScalarsN(); }
+
+    // cells of the whole domain, with i in [1,GetNX()], j in [1,GetNY()]
+    template <int DIM_IDX>
+    float &SMPVel( int i, int j )
+    {
+        const auto [t, li, lj] = findTile( i, j );
+        return t.template SMPVel<DIM_IDX>( li, lj );
+    }
+    FluidCellRef SMPDen( int i, int j )
+    {
+        const auto [t, li, lj] = findTile( i, j );
+        return t.SMPDen( li, lj );
+    }
+    FluidCellRef SMPScalar( int ch, int i, int j )
+    {
+        const auto [t, li, lj] = findTile( i, j );
+        return t.SMPScalar( ch, li, lj );
+    }
+    // with FLUIDSTORAGE_F32 only, see FluidSolverBase::SMPScalarF32()
+    float &SMPDenF32( int i, int j )
+    {
+        const auto [t, li, lj] = findTile( i, j );
+        return t.SMPDenF32( li, lj );
+    }
+    float &SMPScalarF32( int ch, int i, int j )
+    {
+        const auto [t, li, lj] = findTile( i, j );
+        return t.SMPScalarF32( ch, li, lj );
+    }
+
+    // events pushed by another thread, the stepping thread being the
+    //  consumer. They are drained at the start of each Step(), before
+    //  the halos are exchanged, and splatted in one batch
+    void SetEventQueue( FluidEventQueue *pQueue ) { mpEventQueue = pQueue; }
+
+    // FluidSolverBase::Step() of all the tiles, after the pending
+    //  StepSliced() if any
+    void Step( float visc, float diff, float dt );
+
+    // Step() in slices, see FluidSolverBase::StepSliced(). The events
+    //  and the halos are taken when a step starts, then the tiles are
+    //  stepped one after the other, each over the pool
+    bool StepSliced( float visc, float diff, float dt,
+                     FluidSolverBase::StepClock::time_point deadline );
+    bool IsStepPending() const { return mSlicedTileIdx >= 0; }
+
+private:
+    struct TileCell
+    {
+        FluidSolverBase &tile;
+        int             i;
+        int             j;
+    };
+    TileCell findTile( int i, int j )
+    {
+        const int tx = std::min( (i-1) / mTileNX, mTilesX-1 );
+        const int ty = std::min( (j-1) / mTileNY, mTilesY-1 );
+        return { GetTile( tx, ty ), i - tx * mTileNX, j - ty * mTileNY };
+    }
+
+    // the events and the halos of a step
+    void beginStep();
+    void applyEvents( const FluidEvent *pEvents, size_t eventsN );
+    void exchangeHalos( const FluidSolverBase::Field *pFields, int fieldsN );
+
+    template <typename F>
+    void forEachTile( const F &fn );
+};
+
+#endif
+
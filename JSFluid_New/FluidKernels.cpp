@@ -0,0 +1,115 @@
+//==================================================================
+/// FluidKernels.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <stdlib.h>
+#include <string.h>
+#include "FluidKernels.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+# include <intrin.h>
+#endif
+
+//==================================================================
+namespace
+{
+struct VecScalar
+{
+    static const int W = 1;
+    // only named by the vector code, which isn't built for W == 1
+    using F = float;
+    using I = int;
+};
+
+#include "FluidKernelsImpl.h"
+}
+
+//==================================================================
+static FluidISA detectCPU_ISA()
+{
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx512f" ) )
+        return FLUIDISA_AVX512;
+
+    if ( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) &&
+         __builtin_cpu_supports( "f16c" ) )
+        return FLUIDISA_AVX2;
+
+    if ( __builtin_cpu_supports( "sse4.1" ) )
+        return FLUIDISA_SSE41;
+
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int info[4] {};
+    __cpuid( info, 1 );
+    const bool hasSSE41   = !!(info[2] & (1 << 19));
+    const bool hasFMA     = !!(info[2] & (1 << 12));
+    const bool hasOSXSAVE = !!(info[2] & (1 << 27));
+    const bool hasF16C    = !!(info[2] & (1 << 29));
+
+    __cpuidex( info, 7, 0 );
+    const bool hasAVX2    = !!(info[1] & (1 << 5));
+    const bool hasAVX512F = !!(info[1] & (1 << 16));
+
+    // the OS must save the YMM and ZMM registers too
+    const auto xcr0 = hasOSXSAVE ? _xgetbv( 0 ) : 0;
+    const bool osYMM = (xcr0 & 0x06) == 0x06;
+    const bool osZMM = (xcr0 & 0xe6) == 0xe6;
+
+    if ( hasAVX512F && osZMM )
+        return FLUIDISA_AVX512;
+
+    if ( hasAVX2 && hasFMA && hasF16C && osYMM )
+        return FLUIDISA_AVX2;
+
+    if ( hasSSE41 )
+        return FLUIDISA_SSE41;
+#endif
+
+    return FLUIDISA_SCALAR;
+}
+
+//==================================================================
+FluidISA DetectFluidISA()
+{
+    static const FluidISA sISA = []()
+    {
+        auto isa = detectCPU_ISA();
+
+        // JSFLUID_ISA=scalar|sse41|avx2|avx512 caps the choice, to
+        //  compare the kernel sets on the same machine
+        if ( const char *pEnv = getenv( "JSFLUID_ISA" ) )
+        {
+            static const char *names[FLUIDISA_N] = { "scalar", "sse41", "avx2", "avx512" };
+            for (int i=0; i < FLUIDISA_N; ++i)
+                if ( !strcmp( pEnv, names[i] ) && i < (int)isa )
+                    isa = (FluidISA)i;
+        }
+
+        // fall back to the best set that was built in
+        while ( isa != FLUIDISA_SCALAR && !GetFluidKernels( isa ) )
+            isa = (FluidISA)(isa - 1);
+
+        return isa;
+    }();
+
+    return sISA;
+}
+
+//==================================================================
+const FluidKernels *GetFluidKernels( FluidISA isa )
+{
+    switch ( isa )
+    {
+    case FLUIDISA_SCALAR: return KernelsImpl<VecScalar>::GetKernels( FLUIDISA_SCALAR, "scalar" );
+    case FLUIDISA_SSE41:  return GetFluidKernels_SSE41();
+    case FLUIDISA_AVX2:   return GetFluidKernels_AVX2();
+    case FLUIDISA_AVX512: return GetFluidKernels_AVX512();
+    default: return nullptr;
+    }
+}
+
@@ -0,0 +1,192 @@
+//==================================================================
+/// FluidKernels.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef FLUIDKERNELS_H
+#define FLUIDKERNELS_H
+
+#include <stdint.h>
+#include "GridLayout.h"
+
+// storage types of FluidStorage.h, which isn't included here so that
+//  its inline functions aren't built for the kernels' instruction sets
+struct FluidHalf;
+struct FluidBFloat16;
+
+//==================================================================
+/// Row kernels of the solver for grids with a linear layout, one set
+/// per instruction set. Fields are (nx+2) x (ny+2) padded, "stride"
+/// is the distance between rows and the kernels work on the cells
+/// [i0,i1] of row j.
+/// The *Tile kernels do the same for GridLayoutTiled, on the cells of
+/// a GridTileSpan, and the *Row3 ones for the 3D grids of
+/// FluidSolver3D, on the cells [i0,i1] of a FluidRow3.
+//==================================================================
+enum FluidISA : int
+{
+    FLUIDISA_SCALAR,
+    FLUIDISA_SSE41,
+    FLUIDISA_AVX2,      // AVX2 + FMA + F16C
+    FLUIDISA_AVX512,    // AVX-512F
+    FLUIDISA_N
+};
+
+// row (j,k) of an (nx+2) x (ny+2) x (nz+2) padded 3D grid
+struct FluidRow3
+{
+    int     strideY;    // distance of the rows
+    int     strideZ;    // distance of the planes
+    int     j;
+    int     k;
+
+    int Offset() const { return strideY * j + strideZ * k; }
+};
+
+// the kernels for fields stored as T, widened to float in registers.
+//  The velocity is always float
+template <typename T>
+struct FluidStorageKernels
+{
+    void (*RelaxRowRB)(
+            T *x, const T *x0, int stride, int j, int i0, int i1,
+            int color, float a, float ooc );
+
+    float (*RelaxRowRBDelta)(
+            T *x, const T *x0, int stride, int j, int i0, int i1,
+            int color, float a, float ooc );
+
+    void (*AdvectRowN)(
+            T *const *ppD, const T *const *ppD0, int fieldsN,
+            const float *u, const float *v,
+            int stride, int j, int i0, int i1,
+            float dt0, float maxX, float maxY );
+
+    void (*RelaxTileRB)(
+            T *x, const T *x0, const GridTileSpan &t,
+            int color, float a, float ooc );
+
+    float (*RelaxTileRBDelta)(
+            T *x, const T *x0, const GridTileSpan &t,
+            int color, float a, float ooc );
+
+    void (*AdvectTileN)(
+            T *const *ppD, const T *const *ppD0, int fieldsN,
+            const float *u, const float *v,
+            const GridTileSpan &t, int tilesX,
+            float dt0, float maxX, float maxY );
+
+    void (*SplatRunN)(
+            T *const *ppRuns, const float *pAmounts, int fieldsN, int n,
+            float dx0, float dy2, float invR2, float falloff );
+};
+
+struct FluidKernels
+{
+    FluidISA    isa;
+    const char  *pName;
+
+    // red-black relaxation of the cells of one color:
+    //  x = (x0 + a * (sum of the 4 neighbors of x)) * ooc
+    void (*RelaxRowRB)(
+            float *x, const float *x0, int stride, int j, int i0, int i1,
+            int color, float a, float ooc );
+
+    // as RelaxRowRB, also returning the largest change of a cell
+    float (*RelaxRowRBDelta)(
+            float *x, const float *x0, int stride, int j, int i0, int i1,
+            int color, float a, float ooc );
+
+    // div = sca * (u(i+1) - u(i-1) + v(j+1) - v(j-1))
+    void (*DivergenceRow)(
+            float *div, const float *u, const float *v, int stride, int j, int i0, int i1,
+            float sca );
+
+    // u -= sca * (p(i+1) - p(i-1)),  v -= sca * (p(j+1) - p(j-1))
+    void (*SubGradientRow)(
+            float *u, float *v, const float *p, int stride, int j, int i0, int i1,
+            float sca );
+
+    // semi-Lagrangian bilinear fetch of d0, back along (u,v) * dt0,
+    //  with the trace clamped to [0.5, maxX] x [0.5, maxY].
+    //  The trace is shared by the fieldsN pairs of ppD and ppD0
+    void (*AdvectRowN)(
+            float *const *ppD, const float *const *ppD0, int fieldsN,
+            const float *u, const float *v,
+            int stride, int j, int i0, int i1,
+            float dt0, float maxX, float maxY );
+
+    // the row kernels above for GridLayoutTiled. AdvectTileN fetches
+    //  from the tiles of a grid tilesX tiles wide
+    void (*RelaxTileRB)(
+            float *x, const float *x0, const GridTileSpan &t,
+            int color, float a, float ooc );
+
+    float (*RelaxTileRBDelta)(
+            float *x, const float *x0, const GridTileSpan &t,
+            int color, float a, float ooc );
+
+    void (*DivergenceTile)(
+            float *div, const float *u, const float *v, const GridTileSpan &t,
+            float sca );
+
+    void (*SubGradientTile)(
+            float *u, float *v, const float *p, const GridTileSpan &t,
+            float sca );
+
+    void (*AdvectTileN)(
+            float *const *ppD, const float *const *ppD0, int fieldsN,
+            const float *u, const float *v,
+            const GridTileSpan &t, int tilesX,
+            float dt0, float maxX, float maxY );
+
+    // the row kernels above for 3D grids, with the 6 neighbors of the
+    //  7-point stencil and the trilinear fetch of AdvectRow3N
+    void (*RelaxRow3RB)(
+            float *x, const float *x0, const FluidRow3 &r, int i0, int i1,
+            int color, float a, float ooc );
+
+    void (*DivergenceRow3)(
+            float *div, const float *u, const float *v, const float *w,
+            const FluidRow3 &r, int i0, int i1, float sca );
+
+    void (*SubGradientRow3)(
+            float *u, float *v, float *w, const float *p,
+            const FluidRow3 &r, int i0, int i1, float sca );
+
+    void (*AdvectRow3N)(
+            float *const *ppD, const float *const *ppD0, int fieldsN,
+            const float *u, const float *v, const float *w,
+            const FluidRow3 &r, int i0, int i1,
+            float dt0, float maxX, float maxY, float maxZ );
+
+    // a disc splatted on the runs of n contiguous cells of fieldsN
+    //  fields, the same cells of each: run[k] += amount of the field *
+    //  (1 - falloff * ((dx0 + k)^2 + dy2) * invR2). dx0 and dy2 are
+    //  from the center of the disc to the center of the first cell
+    void (*SplatRunN)(
+            float *const *ppRuns, const float *pAmounts, int fieldsN, int n,
+            float dx0, float dy2, float invR2, float falloff );
+
+    // the relaxation and advection kernels of the 16 bit storage types,
+    //  see FluidStorage.h
+    FluidStorageKernels<FluidHalf>      f16;
+    FluidStorageKernels<FluidBFloat16>  bf16;
+};
+
+// best instruction set supported by the running CPU
+FluidISA DetectFluidISA();
+
+// nullptr if the set isn't built into this binary
+const FluidKernels *GetFluidKernels( FluidISA isa );
+
+// also used by the per-ISA kernel sets
+const FluidKernels *GetFluidKernels_SSE41();
+const FluidKernels *GetFluidKernels_AVX2();
+const FluidKernels *GetFluidKernels_AVX512();
+
+#endif
+
@@ -0,0 +1,1143 @@
+//==================================================================
+/// FluidKernelsImpl.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+// Kernel bodies shared by all instruction sets. This is included by
+//  each FluidKernels*.cpp inside an anonymous namespace, after
+//  defining the vector traits class passed as VEC.
+//  No standard headers here, or their inline functions may get built
+//  for an instruction set that the CPU doesn't have.
+
+#ifndef FLUIDKERNELSIMPL_H
+#define FLUIDKERNELSIMPL_H
+
+//==================================================================
+template <typename VEC>
+struct KernelsImpl
+{
+    // W == 1 is the scalar set, which only runs the tail loops
+    static const int W = VEC::W;
+
+    //==================================================================
+    static inline float clampS( float x, float mi, float ma )
+    {
+        auto t = x < mi ? mi : x;
+        return t > ma ? ma : t;
+    }
+
+    //==================================================================
+    static inline float absS( float x ) { return x < 0 ? -x : x; }
+
+    //==================================================================
+    // 16 bit storage conversions of FluidStorage.h, built here for the
+    //  instruction set of the kernels
+    static inline uint32_t bitsS( float x )    { union { float f; uint32_t u; } c { x }; return c.u; }
+    static inline float floatS( uint32_t u )   { union { uint32_t u; float f; } c { u }; return c.f; }
+
+    static inline float halfToFloatS( uint32_t h )
+    {
+        uint32_t o = (h & 0x7fff) << 13;
+        const uint32_t e = o & 0x0f800000;
+        o += 0x38000000;
+        if ( e == 0x0f800000 )
+            o += 0x38000000;
+        else
+        if ( e == 0 )
+            o = bitsS( floatS( o + 0x00800000 ) - floatS( 0x38800000 ) );
+
+        return floatS( o | (h & 0x8000) << 16 );
+    }
+
+    static inline uint16_t floatToHalfS( float x )
+    {
+        uint32_t u = bitsS( x );
+        const uint32_t sign = u & 0x80000000;
+        u ^= sign;
+
+        uint32_t o;
+        if ( u > 0x477fffff )
+            o = u > 0x7f800000 ? 0x7e00 : 0x7c00;
+        else
+        if ( u < 0x38800000 )
+            o = bitsS( floatS( u ) + floatS( 0x3f000000 ) ) - 0x3f000000;
+        else
+            o = (u + 0xc8000fff + ((u >> 13) & 1)) >> 13;
+
+        return (uint16_t)(o | sign >> 16);
+    }
+
+    static inline uint16_t floatToBFloat16S( float x )
+    {
+        const uint32_t u = bitsS( x );
+        if ( (u & 0x7fffffff) > 0x7f800000 )
+            return (uint16_t)((u >> 16) | 0x40);
+
+        return (uint16_t)((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+    }
+
+    // the same on vectors, with the 16 bits in the low half of the lanes.
+    //  Sets with F16C convert halves natively
+    static typename VEC::F halfToFloatV( typename VEC::I h )
+    {
+        if constexpr ( VEC::HAS_F16C )
+            return VEC::cvtph( h );
+
+        const auto o = VEC::template isll<13>( VEC::iand( h, VEC::iset1( 0x7fff ) ) );
+        const auto e = VEC::iand( o, VEC::iset1( 0x0f800000 ) );
+
+        auto r = VEC::iadd( o, VEC::iset1( 0x38000000 ) );
+        r = VEC::iblend( r, VEC::iadd( r, VEC::iset1( 0x38000000 ) ),
+                         VEC::icmpeq( e, VEC::iset1( 0x0f800000 ) ) );
+
+        const auto dn = VEC::asI( VEC::sub( VEC::asF( VEC::iadd( r, VEC::iset1( 0x00800000 ) ) ),
+                                            VEC::asF( VEC::iset1( 0x38800000 ) ) ) );
+        r = VEC::iblend( r, dn, VEC::icmpeq( e, VEC::iset1( 0 ) ) );
+
+        return VEC::asF( VEC::ior( r, VEC::template isll<16>( VEC::iand( h, VEC::iset1( 0x8000 ) ) ) ) );
+    }
+
+    static typename VEC::I floatToHalfV( typename VEC::F x )
+    {
+        const auto sign = VEC::iand( VEC::asI( x ), VEC::iset1( (int)0x80000000 ) );
+        const auto u = VEC::ixor( VEC::asI( x ), sign );
+
+        const auto nrm = VEC::template isrl<13>( VEC::iadd(
+                            VEC::iadd( u, VEC::iset1( (int)0xc8000fff ) ),
+                            VEC::iand( VEC::template isrl<13>( u ), VEC::iset1( 1 ) ) ) );
+
+        const auto den = VEC::isub( VEC::asI( VEC::add( VEC::asF( u ), VEC::asF( VEC::iset1( 0x3f000000 ) ) ) ),
+                                    VEC::iset1( 0x3f000000 ) );
+
+        const auto inf = VEC::iblend( VEC::iset1( 0x7c00 ), VEC::iset1( 0x7e00 ),
+                                      VEC::icmpgt( u, VEC::iset1( 0x7f800000 ) ) );
+
+        auto o = VEC::iblend( nrm, den, VEC::icmpgt( VEC::iset1( 0x38800000 ), u ) );
+        o = VEC::iblend( o, inf, VEC::icmpgt( u, VEC::iset1( 0x477fffff ) ) );
+
+        return VEC::ior( o, VEC::template isrl<16>( sign ) );
+    }
+
+    static typename VEC::I floatToBFloat16V( typename VEC::F x )
+    {
+        const auto u = VEC::asI( x );
+        const auto r = VEC::template isrl<16>( VEC::iadd( u, VEC::iadd( VEC::iset1( 0x7fff ),
+                            VEC::iand( VEC::template isrl<16>( u ), VEC::iset1( 1 ) ) ) ) );
+
+        const auto isNaN = VEC::icmpgt( VEC::iand( u, VEC::iset1( 0x7fffffff ) ), VEC::iset1( 0x7f800000 ) );
+        return VEC::iblend( r, VEC::ior( VEC::template isrl<16>( u ), VEC::iset1( 0x40 ) ), isNaN );
+    }
+
+    //==================================================================
+    // loads and stores of a storage type T, of raw type R.
+    //  gather2() fetches the cells at idx and idx+1.
+    //  loadFirst() and storeFirst() only touch the first n < W cells
+    struct CodecF32
+    {
+        using T = float;
+        using R = float;
+        static float get( const R *p, int i )                   { return p[i]; }
+        static void put( R *p, int i, float x )                 { p[i] = x; }
+        static typename VEC::F load( const R *p )               { return VEC::load( p ); }
+        static void store( R *p, typename VEC::F v )            { VEC::store( p, v ); }
+        static typename VEC::F loadFirst( const R *p, int n )   { return VEC::loadFirst( p, n ); }
+        static void storeFirst( R *p, typename VEC::F v, int n ) { VEC::storeFirst( p, v, n ); }
+        static void gather2( const R *p, typename VEC::I idx, typename VEC::F &d0, typename VEC::F &d1 )
+        {
+            d0 = VEC::gather( p    , idx );
+            d1 = VEC::gather( p + 1, idx );
+        }
+        static typename VEC::F gather( const R *p, typename VEC::I idx ) { return VEC::gather( p, idx ); }
+    };
+
+    // partial loads and stores of the 16 bit types, through a buffer
+    template <typename C>
+    struct CodecFirstU16
+    {
+        static typename VEC::F loadFirst( const uint16_t *p, int n )
+        {
+            uint16_t buff[W] {};
+            for (int c=0; c < n; ++c)
+                buff[c] = p[c];
+            return C::load( buff );
+        }
+        static void storeFirst( uint16_t *p, typename VEC::F v, int n )
+        {
+            uint16_t buff[W];
+            C::store( buff, v );
+            for (int c=0; c < n; ++c)
+                p[c] = buff[c];
+        }
+    };
+
+    struct CodecF16 : CodecFirstU16<CodecF16>
+    {
+        using T = FluidHalf;
+        using R = uint16_t;
+        static float get( const R *p, int i )                   { return halfToFloatS( p[i] ); }
+        static void put( R *p, int i, float x )                 { p[i] = floatToHalfS( x ); }
+        static typename VEC::F load( const R *p )
+        {
+            if constexpr ( VEC::HAS_F16C )
+                return VEC::loadph( p );
+            else
+                return halfToFloatV( VEC::loadU16( p ) );
+        }
+        static void store( R *p, typename VEC::F v )
+        {
+            if constexpr ( VEC::HAS_F16C )
+                VEC::storeph( p, v );
+            else
+                VEC::storeU16( p, floatToHalfV( v ) );
+        }
+        static void gather2( const R *p, typename VEC::I idx, typename VEC::F &d0, typename VEC::F &d1 )
+        {
+            // both cells in one 32 bit fetch
+            const auto g = VEC::gatherU32( p, idx );
+            d0 = halfToFloatV( VEC::iand( g, VEC::iset1( 0xffff ) ) );
+            d1 = halfToFloatV( VEC::template isrl<16>( g ) );
+        }
+        // the high half of the fetch from the cell before, which is
+        //  never past the end
+        static typename VEC::F gather( const R *p, typename VEC::I idx )
+        {
+            return halfToFloatV( VEC::template isrl<16>( VEC::gatherU32( p - 1, idx ) ) );
+        }
+    };
+
+    struct CodecBF16 : CodecFirstU16<CodecBF16>
+    {
+        using T = FluidBFloat16;
+        using R = uint16_t;
+        static float get( const R *p, int i )                   { return floatS( (uint32_t)p[i] << 16 ); }
+        static void put( R *p, int i, float x )                 { p[i] = floatToBFloat16S( x ); }
+        static typename VEC::F load( const R *p )
+        {
+            return VEC::asF( VEC::template isll<16>( VEC::loadU16( p ) ) );
+        }
+        static void store( R *p, typename VEC::F v )            { VEC::storeU16( p, floatToBFloat16V( v ) ); }
+        static void gather2( const R *p, typename VEC::I idx, typename VEC::F &d0, typename VEC::F &d1 )
+        {
+            const auto g = VEC::gatherU32( p, idx );
+            d0 = VEC::asF( VEC::template isll<16>( g ) );
+            d1 = VEC::asF( VEC::iand( g, VEC::iset1( (int)0xffff0000 ) ) );
+        }
+        static typename VEC::F gather( const R *p, typename VEC::I idx )
+        {
+            return VEC::asF( VEC::iand( VEC::gatherU32( p - 1, idx ), VEC::iset1( (int)0xffff0000 ) ) );
+        }
+    };
+
+    //==================================================================
+    template <typename C, bool DO_DELTA>
+    static float relaxRowRB(
+            typename C::T *x, const typename C::T *x0, int stride, int j, int i0, int i1,
+            int color, float a, float ooc )
+    {
+        auto *px  = (typename C::R *)x + stride * j;
+        const auto *px0 = (const typename C::R *)x0 + stride * j;
+
+        float maxDelta = 0;
+
+        int i = i0;
+        if constexpr ( W > 1 )
+        {
+            const auto va   = VEC::set1( a );
+            const auto vooc = VEC::set1( ooc );
+            const auto mask = VEC::laneParityMask( (color + i0 + j) & 1 );
+
+            auto vmaxDelta = VEC::set1( 0.f );
+
+            // all lanes are computed, only the ones of the color are kept.
+            //  Those read cells of the other color, which don't change in
+            //  this phase. The lanes of the other color read cells of the
+            //  color, which the rows of a neighboring band may be writing,
+            //  but are dropped by the blend, and the full store writes
+            //  them back with the values they were loaded with (also for
+            //  the 16 bit types, whose conversions are exact both ways).
+            //  So the other bands only ever see same-value rewrites of the
+            //  cells they read, which is cheaper than a masked store.
+            // The left neighbors of the next block are loaded before the
+            //  store, as loading them after it stalls on store forwarding
+            auto left = i + W-1 <= i1 ? C::load( px + i - 1 ) : VEC::set1( 0.f );
+            for (; i + W-1 <= i1; i += W)
+            {
+                const auto cur  = C::load( px + i );
+                const auto sum  = VEC::add( VEC::add( VEC::add(
+                                        left,
+                                        C::load( px + i + 1      ) ),
+                                        C::load( px + i - stride ) ),
+                                        C::load( px + i + stride ) );
+                // (not past the row end, which may be the end of the grid)
+                const auto next = i + 2*W-1 <= i1 ? C::load( px + i + W-1 ) : cur;
+
+                const auto nx = VEC::mul( VEC::madd( va, sum, C::load( px0 + i ) ), vooc );
+                const auto res = VEC::blend( cur, nx, mask );
+
+                // the lanes of the other color don't change
+                if constexpr ( DO_DELTA )
+                    vmaxDelta = VEC::max( vmaxDelta, VEC::abs( VEC::sub( res, cur ) ) );
+
+                C::store( px + i, res );
+                left = next;
+            }
+
+            if constexpr ( DO_DELTA )
+                maxDelta = VEC::hmax( vmaxDelta );
+        }
+
+        for (i += ((i + j + color) & 1); i <= i1; i += 2)
+        {
+            const float nx = (C::get( px0, i ) + a * (C::get( px, i-1 ) + C::get( px, i+1 ) +
+                                                      C::get( px, i-stride ) + C::get( px, i+stride ))) * ooc;
+
+            if constexpr ( DO_DELTA )
+            {
+                const float d = absS( nx - C::get( px, i ) );
+                maxDelta = d > maxDelta ? d : maxDelta;
+            }
+            C::put( px, i, nx );
+        }
+
+        return maxDelta;
+    }
+
+    template <typename C>
+    static void RelaxRowRB(
+            typename C::T *x, const typename C::T *x0, int stride, int j, int i0, int i1,
+            int color, float a, float ooc )
+    {
+        relaxRowRB<C,false>( x, x0, stride, j, i0, i1, color, a, ooc );
+    }
+
+    template <typename C>
+    static float RelaxRowRBDelta(
+            typename C::T *x, const typename C::T *x0, int stride, int j, int i0, int i1,
+            int color, float a, float ooc )
+    {
+        return relaxRowRB<C,true>( x, x0, stride, j, i0, i1, color, a, ooc );
+    }
+
+    //==================================================================
+    static void DivergenceRow(
+            float *div, const float *u, const float *v, int stride, int j, int i0, int i1,
+            float sca )
+    {
+        auto *pd = div + stride * j;
+        const auto *pu = u + stride * j;
+        const auto *pv = v + stride * j;
+
+        int i = i0;
+        if constexpr ( W > 1 )
+        {
+            const auto vsca = VEC::set1( sca );
+
+            for (; i + W-1 <= i1; i += W)
+            {
+                const auto dx = VEC::sub( VEC::load( pu + i + 1      ), VEC::load( pu + i - 1      ) );
+                const auto dy = VEC::sub( VEC::load( pv + i + stride ), VEC::load( pv + i - stride ) );
+                VEC::store( pd + i, VEC::mul( vsca, VEC::add( dx, dy ) ) );
+            }
+        }
+
+        for (; i <= i1; ++i)
+            pd[i] = sca * ((pu[i+1] - pu[i-1]) + (pv[i+stride] - pv[i-stride]));
+    }
+
+    //==================================================================
+    static void SubGradientRow(
+            float *u, float *v, const float *p, int stride, int j, int i0, int i1,
+            float sca )
+    {
+        auto *pu = u + stride * j;
+        auto *pv = v + stride * j;
+        const auto *pp = p + stride * j;
+
+        int i = i0;
+        if constexpr ( W > 1 )
+        {
+            const auto vsca = VEC::set1( sca );
+
+            for (; i + W-1 <= i1; i += W)
+            {
+                const auto gx = VEC::sub( VEC::load( pp + i + 1      ), VEC::load( pp + i - 1      ) );
+                const auto gy = VEC::sub( VEC::load( pp + i + stride ), VEC::load( pp + i - stride ) );
+                VEC::store( pu + i, VEC::sub( VEC::load( pu + i ), VEC::mul( vsca, gx ) ) );
+                VEC::store( pv + i, VEC::sub( VEC::load( pv + i ), VEC::mul( vsca, gy ) ) );
+            }
+        }
+
+        for (; i <= i1; ++i)
+        {
+            pu[i] -= sca * (pp[i+1     ] - pp[i-1     ]);
+            pv[i] -= sca * (pp[i+stride] - pp[i-stride]);
+        }
+    }
+
+    //==================================================================
+    template <typename C>
+    static void AdvectRowN(
+            typename C::T *const *ppD, const typename C::T *const *ppD0, int fieldsN,
+            const float *u, const float *v,
+            int stride, int j, int i0, int i1,
+            float dt0, float maxX, float maxY )
+    {
+        const int rowOff = stride * j;
+        const auto *pu = u + rowOff;
+        const auto *pv = v + rowOff;
+
+        int i = i0;
+        if constexpr ( W > 1 )
+        {
+            const auto vdt0  = VEC::set1( dt0 );
+            const auto vhalf = VEC::set1( 0.5f );
+            const auto vone  = VEC::set1( 1.f );
+            const auto vmaxX = VEC::set1( maxX );
+            const auto vmaxY = VEC::set1( maxY );
+            const auto vj    = VEC::set1( (float)j );
+            const auto vstr  = VEC::iset1( stride );
+            const auto viota = VEC::iota();
+
+            for (; i + W-1 <= i1; i += W)
+            {
+                const auto vi = VEC::add( viota, VEC::set1( (float)i ) );
+
+                auto x = VEC::sub( vi, VEC::mul( vdt0, VEC::load( pu + i ) ) );
+                auto y = VEC::sub( vj, VEC::mul( vdt0, VEC::load( pv + i ) ) );
+
+                x = VEC::min( VEC::max( x, vhalf ), vmaxX );
+                y = VEC::min( VEC::max( y, vhalf ), vmaxY );
+
+                // positive, so truncation is floor
+                const auto xi = VEC::cvtt( x );
+                const auto yi = VEC::cvtt( y );
+
+                const auto s1 = VEC::sub( x, VEC::cvt( xi ) );
+                const auto s0 = VEC::sub( vone, s1 );
+                const auto t1 = VEC::sub( y, VEC::cvt( yi ) );
+                const auto t0 = VEC::sub( vone, t1 );
+
+                const auto idx00 = VEC::iadd( xi, VEC::imul( yi, vstr ) );
+                const auto idx01 = VEC::iadd( idx00, vstr );
+
+                // the same trace and weights for all the fields
+                for (int f=0; f < fieldsN; ++f)
+                {
+                    const auto *d0 = (const typename C::R *)ppD0[f];
+
+                    typename VEC::F d00, d10, d01, d11;
+                    C::gather2( d0, idx00, d00, d10 );
+                    C::gather2( d0, idx01, d01, d11 );
+
+                    const auto r = VEC::add(
+                            VEC::mul( s0, VEC::madd( t0, d00, VEC::mul( t1, d01 ) ) ),
+                            VEC::mul( s1, VEC::madd( t0, d10, VEC::mul( t1, d11 ) ) ) );
+
+                    C::store( (typename C::R *)ppD[f] + rowOff + i, r );
+                }
+            }
+        }
+
+        for (; i <= i1; ++i)
+        {
+            const float x = clampS( i - dt0 * pu[i], 0.5f, maxX );
+            const float y = clampS( j - dt0 * pv[i], 0.5f, maxY );
+
+            const int xi = (int)x;
+            const int yi = (int)y;
+
+            const float s1 = x - xi;
+            const float s0 = 1 - s1;
+            const float t1 = y - yi;
+            const float t0 = 1 - t1;
+
+            const int idx = xi + stride * yi;
+
+            for (int f=0; f < fieldsN; ++f)
+            {
+                const auto *p00 = (const typename C::R *)ppD0[f] + idx;
+
+                C::put( (typename C::R *)ppD[f], rowOff + i,
+                        s0 * (t0 * C::get( p00, 0 ) + t1 * C::get( p00, stride   )) +
+                        s1 * (t0 * C::get( p00, 1 ) + t1 * C::get( p00, stride+1 )) );
+            }
+        }
+    }
+
+    //==================================================================
+    // Tile kernels of GridLayoutTiled. The rows of a tile are the rows
+    //  above and below each other, but for the first and the last, whose
+    //  neighbors are in the tiles below and above. The cells on the
+    //  sides of a row are in the tiles on the sides at c = 0 and TILE-1,
+    //  the vector code loads past them and then swaps in the right ones
+    static const int TILE = GridTileSpan::TILE;
+
+    template <typename R>
+    struct TileRow
+    {
+        R   *p;     // row r of the tile
+        R   *pN;    // the rows at j+1 and j-1
+        R   *pS;
+
+        TileRow( R *f, const GridTileSpan &t, int r )
+            : p ( f + t.off + r * TILE )
+            , pN( r < TILE-1 ? p + TILE : f + t.offN )
+            , pS( r > 0      ? p - TILE : f + t.offS + (TILE-1) * TILE )
+        {
+        }
+    };
+
+    // the cells at c0-1 and c1+1 of row r, when in the tiles on the sides
+    template <typename C>
+    static float tileW( const typename C::R *f, const GridTileSpan &t, int r )
+    {
+        return t.c0 == 0 ? C::get( f + t.offW + r * TILE, TILE-1 ) : 0.f;
+    }
+    template <typename C>
+    static float tileE( const typename C::R *f, const GridTileSpan &t, int r )
+    {
+        return t.c1 == TILE-1 ? C::get( f + t.offE + r * TILE, 0 ) : 0.f;
+    }
+
+    // the vectors at c-1 and c+1 of a row, with the cells of the
+    //  tiles on the sides
+    static typename VEC::F fixW( typename VEC::F left, int c, float w )
+    {
+        return c == 0 ? VEC::blend( left, VEC::set1( w ), VEC::laneMask( 0 ) ) : left;
+    }
+    static typename VEC::F fixE( typename VEC::F right, int c, float e )
+    {
+        return c + W == TILE ? VEC::blend( right, VEC::set1( e ), VEC::laneMask( W-1 ) ) : right;
+    }
+
+    //==================================================================
+    template <typename C, bool DO_DELTA>
+    static float relaxTileRB(
+            typename C::T *x, const typename C::T *x0, const GridTileSpan &t,
+            int color, float a, float ooc )
+    {
+        using R = typename C::R;
+
+        float maxDelta = 0;
+        for (int r=t.r0; r <= t.r1; ++r)
+        {
+            const int j = t.j + r;
+            const TileRow<R> row( (R *)x, t, r );
+            const auto *px0 = (const R *)x0 + t.off + r * TILE;
+            const float w = tileW<C>( (const R *)x, t, r );
+            const float e = tileE<C>( (const R *)x, t, r );
+
+            int c = t.c0;
+            if constexpr ( W > 1 )
+            {
+                const auto va   = VEC::set1( a );
+                const auto vooc = VEC::set1( ooc );
+                const auto mask = VEC::laneParityMask( (color + t.i + c + j) & 1 );
+
+                auto vmaxDelta = VEC::set1( 0.f );
+
+                // as in relaxRowRB. At the start of the tile row the left
+                //  neighbors come from the row itself, as loading them
+                //  would stall on the store of the row before
+                auto left = c > 0 && c + W-1 <= t.c1 ? C::load( row.p + c - 1 ) : VEC::set1( 0.f );
+                for (; c + W-1 <= t.c1; c += W)
+                {
+                    const auto cur  = C::load( row.p + c );
+                    if ( c == 0 )
+                        left = VEC::shiftIn( cur, w );
+
+                    const auto sum  = VEC::add( VEC::add( VEC::add(
+                                            left,
+                                            fixE( C::load( row.p + c + 1 ), c, e ) ),
+                                            C::load( row.pS + c ) ),
+                                            C::load( row.pN + c ) );
+                    const auto next = c + 2*W-1 <= t.c1 ? C::load( row.p + c + W-1 ) : cur;
+
+                    const auto nx = VEC::mul( VEC::madd( va, sum, C::load( px0 + c ) ), vooc );
+                    const auto res = VEC::blend( cur, nx, mask );
+
+                    if constexpr ( DO_DELTA )
+                        vmaxDelta = VEC::max( vmaxDelta, VEC::abs( VEC::sub( res, cur ) ) );
+
+                    C::store( row.p + c, res );
+                    left = next;
+                }
+
+                if constexpr ( DO_DELTA )
+                {
+                    const float d = VEC::hmax( vmaxDelta );
+                    maxDelta = d > maxDelta ? d : maxDelta;
+                }
+            }
+
+            for (c += ((t.i + c + j + color) & 1); c <= t.c1; c += 2)
+            {
+                const float l  = c > 0      ? C::get( row.p, c-1 ) : w;
+                const float rr = c < TILE-1 ? C::get( row.p, c+1 ) : e;
+                const float nx = (C::get( px0, c ) + a * (l + rr +
+                                                          C::get( row.pS, c ) + C::get( row.pN, c ))) * ooc;
+
+                if constexpr ( DO_DELTA )
+                {
+                    const float d = absS( nx - C::get( row.p, c ) );
+                    maxDelta = d > maxDelta ? d : maxDelta;
+                }
+                C::put( row.p, c, nx );
+            }
+        }
+
+        return maxDelta;
+    }
+
+    template <typename C>
+    static void RelaxTileRB(
+            typename C::T *x, const typename C::T *x0, const GridTileSpan &t,
+            int color, float a, float ooc )
+    {
+        relaxTileRB<C,false>( x, x0, t, color, a, ooc );
+    }
+
+    template <typename C>
+    static float RelaxTileRBDelta(
+            typename C::T *x, const typename C::T *x0, const GridTileSpan &t,
+            int color, float a, float ooc )
+    {
+        return relaxTileRB<C,true>( x, x0, t, color, a, ooc );
+    }
+
+    //==================================================================
+    static void DivergenceTile(
+            float *div, const float *u, const float *v, const GridTileSpan &t,
+            float sca )
+    {
+        for (int r=t.r0; r <= t.r1; ++r)
+        {
+            auto *pd = div + t.off + r * TILE;
+            const auto *pu = u + t.off + r * TILE;
+            const TileRow<const float> rowV( v, t, r );
+            const float uW = tileW<CodecF32>( u, t, r );
+            const float uE = tileE<CodecF32>( u, t, r );
+
+            int c = t.c0;
+            if constexpr ( W > 1 )
+            {
+                const auto vsca = VEC::set1( sca );
+
+                for (; c + W-1 <= t.c1; c += W)
+                {
+                    const auto dx = VEC::sub( fixE( VEC::load( pu + c + 1 ), c, uE ),
+                                              fixW( VEC::load( pu + c - 1 ), c, uW ) );
+                    const auto dy = VEC::sub( VEC::load( rowV.pN + c ), VEC::load( rowV.pS + c ) );
+                    VEC::store( pd + c, VEC::mul( vsca, VEC::add( dx, dy ) ) );
+                }
+            }
+
+            for (; c <= t.c1; ++c)
+            {
+                const float l  = c > 0      ? pu[c-1] : uW;
+                const float rr = c < TILE-1 ? pu[c+1] : uE;
+                pd[c] = sca * ((rr - l) + (rowV.pN[c] - rowV.pS[c]));
+            }
+        }
+    }
+
+    //==================================================================
+    static void SubGradientTile(
+            float *u, float *v, const float *p, const GridTileSpan &t,
+            float sca )
+    {
+        for (int r=t.r0; r <= t.r1; ++r)
+        {
+            auto *pu = u + t.off + r * TILE;
+            auto *pv = v + t.off + r * TILE;
+            const TileRow<const float> rowP( p, t, r );
+            const float pW = tileW<CodecF32>( p, t, r );
+            const float pE = tileE<CodecF32>( p, t, r );
+
+            int c = t.c0;
+            if constexpr ( W > 1 )
+            {
+                const auto vsca = VEC::set1( sca );
+
+                for (; c + W-1 <= t.c1; c += W)
+                {
+                    const auto gx = VEC::sub( fixE( VEC::load( rowP.p + c + 1 ), c, pE ),
+                                              fixW( VEC::load( rowP.p + c - 1 ), c, pW ) );
+                    const auto gy = VEC::sub( VEC::load( rowP.pN + c ), VEC::load( rowP.pS + c ) );
+                    VEC::store( pu + c, VEC::sub( VEC::load( pu + c ), VEC::mul( vsca, gx ) ) );
+                    VEC::store( pv + c, VEC::sub( VEC::load( pv + c ), VEC::mul( vsca, gy ) ) );
+                }
+            }
+
+            for (; c <= t.c1; ++c)
+            {
+                const float l  = c > 0      ? rowP.p[c-1] : pW;
+                const float rr = c < TILE-1 ? rowP.p[c+1] : pE;
+                pu[c] -= sca * (rr - l);
+                pv[c] -= sca * (rowP.pN[c] - rowP.pS[c]);
+            }
+        }
+    }
+
+    //==================================================================
+    template <typename C>
+    static void AdvectTileN(
+            typename C::T *const *ppD, const typename C::T *const *ppD0, int fieldsN,
+            const float *u, const float *v,
+            const GridTileSpan &t, int tilesX,
+            float dt0, float maxX, float maxY )
+    {
+        const int S   = GridTileSpan::TILE_SHIFT;
+        const int ORG = GridTileSpan::ORG;
+
+        for (int r=t.r0; r <= t.r1; ++r)
+        {
+            const int j = t.j + r;
+            const int rowOff = t.off + r * TILE;
+            const auto *pu = u + rowOff;
+            const auto *pv = v + rowOff;
+
+            int c = t.c0;
+            if constexpr ( W > 1 )
+            {
+                const auto vdt0  = VEC::set1( dt0 );
+                const auto vhalf = VEC::set1( 0.5f );
+                const auto vone  = VEC::set1( 1.f );
+                const auto vmaxX = VEC::set1( maxX );
+                const auto vmaxY = VEC::set1( maxY );
+                const auto vj    = VEC::set1( (float)j );
+                const auto viota = VEC::iota();
+                const auto vorg  = VEC::iset1( ORG );
+                const auto vione = VEC::iset1( 1 );
+                const auto vmask = VEC::iset1( TILE-1 );
+                const auto vtilesX = VEC::iset1( tilesX );
+
+                // the index is the sum of a part of the row and one of the
+                //  column, of the cell's coordinates + ORG
+                auto rowPart = [&]( typename VEC::I y )
+                {
+                    return VEC::iadd( VEC::template isll<2*S>( VEC::imul( VEC::template isrl<S>( y ), vtilesX ) ),
+                                      VEC::template isll<S>( VEC::iand( y, vmask ) ) );
+                };
+                auto colPart = [&]( typename VEC::I x )
+                {
+                    return VEC::iadd( VEC::template isll<2*S>( VEC::template isrl<S>( x ) ),
+                                      VEC::iand( x, vmask ) );
+                };
+
+                for (; c + W-1 <= t.c1; c += W)
+                {
+                    const auto vi = VEC::add( viota, VEC::set1( (float)(t.i + c) ) );
+
+                    auto x = VEC::sub( vi, VEC::mul( vdt0, VEC::load( pu + c ) ) );
+                    auto y = VEC::sub( vj, VEC::mul( vdt0, VEC::load( pv + c ) ) );
+
+                    x = VEC::min( VEC::max( x, vhalf ), vmaxX );
+                    y = VEC::min( VEC::max( y, vhalf ), vmaxY );
+
+                    const auto xi = VEC::cvtt( x );
+                    const auto yi = VEC::cvtt( y );
+
+                    const auto s1 = VEC::sub( x, VEC::cvt( xi ) );
+                    const auto s0 = VEC::sub( vone, s1 );
+                    const auto t1 = VEC::sub( y, VEC::cvt( yi ) );
+                    const auto t0 = VEC::sub( vone, t1 );
+
+                    // i0 and i0+1 may be in different tiles, and so j0 and j0+1
+                    const auto x0 = VEC::iadd( xi, vorg );
+                    const auto y0 = VEC::iadd( yi, vorg );
+                    const auto col0 = colPart( x0 );
+                    const auto col1 = colPart( VEC::iadd( x0, vione ) );
+                    const auto row0 = rowPart( y0 );
+                    const auto row1 = rowPart( VEC::iadd( y0, vione ) );
+
+                    const auto idx00 = VEC::iadd( row0, col0 );
+                    const auto idx10 = VEC::iadd( row0, col1 );
+                    const auto idx01 = VEC::iadd( row1, col0 );
+                    const auto idx11 = VEC::iadd( row1, col1 );
+
+                    for (int f=0; f < fieldsN; ++f)
+                    {
+                        const auto *d0 = (const typename C::R *)ppD0[f];
+
+                        const auto d00 = C::gather( d0, idx00 );
+                        const auto d10 = C::gather( d0, idx10 );
+                        const auto d01 = C::gather( d0, idx01 );
+                        const auto d11 = C::gather( d0, idx11 );
+
+                        const auto res = VEC::add(
+                                VEC::mul( s0, VEC::madd( t0, d00, VEC::mul( t1, d01 ) ) ),
+                                VEC::mul( s1, VEC::madd( t0, d10, VEC::mul( t1, d11 ) ) ) );
+
+                        C::store( (typename C::R *)ppD[f] + rowOff + c, res );
+                    }
+                }
+            }
+
+            auto ix = [tilesX]( int x, int y )
+            {
+                return (((y >> S) * tilesX + (x >> S)) << (2*S)) + ((y & (TILE-1)) << S) + (x & (TILE-1));
+            };
+
+            for (; c <= t.c1; ++c)
+            {
+                const float x = clampS( (t.i + c) - dt0 * pu[c], 0.5f, maxX );
+                const float y = clampS( j - dt0 * pv[c], 0.5f, maxY );
+
+                const int xi = (int)x;
+                const int yi = (int)y;
+
+                const float s1 = x - xi;
+                const float s0 = 1 - s1;
+                const float t1 = y - yi;
+                const float t0 = 1 - t1;
+
+                const int idx00 = ix( xi + ORG    , yi + ORG     );
+                const int idx10 = ix( xi + ORG + 1, yi + ORG     );
+                const int idx01 = ix( xi + ORG    , yi + ORG + 1 );
+                const int idx11 = ix( xi + ORG + 1, yi + ORG + 1 );
+
+                for (int f=0; f < fieldsN; ++f)
+                {
+                    const auto *d0 = (const typename C::R *)ppD0[f];
+
+                    C::put( (typename C::R *)ppD[f], rowOff + c,
+                            s0 * (t0 * C::get( d0, idx00 ) + t1 * C::get( d0, idx01 )) +
+                            s1 * (t0 * C::get( d0, idx10 ) + t1 * C::get( d0, idx11 )) );
+                }
+            }
+        }
+    }
+
+    //==================================================================
+    // Row kernels of the 3D grids of FluidSolver3D. The color of a
+    //  cell goes by i + j + k, the rest is as in the 2D ones
+    static void RelaxRow3RB(
+            float *x, const float *x0, const FluidRow3 &r, int i0, int i1,
+            int color, float a, float ooc )
+    {
+        const int off = r.Offset();
+        const int sY  = r.strideY;
+        const int sZ  = r.strideZ;
+        const int jk  = r.j + r.k;
+
+        auto *px = x + off;
+        const auto *px0 = x0 + off;
+
+        int i = i0;
+        if constexpr ( W > 1 )
+        {
+            const auto va   = VEC::set1( a );
+            const auto vooc = VEC::set1( ooc );
+            const auto mask = VEC::laneParityMask( (color + i0 + jk) & 1 );
+
+            // as in relaxRowRB
+            auto left = i + W-1 <= i1 ? VEC::load( px + i - 1 ) : VEC::set1( 0.f );
+            for (; i + W-1 <= i1; i += W)
+            {
+                const auto cur = VEC::load( px + i );
+                const auto sum = VEC::add(
+                        VEC::add( left, VEC::load( px + i + 1 ) ),
+                        VEC::add( VEC::add( VEC::load( px + i - sY ), VEC::load( px + i + sY ) ),
+                                  VEC::add( VEC::load( px + i - sZ ), VEC::load( px + i + sZ ) ) ) );
+                const auto next = i + 2*W-1 <= i1 ? VEC::load( px + i + W-1 ) : cur;
+
+                const auto nx = VEC::mul( VEC::madd( va, sum, VEC::load( px0 + i ) ), vooc );
+
+                VEC::store( px + i, VEC::blend( cur, nx, mask ) );
+                left = next;
+            }
+        }
+
+        for (i += ((i + jk + color) & 1); i <= i1; i += 2)
+        {
+            px[i] = (px0[i] + a * (px[i-1 ] + px[i+1 ] +
+                                   px[i-sY] + px[i+sY] +
+                                   px[i-sZ] + px[i+sZ])) * ooc;
+        }
+    }
+
+    //==================================================================
+    static void DivergenceRow3(
+            float *div, const float *u, const float *v, const float *w,
+            const FluidRow3 &r, int i0, int i1, float sca )
+    {
+        const int off = r.Offset();
+        const int sY  = r.strideY;
+        const int sZ  = r.strideZ;
+
+        auto *pd = div + off;
+        const auto *pu = u + off;
+        const auto *pv = v + off;
+        const auto *pw = w + off;
+
+        int i = i0;
+        if constexpr ( W > 1 )
+        {
+            const auto vsca = VEC::set1( sca );
+
+            for (; i + W-1 <= i1; i += W)
+            {
+                const auto dx = VEC::sub( VEC::load( pu + i + 1  ), VEC::load( pu + i - 1  ) );
+                const auto dy = VEC::sub( VEC::load( pv + i + sY ), VEC::load( pv + i - sY ) );
+                const auto dz = VEC::sub( VEC::load( pw + i + sZ ), VEC::load( pw + i - sZ ) );
+                VEC::store( pd + i, VEC::mul( vsca, VEC::add( VEC::add( dx, dy ), dz ) ) );
+            }
+        }
+
+        for (; i <= i1; ++i)
+            pd[i] = sca * ((pu[i+1] - pu[i-1]) + (pv[i+sY] - pv[i-sY]) + (pw[i+sZ] - pw[i-sZ]));
+    }
+
+    //==================================================================
+    static void SubGradientRow3(
+            float *u, float *v, float *w, const float *p,
+            const FluidRow3 &r, int i0, int i1, float sca )
+    {
+        const int off = r.Offset();
+        const int sY  = r.strideY;
+        const int sZ  = r.strideZ;
+
+        auto *pu = u + off;
+        auto *pv = v + off;
+        auto *pw = w + off;
+        const auto *pp = p + off;
+
+        int i = i0;
+        if constexpr ( W > 1 )
+        {
+            const auto vsca = VEC::set1( sca );
+
+            for (; i + W-1 <= i1; i += W)
+            {
+                const auto gx = VEC::sub( VEC::load( pp + i + 1  ), VEC::load( pp + i - 1  ) );
+                const auto gy = VEC::sub( VEC::load( pp + i + sY ), VEC::load( pp + i - sY ) );
+                const auto gz = VEC::sub( VEC::load( pp + i + sZ ), VEC::load( pp + i - sZ ) );
+                VEC::store( pu + i, VEC::sub( VEC::load( pu + i ), VEC::mul( vsca, gx ) ) );
+                VEC::store( pv + i, VEC::sub( VEC::load( pv + i ), VEC::mul( vsca, gy ) ) );
+                VEC::store( pw + i, VEC::sub( VEC::load( pw + i ), VEC::mul( vsca, gz ) ) );
+            }
+        }
+
+        for (; i <= i1; ++i)
+        {
+            pu[i] -= sca * (pp[i+1 ] - pp[i-1 ]);
+            pv[i] -= sca * (pp[i+sY] - pp[i-sY]);
+            pw[i] -= sca * (pp[i+sZ] - pp[i-sZ]);
+        }
+    }
+
+    //==================================================================
+    static void AdvectRow3N(
+            float *const *ppD, const float *const *ppD0, int fieldsN,
+            const float *u, const float *v, const float *w,
+            const FluidRow3 &r, int i0, int i1,
+            float dt0, float maxX, float maxY, float maxZ )
+    {
+        const int off = r.Offset();
+        const int sY  = r.strideY;
+        const int sZ  = r.strideZ;
+
+        const auto *pu = u + off;
+        const auto *pv = v + off;
+        const auto *pw = w + off;
+
+        int i = i0;
+        if constexpr ( W > 1 )
+        {
+            const auto vdt0  = VEC::set1( dt0 );
+            const auto vhalf = VEC::set1( 0.5f );
+            const auto vone  = VEC::set1( 1.f );
+            const auto vmaxX = VEC::set1( maxX );
+            const auto vmaxY = VEC::set1( maxY );
+            const auto vmaxZ = VEC::set1( maxZ );
+            const auto vj    = VEC::set1( (float)r.j );
+            const auto vk    = VEC::set1( (float)r.k );
+            const auto vsY   = VEC::iset1( sY );
+            const auto vsZ   = VEC::iset1( sZ );
+            const auto viota = VEC::iota();
+
+            for (; i + W-1 <= i1; i += W)
+            {
+                const auto vi = VEC::add( viota, VEC::set1( (float)i ) );
+
+                auto x = VEC::sub( vi, VEC::mul( vdt0, VEC::load( pu + i ) ) );
+                auto y = VEC::sub( vj, VEC::mul( vdt0, VEC::load( pv + i ) ) );
+                auto z = VEC::sub( vk, VEC::mul( vdt0, VEC::load( pw + i ) ) );
+
+                x = VEC::min( VEC::max( x, vhalf ), vmaxX );
+                y = VEC::min( VEC::max( y, vhalf ), vmaxY );
+                z = VEC::min( VEC::max( z, vhalf ), vmaxZ );
+
+                const auto xi = VEC::cvtt( x );
+                const auto yi = VEC::cvtt( y );
+                const auto zi = VEC::cvtt( z );
+
+                const auto s1 = VEC::sub( x, VEC::cvt( xi ) );
+                const auto s0 = VEC::sub( vone, s1 );
+                const auto t1 = VEC::sub( y, VEC::cvt( yi ) );
+                const auto t0 = VEC::sub( vone, t1 );
+                const auto q1 = VEC::sub( z, VEC::cvt( zi ) );
+                const auto q0 = VEC::sub( vone, q1 );
+
+                // the 4 pairs of taps along x
+                const auto idx000 = VEC::iadd( xi, VEC::iadd( VEC::imul( yi, vsY ), VEC::imul( zi, vsZ ) ) );
+                const auto idx010 = VEC::iadd( idx000, vsY );
+                const auto idx001 = VEC::iadd( idx000, vsZ );
+                const auto idx011 = VEC::iadd( idx010, vsZ );
+
+                for (int f=0; f < fieldsN; ++f)
+                {
+                    const auto *d0 = ppD0[f];
+
+                    auto bilerp = [&]( typename VEC::I idx0, typename VEC::I idx1 )
+                    {
+                        typename VEC::F d00, d10, d01, d11;
+                        CodecF32::gather2( d0, idx0, d00, d10 );
+                        CodecF32::gather2( d0, idx1, d01, d11 );
+                        return VEC::add(
+                                VEC::mul( s0, VEC::madd( t0, d00, VEC::mul( t1, d01 ) ) ),
+                                VEC::mul( s1, VEC::madd( t0, d10, VEC::mul( t1, d11 ) ) ) );
+                    };
+
+                    const auto res = VEC::madd( q0, bilerp( idx000, idx010 ),
+                                                VEC::mul( q1, bilerp( idx001, idx011 ) ) );
+
+                    VEC::store( ppD[f] + off + i, res );
+                }
+            }
+        }
+
+        for (; i <= i1; ++i)
+        {
+            const float x = clampS( i   - dt0 * pu[i], 0.5f, maxX );
+            const float y = clampS( r.j - dt0 * pv[i], 0.5f, maxY );
+            const float z = clampS( r.k - dt0 * pw[i], 0.5f, maxZ );
+
+            const int xi = (int)x;
+            const int yi = (int)y;
+            const int zi = (int)z;
+
+            const float s1 = x - xi;
+            const float s0 = 1 - s1;
+            const float t1 = y - yi;
+            const float t0 = 1 - t1;
+            const float q1 = z - zi;
+            const float q0 = 1 - q1;
+
+            const int idx = xi + sY * yi + sZ * zi;
+
+            for (int f=0; f < fieldsN; ++f)
+            {
+                const auto *p0 = ppD0[f] + idx;
+                const auto *p1 = p0 + sZ;
+
+                ppD[f][off + i] =
+                    q0 * (s0 * (t0 * p0[0] + t1 * p0[sY  ]) + s1 * (t0 * p0[1] + t1 * p0[sY+1])) +
+                    q1 * (s0 * (t0 * p1[0] + t1 * p1[sY  ]) + s1 * (t0 * p1[1] + t1 * p1[sY+1]));
+            }
+        }
+    }
+
+    //==================================================================
+    template <typename C>
+    static void SplatRunN(
+            typename C::T *const *ppRuns, const float *pAmounts, int fieldsN, int n,
+            float dx0, float dy2, float invR2, float falloff )
+    {
+        using R = typename C::R;
+        const float sca = falloff * invR2;
+
+        int k = 0;
+        if constexpr ( W > 1 )
+        {
+            const auto vnsca = VEC::set1( -sca );
+            const auto vone  = VEC::set1( 1.f );
+            const auto vdy2  = VEC::set1( dy2 );
+            const auto vdx0  = VEC::add( VEC::iota(), VEC::set1( dx0 ) );
+
+            // 1 - sca * (dx^2 + dy^2), for the cells from k
+            auto weights = [&]( int k )
+            {
+                const auto dx = VEC::add( vdx0, VEC::set1( (float)k ) );
+                return VEC::madd( vnsca, VEC::madd( dx, dx, vdy2 ), vone );
+            };
+
+            // the same weights for all the fields
+            for (; k + W-1 < n; k += W)
+            {
+                const auto w = weights( k );
+                for (int f=0; f < fieldsN; ++f)
+                {
+                    auto *p = (R *)ppRuns[f] + k;
+                    C::store( p, VEC::madd( VEC::set1( pAmounts[f] ), w, C::load( p ) ) );
+                }
+            }
+
+            // the last cells with partial loads and stores, as the cells
+            //  past the run may be another thread's. Splat runs are
+            //  short, so this is most of a run, not a remainder
+            if ( k < n )
+            {
+                const int m = n - k;
+                const auto w = weights( k );
+                for (int f=0; f < fieldsN; ++f)
+                {
+                    auto *p = (R *)ppRuns[f] + k;
+                    C::storeFirst( p, VEC::madd( VEC::set1( pAmounts[f] ), w, C::loadFirst( p, m ) ), m );
+                }
+                k = n;
+            }
+        }
+
+        for (; k < n; ++k)
+        {
+            const float dx = dx0 + k;
+            const float w  = 1 - sca * (dx*dx + dy2);
+
+            for (int f=0; f < fieldsN; ++f)
+            {
+                auto *p = (R *)ppRuns[f];
+                C::put( p, k, C::get( p, k ) + pAmounts[f] * w );
+            }
+        }
+    }
+
+    //==================================================================
+    static const FluidKernels *GetKernels( FluidISA isa, const char *pName )
+    {
+        static const FluidKernels sKernels
+        {
+            isa,
+            pName,
+            RelaxRowRB<CodecF32>,
+            RelaxRowRBDelta<CodecF32>,
+            DivergenceRow,
+            SubGradientRow,
+            AdvectRowN<CodecF32>,
+            RelaxTileRB<CodecF32>,
+            RelaxTileRBDelta<CodecF32>,
+            DivergenceTile,
+            SubGradientTile,
+            AdvectTileN<CodecF32>,
+            RelaxRow3RB,
+            DivergenceRow3,
+            SubGradientRow3,
+            AdvectRow3N,
+            SplatRunN<CodecF32>,
+            { RelaxRowRB<CodecF16>,  RelaxRowRBDelta<CodecF16>,  AdvectRowN<CodecF16>,
+              RelaxTileRB<CodecF16>, RelaxTileRBDelta<CodecF16>, AdvectTileN<CodecF16>,
+              SplatRunN<CodecF16> },
+            { RelaxRowRB<CodecBF16>,  RelaxRowRBDelta<CodecBF16>,  AdvectRowN<CodecBF16>,
+              RelaxTileRB<CodecBF16>, RelaxTileRBDelta<CodecBF16>, AdvectTileN<CodecBF16>,
+              SplatRunN<CodecBF16> },
+        };
+        return &sKernels;
+    }
+};
+
+#endif
+
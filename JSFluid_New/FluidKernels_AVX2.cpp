@@ -0,0 +1,137 @@
+//==================================================================
+/// FluidKernels_AVX2.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+// built with AVX2, FMA and F16C enabled, see CMakeLists.txt
+
+#include "FluidKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+
+#include <immintrin.h>
+
+//==================================================================
+namespace
+{
+struct VecAVX2
+{
+    using F = __m256;
+    using I = __m256i;
+    using M = __m256;
+    static const int W = 8;
+
+    static F load( const float *p )         { return _mm256_loadu_ps( p ); }
+    static void store( float *p, F v )      { _mm256_storeu_ps( p, v ); }
+    // the first n < W lanes only, the memory past them isn't touched
+    static __m256i firstMask( int n )
+    {
+        return _mm256_cmpgt_epi32( _mm256_set1_epi32( n ), _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ) );
+    }
+    static F loadFirst( const float *p, int n )     { return _mm256_maskload_ps( p, firstMask( n ) ); }
+    static void storeFirst( float *p, F v, int n )  { _mm256_maskstore_ps( p, firstMask( n ), v ); }
+    static F set1( float x )                { return _mm256_set1_ps( x ); }
+    static F iota()                         { return _mm256_setr_ps( 0, 1, 2, 3, 4, 5, 6, 7 ); }
+    static F add( F a, F b )                { return _mm256_add_ps( a, b ); }
+    static F sub( F a, F b )                { return _mm256_sub_ps( a, b ); }
+    static F mul( F a, F b )                { return _mm256_mul_ps( a, b ); }
+    static F madd( F a, F b, F c )          { return _mm256_fmadd_ps( a, b, c ); }
+    static F min( F a, F b )                { return _mm256_min_ps( a, b ); }
+    static F max( F a, F b )                { return _mm256_max_ps( a, b ); }
+    static F abs( F a )                     { return _mm256_andnot_ps( _mm256_set1_ps( -0.f ), a ); }
+    static float hmax( F a )
+    {
+        auto h = _mm_max_ps( _mm256_castps256_ps128( a ), _mm256_extractf128_ps( a, 1 ) );
+        h = _mm_max_ps( h, _mm_movehl_ps( h, h ) );
+        h = _mm_max_ss( h, _mm_shuffle_ps( h, h, 1 ) );
+        return _mm_cvtss_f32( h );
+    }
+    static I cvtt( F a )                    { return _mm256_cvttps_epi32( a ); }
+    static F cvt( I a )                     { return _mm256_cvtepi32_ps( a ); }
+    static I iset1( int x )                 { return _mm256_set1_epi32( x ); }
+    static I iadd( I a, I b )               { return _mm256_add_epi32( a, b ); }
+    static I imul( I a, I b )               { return _mm256_mullo_epi32( a, b ); }
+    static F gather( const float *p, I idx ) { return _mm256_i32gather_ps( p, idx, 4 ); }
+
+    // lanes with (lane & 1) == parity
+    static M laneParityMask( int parity )
+    {
+        return parity ? _mm256_castsi256_ps( _mm256_setr_epi32( 0, -1, 0, -1, 0, -1, 0, -1 ) )
+                      : _mm256_castsi256_ps( _mm256_setr_epi32( -1, 0, -1, 0, -1, 0, -1, 0 ) );
+    }
+    static F blend( F a, F b, M m )         { return _mm256_blendv_ps( a, b, m ); }
+    // the lane only
+    static M laneMask( int lane )
+    {
+        return _mm256_castsi256_ps( _mm256_cmpeq_epi32( _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ),
+                                                        _mm256_set1_epi32( lane ) ) );
+    }
+    // x, then the lanes of a but the last
+    static F shiftIn( F a, float x )
+    {
+        const auto up = _mm256_permutevar8x32_ps( a, _mm256_setr_epi32( 0, 0, 1, 2, 3, 4, 5, 6 ) );
+        return _mm256_blend_ps( up, _mm256_set1_ps( x ), 1 );
+    }
+
+    // integer lanes, for the 16 bit storage types
+    using MI = __m256i;
+    static I iand( I a, I b )               { return _mm256_and_si256( a, b ); }
+    static I ior( I a, I b )                { return _mm256_or_si256( a, b ); }
+    static I ixor( I a, I b )               { return _mm256_xor_si256( a, b ); }
+    static I isub( I a, I b )               { return _mm256_sub_epi32( a, b ); }
+    template <int N> static I isll( I a )   { return _mm256_slli_epi32( a, N ); }
+    template <int N> static I isrl( I a )   { return _mm256_srli_epi32( a, N ); }
+    static MI icmpeq( I a, I b )            { return _mm256_cmpeq_epi32( a, b ); }
+    static MI icmpgt( I a, I b )            { return _mm256_cmpgt_epi32( a, b ); }
+    static I iblend( I a, I b, MI m )       { return _mm256_blendv_epi8( a, b, m ); }
+    static F asF( I a )                     { return _mm256_castsi256_ps( a ); }
+    static I asI( F a )                     { return _mm256_castps_si256( a ); }
+
+    // zero-extended, and the low 16 bits of the lanes
+    static I loadU16( const uint16_t *p )
+    {
+        return _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i *)p ) );
+    }
+    static void storeU16( uint16_t *p, I v )
+    {
+        // the pack works within 128 bit halves
+        const auto pk = _mm256_permute4x64_epi64( _mm256_packus_epi32( v, v ), 0x08 );
+        _mm_storeu_si128( (__m128i *)p, _mm256_castsi256_si128( pk ) );
+    }
+
+    // the 32 bits at p + idx
+    static I gatherU32( const uint16_t *p, I idx ) { return _mm256_i32gather_epi32( (const int *)p, idx, 2 ); }
+
+    // halves, rounded to nearest even
+    static const bool HAS_F16C = true;
+    static F loadph( const uint16_t *p )    { return _mm256_cvtph_ps( _mm_loadu_si128( (const __m128i *)p ) ); }
+    static void storeph( uint16_t *p, F v )
+    {
+        _mm_storeu_si128( (__m128i *)p, _mm256_cvtps_ph( v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) );
+    }
+    // of the low 16 bits of the lanes
+    static F cvtph( I h )
+    {
+        const auto pk = _mm256_permute4x64_epi64( _mm256_packus_epi32( h, h ), 0x08 );
+        return _mm256_cvtph_ps( _mm256_castsi256_si128( pk ) );
+    }
+};
+
+#include "FluidKernelsImpl.h"
+}
+
+//==================================================================
+const FluidKernels *GetFluidKernels_AVX2()
+{
+    return KernelsImpl<VecAVX2>::GetKernels( FLUIDISA_AVX2, "avx2" );
+}
+
+#else
+
+const FluidKernels *GetFluidKernels_AVX2() { return nullptr; }
+
+#endif
+
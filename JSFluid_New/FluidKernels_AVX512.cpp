@@ -0,0 +1,119 @@
+//==================================================================
+/// FluidKernels_AVX512.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+// built with AVX-512F enabled, see CMakeLists.txt
+
+#include "FluidKernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#include <immintrin.h>
+
+// GCC 12 flags the undefined passthrough operands of its own intrinsics
+#if defined(__GNUC__) && !defined(__clang__)
+# pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+# pragma GCC diagnostic ignored "-Wuninitialized"
+#endif
+
+//==================================================================
+namespace
+{
+struct VecAVX512
+{
+    using F = __m512;
+    using I = __m512i;
+    using M = __mmask16;
+    static const int W = 16;
+
+    static F load( const float *p )         { return _mm512_loadu_ps( p ); }
+    static void store( float *p, F v )      { _mm512_storeu_ps( p, v ); }
+    // the first n < W lanes only, the memory past them isn't touched
+    static F loadFirst( const float *p, int n )     { return _mm512_maskz_loadu_ps( (M)((1u << n) - 1), p ); }
+    static void storeFirst( float *p, F v, int n )  { _mm512_mask_storeu_ps( p, (M)((1u << n) - 1), v ); }
+    static F set1( float x )                { return _mm512_set1_ps( x ); }
+    static F iota()
+    {
+        return _mm512_setr_ps( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 );
+    }
+    static F add( F a, F b )                { return _mm512_add_ps( a, b ); }
+    static F sub( F a, F b )                { return _mm512_sub_ps( a, b ); }
+    static F mul( F a, F b )                { return _mm512_mul_ps( a, b ); }
+    static F madd( F a, F b, F c )          { return _mm512_fmadd_ps( a, b, c ); }
+    static F min( F a, F b )                { return _mm512_min_ps( a, b ); }
+    static F max( F a, F b )                { return _mm512_max_ps( a, b ); }
+    static F abs( F a )                     { return _mm512_abs_ps( a ); }
+    static float hmax( F a )                { return _mm512_reduce_max_ps( a ); }
+    static I cvtt( F a )                    { return _mm512_cvttps_epi32( a ); }
+    static F cvt( I a )                     { return _mm512_cvtepi32_ps( a ); }
+    static I iset1( int x )                 { return _mm512_set1_epi32( x ); }
+    static I iadd( I a, I b )               { return _mm512_add_epi32( a, b ); }
+    static I imul( I a, I b )               { return _mm512_mullo_epi32( a, b ); }
+    static F gather( const float *p, I idx ) { return _mm512_i32gather_ps( idx, p, 4 ); }
+
+    // lanes with (lane & 1) == parity
+    static M laneParityMask( int parity )   { return parity ? 0xAAAA : 0x5555; }
+    static F blend( F a, F b, M m )         { return _mm512_mask_blend_ps( m, a, b ); }
+    // the lane only
+    static M laneMask( int lane )           { return (M)(1u << lane); }
+    // x, then the lanes of a but the last
+    static F shiftIn( F a, float x )
+    {
+        return _mm512_castsi512_ps( _mm512_alignr_epi32( _mm512_castps_si512( a ),
+                                                         _mm512_castps_si512( _mm512_set1_ps( x ) ), 15 ) );
+    }
+
+    // integer lanes, for the 16 bit storage types
+    using MI = __mmask16;
+    static I iand( I a, I b )               { return _mm512_and_si512( a, b ); }
+    static I ior( I a, I b )                { return _mm512_or_si512( a, b ); }
+    static I ixor( I a, I b )               { return _mm512_xor_si512( a, b ); }
+    static I isub( I a, I b )               { return _mm512_sub_epi32( a, b ); }
+    template <int N> static I isll( I a )   { return _mm512_slli_epi32( a, N ); }
+    template <int N> static I isrl( I a )   { return _mm512_srli_epi32( a, N ); }
+    static MI icmpeq( I a, I b )            { return _mm512_cmpeq_epi32_mask( a, b ); }
+    static MI icmpgt( I a, I b )            { return _mm512_cmpgt_epi32_mask( a, b ); }
+    static I iblend( I a, I b, MI m )       { return _mm512_mask_blend_epi32( m, a, b ); }
+    static F asF( I a )                     { return _mm512_castsi512_ps( a ); }
+    static I asI( F a )                     { return _mm512_castps_si512( a ); }
+
+    // zero-extended, and the low 16 bits of the lanes
+    static I loadU16( const uint16_t *p )
+    {
+        return _mm512_cvtepu16_epi32( _mm256_loadu_si256( (const __m256i *)p ) );
+    }
+    static void storeU16( uint16_t *p, I v ) { _mm256_storeu_si256( (__m256i *)p, _mm512_cvtepi32_epi16( v ) ); }
+
+    // the 32 bits at p + idx
+    static I gatherU32( const uint16_t *p, I idx ) { return _mm512_i32gather_epi32( idx, p, 2 ); }
+
+    // halves, rounded to nearest even
+    static const bool HAS_F16C = true;
+    static F loadph( const uint16_t *p )    { return _mm512_cvtph_ps( _mm256_loadu_si256( (const __m256i *)p ) ); }
+    static void storeph( uint16_t *p, F v )
+    {
+        _mm256_storeu_si256( (__m256i *)p, _mm512_cvtps_ph( v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) );
+    }
+    // of the low 16 bits of the lanes
+    static F cvtph( I h )                   { return _mm512_cvtph_ps( _mm512_cvtepi32_epi16( h ) ); }
+};
+
+#include "FluidKernelsImpl.h"
+}
+
+//==================================================================
+const FluidKernels *GetFluidKernels_AVX512()
+{
+    return KernelsImpl<VecAVX512>::GetKernels( FLUIDISA_AVX512, "avx512" );
+}
+
+#else
+
+const FluidKernels *GetFluidKernels_AVX512() { return nullptr; }
+
+#endif
+
@@ -0,0 +1,145 @@
+//==================================================================
+/// FluidKernels_SSE41.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+// built with SSE4.1 enabled, see CMakeLists.txt
+
+#include "FluidKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+
+#include <smmintrin.h>
+
+//==================================================================
+namespace
+{
+struct VecSSE41
+{
+    using F = __m128;
+    using I = __m128i;
+    using M = __m128;
+    static const int W = 4;
+
+    static F load( const float *p )         { return _mm_loadu_ps( p ); }
+    static void store( float *p, F v )      { _mm_storeu_ps( p, v ); }
+    // the first n < W lanes only, the memory past them isn't touched
+    static F loadFirst( const float *p, int n )
+    {
+        switch ( n )
+        {
+        case 1: return _mm_load_ss( p );
+        case 2: return _mm_castpd_ps( _mm_load_sd( (const double *)p ) );
+        default: return _mm_insert_ps( _mm_castpd_ps( _mm_load_sd( (const double *)p ) ),
+                                       _mm_load_ss( p + 2 ), 0x20 );
+        }
+    }
+    static void storeFirst( float *p, F v, int n )
+    {
+        if ( n == 1 )
+            _mm_store_ss( p, v );
+        else
+        {
+            _mm_store_sd( (double *)p, _mm_castps_pd( v ) );
+            if ( n == 3 )
+                _mm_store_ss( p + 2, _mm_movehl_ps( v, v ) );
+        }
+    }
+    static F set1( float x )                { return _mm_set1_ps( x ); }
+    static F iota()                         { return _mm_setr_ps( 0, 1, 2, 3 ); }
+    static F add( F a, F b )                { return _mm_add_ps( a, b ); }
+    static F sub( F a, F b )                { return _mm_sub_ps( a, b ); }
+    static F mul( F a, F b )                { return _mm_mul_ps( a, b ); }
+    static F madd( F a, F b, F c )          { return _mm_add_ps( _mm_mul_ps( a, b ), c ); }
+    static F min( F a, F b )                { return _mm_min_ps( a, b ); }
+    static F max( F a, F b )                { return _mm_max_ps( a, b ); }
+    static F abs( F a )                     { return _mm_andnot_ps( _mm_set1_ps( -0.f ), a ); }
+    static float hmax( F a )
+    {
+        a = _mm_max_ps( a, _mm_movehl_ps( a, a ) );
+        a = _mm_max_ss( a, _mm_shuffle_ps( a, a, 1 ) );
+        return _mm_cvtss_f32( a );
+    }
+    static I cvtt( F a )                    { return _mm_cvttps_epi32( a ); }
+    static F cvt( I a )                     { return _mm_cvtepi32_ps( a ); }
+    static I iset1( int x )                 { return _mm_set1_epi32( x ); }
+    static I iadd( I a, I b )               { return _mm_add_epi32( a, b ); }
+    static I imul( I a, I b )               { return _mm_mullo_epi32( a, b ); }
+
+    static F gather( const float *p, I idx )
+    {
+        return _mm_setr_ps(
+                    p[ _mm_extract_epi32( idx, 0 ) ],
+                    p[ _mm_extract_epi32( idx, 1 ) ],
+                    p[ _mm_extract_epi32( idx, 2 ) ],
+                    p[ _mm_extract_epi32( idx, 3 ) ] );
+    }
+
+    // lanes with (lane & 1) == parity
+    static M laneParityMask( int parity )
+    {
+        return parity ? _mm_castsi128_ps( _mm_setr_epi32( 0, -1, 0, -1 ) )
+                      : _mm_castsi128_ps( _mm_setr_epi32( -1, 0, -1, 0 ) );
+    }
+    static F blend( F a, F b, M m )         { return _mm_blendv_ps( a, b, m ); }
+    // the lane only
+    static M laneMask( int lane )
+    {
+        return _mm_castsi128_ps( _mm_cmpeq_epi32( _mm_setr_epi32( 0, 1, 2, 3 ), _mm_set1_epi32( lane ) ) );
+    }
+    // x, then the lanes of a but the last
+    static F shiftIn( F a, float x )
+    {
+        const auto up = _mm_castsi128_ps( _mm_slli_si128( _mm_castps_si128( a ), 4 ) );
+        return _mm_blend_ps( up, _mm_set1_ps( x ), 1 );
+    }
+
+    // integer lanes, for the 16 bit storage types
+    static const bool HAS_F16C = false;
+    using MI = __m128i;
+    static I iand( I a, I b )               { return _mm_and_si128( a, b ); }
+    static I ior( I a, I b )                { return _mm_or_si128( a, b ); }
+    static I ixor( I a, I b )               { return _mm_xor_si128( a, b ); }
+    static I isub( I a, I b )               { return _mm_sub_epi32( a, b ); }
+    template <int N> static I isll( I a )   { return _mm_slli_epi32( a, N ); }
+    template <int N> static I isrl( I a )   { return _mm_srli_epi32( a, N ); }
+    static MI icmpeq( I a, I b )            { return _mm_cmpeq_epi32( a, b ); }
+    static MI icmpgt( I a, I b )            { return _mm_cmpgt_epi32( a, b ); }
+    static I iblend( I a, I b, MI m )       { return _mm_blendv_epi8( a, b, m ); }
+    static F asF( I a )                     { return _mm_castsi128_ps( a ); }
+    static I asI( F a )                     { return _mm_castps_si128( a ); }
+
+    // zero-extended, and the low 16 bits of the lanes
+    static I loadU16( const uint16_t *p )   { return _mm_cvtepu16_epi32( _mm_loadl_epi64( (const __m128i *)p ) ); }
+    static void storeU16( uint16_t *p, I v ) { _mm_storel_epi64( (__m128i *)p, _mm_packus_epi32( v, v ) ); }
+
+    // the 32 bits at p + idx
+    static I gatherU32( const uint16_t *p, I idx )
+    {
+        auto g = [p]( int k ) { return (int)(p[k] | (uint32_t)p[k+1] << 16); };
+        return _mm_setr_epi32(
+                    g( _mm_extract_epi32( idx, 0 ) ),
+                    g( _mm_extract_epi32( idx, 1 ) ),
+                    g( _mm_extract_epi32( idx, 2 ) ),
+                    g( _mm_extract_epi32( idx, 3 ) ) );
+    }
+};
+
+#include "FluidKernelsImpl.h"
+}
+
+//==================================================================
+const FluidKernels *GetFluidKernels_SSE41()
+{
+    return KernelsImpl<VecSSE41>::GetKernels( FLUIDISA_SSE41, "sse41" );
+}
+
+#else
+
+const FluidKernels *GetFluidKernels_SSE41() { return nullptr; }
+
+#endif
+
@@ -7,3 +7,238 @@
 
 #include "FluidSolver.h"
 
+//==================================================================
+using CreateFn = std::unique_ptr<FluidSolverBase> (*)( int nx, int ny );
+
+template <int NX, int NY, bool DO_BOUND, unsigned POLICY, typename STORAGE = float,
+          template <int,int> class LAYOUT = GridLayoutLinear>
+static std::unique_ptr<FluidSolverBase> createT( int nx, int ny )
+{
+    return std::make_unique<FluidSolverT<NX,NY,DO_BOUND,LAYOUT,POLICY,STORAGE>>( nx, ny );
+}
+
+struct FastPathEntry
+{
+    int         nx;
+    int         ny;
+    bool        doBound;
+    unsigned    policy;
+    CreateFn    createFn;
+};
+
+// no viscosity and no diffusion, as in the demo
+static const unsigned IDEAL = FluidSolverBase::POLICY_INVISCID |
+                              FluidSolverBase::POLICY_NO_DIFFUSION;
+
+#define FAST_PATH(_NX_,_NY_) \
+    { _NX_, _NY_, false, 0    , createT<_NX_,_NY_,false,0    > }, \
+    { _NX_, _NY_, true , 0    , createT<_NX_,_NY_,true ,0    > }, \
+    { _NX_, _NY_, false, IDEAL, createT<_NX_,_NY_,false,IDEAL> }, \
+    { _NX_, _NY_, true , IDEAL, createT<_NX_,_NY_,true ,IDEAL> }
+
+// sizes that get kernels specialized at compile time
+static const FastPathEntry _sFastPaths[] =
+{
+    FAST_PATH(   64,   64 ),
+    FAST_PATH(  128,  128 ),
+    FAST_PATH(  256,  256 ),
+    FAST_PATH(  512,  512 ),
+    FAST_PATH( 1024, 1024 ),
+    FAST_PATH( 1024,  256 ),
+};
+
+#undef FAST_PATH
+
+#define GENERIC_PATHS(_ST_,_LA_) \
+    {{ createT<0,0,false,0,_ST_,_LA_>, createT<0,0,false,1,_ST_,_LA_>, \
+       createT<0,0,false,2,_ST_,_LA_>, createT<0,0,false,3,_ST_,_LA_> }, \
+     { createT<0,0,true ,0,_ST_,_LA_>, createT<0,0,true ,1,_ST_,_LA_>, \
+       createT<0,0,true ,2,_ST_,_LA_>, createT<0,0,true ,3,_ST_,_LA_> }}
+
+// runtime size, by layout, scalar storage, doBound and policy
+static const CreateFn _sGenericPaths[FLUIDLAYOUT_N][FLUIDSTORAGE_N][2][4] =
+{
+    {
+        GENERIC_PATHS( float,         GridLayoutLinear ),
+        GENERIC_PATHS( FluidHalf,     GridLayoutLinear ),
+        GENERIC_PATHS( FluidBFloat16, GridLayoutLinear ),
+    },
+    {
+        GENERIC_PATHS( float,         GridLayoutTiled ),
+        GENERIC_PATHS( FluidHalf,     GridLayoutTiled ),
+        GENERIC_PATHS( FluidBFloat16, GridLayoutTiled ),
+    },
+};
+
+#undef GENERIC_PATHS
+
+//==================================================================
+std::unique_ptr<FluidSolverBase> CreateFluidSolver( int nx, int ny, bool doBound, unsigned policy,
+                                                    FluidStorage scalStorage, FluidLayout gridLayout )
+{
+    assert( policy <= IDEAL );
+
+    if ( scalStorage == FLUIDSTORAGE_F32 && gridLayout == FLUIDLAYOUT_LINEAR )
+        for (const auto &e : _sFastPaths)
+            if ( e.nx == nx && e.ny == ny && e.doBound == doBound && e.policy == policy )
+                return e.createFn( nx, ny );
+
+    return _sGenericPaths[ gridLayout ][ scalStorage ][ doBound ][ policy ]( nx, ny );
+}
+
+
+//==================================================================
+void FluidSolverBase::AddSplats( const Splat *pSplats, size_t splatsN )
+{
+    FLUID_TRACE_SCOPE( "AddSplats" );
+
+    // the scalars of a scalar grid go there, in its cells
+    if ( moScalGrid )
+    {
+        const float sca = (float)mScalScale;
+        mSplatsTmp.clear();
+        for (size_t k=0; k < splatsN; ++k)
+        {
+            if ( pSplats[k].target == Splat::TARGET_VELOCITY )
+                continue;
+
+            auto s = pSplats[k];
+            s.pos[0] *= sca;
+            s.pos[1] *= sca;
+            s.radius *= sca;
+            mSplatsTmp.push_back( s );
+        }
+        if ( !mSplatsTmp.empty() )
+            moScalGrid->AddSplats( mSplatsTmp.data(), mSplatsTmp.size() );
+    }
+
+    auto &bins = mSplatBins;
+    bins.binsX = (mNX + SPLAT_BIN-1) / SPLAT_BIN;
+    bins.binsY = (mNY + SPLAT_BIN-1) / SPLAT_BIN;
+    const int binsN = bins.binsX * bins.binsY;
+
+    // fn( i0, i1, j0, j1 ) for the box of the cells of the splat, if
+    //  it's for the fields here
+    auto withCells = [&]( const Splat &s, const auto &fn )
+    {
+        if ( s.target != Splat::TARGET_VELOCITY &&
+             (moScalGrid || s.target < 0 || s.target >= (int)mCurScal.size()) )
+            return;
+
+        int j0, j1;
+        splatRows( s, j0, j1 );
+        // the widest row, at the center
+        const float r = std::max( s.radius, 0.f );
+        const int i0 = std::max( r > 0 ? (int)ceilf( s.pos[0] - r + 0.5f ) : (int)floorf( s.pos[0] ) + 1, 1 );
+        const int i1 = std::min( r > 0 ? (int)floorf( s.pos[0] + r + 0.5f ) : i0, mNX );
+        j0 = std::max( j0, 1 );
+        j1 = std::min( j1, mNY );
+        if ( i0 <= i1 && j0 <= j1 )
+            fn( i0, i1, j0, j1 );
+    };
+
+    // fn( bin ) for the bins with cells of the splat
+    auto forEachBin = [&]( const Splat &s, const auto &fn )
+    {
+        withCells( s, [&]( int i0, int i1, int j0, int j1 )
+        {
+            for (int by=(j0-1) / SPLAT_BIN; by <= (j1-1) / SPLAT_BIN; ++by)
+                for (int bx=(i0-1) / SPLAT_BIN; bx <= (i1-1) / SPLAT_BIN; ++bx)
+                    fn( bx + bins.binsX * by );
+        });
+    };
+
+    // counted, then placed in order. The cells go to the sparse map too
+    bins.start.assign( (size_t)binsN + 1, 0 );
+    for (size_t k=0; k < splatsN; ++k)
+    {
+        forEachBin( pSplats[k], [&]( int b ) { ++bins.start[b+1]; } );
+        if ( mIsSparse )
+            withCells( pSplats[k], [&]( int i0, int i1, int j0, int j1 ) { markDirty( i0, i1, j0, j1 ); } );
+    }
+
+    for (int b=0; b < binsN; ++b)
+        bins.start[b+1] += bins.start[b];
+
+    if ( !bins.start[binsN] )
+        return;
+
+    bins.idx.resize( (size_t)bins.start[binsN] );
+    bins.fill.assign( bins.start.begin(), bins.start.end() - 1 );
+    for (size_t k=0; k < splatsN; ++k)
+        forEachBin( pSplats[k], [&]( int b ) { bins.idx[ bins.fill[b]++ ] = (int)k; } );
+
+    addBinnedSplats( pSplats );
+}
+
+//==================================================================
+bool FluidSolverBase::StepSliced( float visc, float diff, float dt, StepClock::time_point deadline )
+{
+    FLUID_TRACE_SCOPE( "StepSliced" );
+
+    if ( !mIsStepPending )
+    {
+        beginStep( STEP_ALL, visc, diff, dt, true );
+        mIsStepPending = true;
+    }
+
+    // the clock is only read between slices, so a slice may go past
+    //  the deadline
+    do
+    {
+        if ( stepSlice() )
+        {
+            mIsStepPending = false;
+            return true;
+        }
+    } while ( StepClock::now() < deadline );
+
+    return false;
+}
+
+//==================================================================
+void FluidSolverBase::SetScalarScale( int scale )
+{
+    assert( scale >= 1 && !mOpenSides );
+
+    const int scalN = GetScalarsN();
+    std::vector<float> diffScas( (size_t)scalN );
+    for (int c=0; c < scalN; ++c)
+        diffScas[c] = GetScalarDiffusionScale( c );
+
+    mScalScale = scale;
+    moScalGrid.reset();
+    mUpsTapsX.clear();
+    mUpsTapsY.clear();
+
+    if ( scale > 1 )
+    {
+        // it only steps scalars, so it leaves out the viscosity
+        moScalGrid = CreateFluidSolver( mNX * scale, mNY * scale, mDoBound,
+                                        mPolicy | POLICY_INVISCID, mScalStorage, mGridLayout );
+        moScalGrid->mInvH = mInvH * (float)scale;
+
+        // centers of the fine cells in the coarse cell coordinates,
+        //  where the ghost cells at 0 and N+1 bound the interpolation
+        auto makeTaps = [scale]( int n, auto &taps )
+        {
+            taps.resize( (size_t)(n * scale) );
+            for (int i=1; i <= n * scale; ++i)
+            {
+                const float x = (i - 0.5f) / (float)scale + 0.5f;
+                const int i0 = (int)x;
+                taps[i-1] = { i0, x - (float)i0 };
+            }
+        };
+        makeTaps( mNX, mUpsTapsX );
+        makeTaps( mNY, mUpsTapsY );
+    }
+
+    // the channels here are unused with a scalar grid
+    mCurScal.resize( 1 );
+    std::fill( mCurScal[0].begin(), mCurScal[0].end(), (uint8_t)0 );
+
+    SetScalarsN( scalN );
+    for (int c=0; c < scalN; ++c)
+        SetScalarDiffusionScale( c, diffScas[c] );
+}
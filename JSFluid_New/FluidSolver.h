@@ -8,267 +8,2202 @@
 #ifndef FLUIDSOLVER_H
 #define FLUIDSOLVER_H
 
+#include <assert.h>
+#include <math.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#include "ThreadPool.h"
+#include "PoissonMG.h"
+#include "PoissonPCG.h"
+#include "GridLayout.h"
+#include "FluidKernels.h"
+#include "FluidWorkspace.h"
+#include "FluidStorage.h"
+#include "FluidActiveTiles.h"
+#include "FluidTrace.h"
+#include "FluidCheckpoint.h"
 
 //==================================================================
-template <int N, bool DO_BOUND>
-class FluidSolver
+/// Size-independent part of the solver, and the interface to step
+/// solvers whose size is only known at runtime (see CreateFluidSolver)
+//==================================================================
+class FluidSolverBase
 {
-    static const int DIMS_N = 2;
+public:
+    enum RelaxMode
+    {
+        RELAX_GAUSS_SEIDEL, // lexicographic, serial
+        RELAX_RED_BLACK     // checkerboard, rows spread over the thread pool
+    };
+
+    enum PressureSolver
+    {
+        PSOLVER_RELAX,      // sweeps of lin_solve, see SetRelaxParams()
+        PSOLVER_MULTIGRID,  // multigrid cycles down to a residual tolerance
+        PSOLVER_PCG         // preconditioned CG down to a residual tolerance
+    };
+
+    enum Side
+    {
+        SIDE_LEFT   = 1 << 0,   // i = 0
+        SIDE_RIGHT  = 1 << 1,   // i = NX+1
+        SIDE_BOTTOM = 1 << 2,   // j = 0
+        SIDE_TOP    = 1 << 3,   // j = NY+1
+    };
+
+    enum Field : int
+    {
+        FIELD_VEL0,
+        FIELD_VEL1,
+        FIELD_PRE0,
+        FIELD_PRE1,
+        FIELD_DEN,  // scalar channel 0, channel c is FIELD_DEN + c
+    };
+
+    // passive scalar channels, see SetScalarsN()
+    static const int SCALARS_MAX = 16;
+
+    // stages taken out at compile time, for configurations that never
+    //  use them (see FluidSolverT)
+    enum Policy : unsigned
+    {
+        POLICY_INVISCID     = 1 << 0,   // no viscosity, visc is ignored
+        POLICY_NO_DIFFUSION = 1 << 1,   // no scalar diffusion, diff is ignored
+    };
+
+    // relaxation of lin_solve, used by the diffusion and PSOLVER_RELAX
     static const int RELAX_ITER_COUNT = 20;
 
-    std::vector<float> mCurVel[DIMS_N];
-    std::vector<float> mCurDen;
+    struct RelaxParams
+    {
+        float   tolerance = 0;      // max residual relative to max |x0|, 0 = off
+        int     maxIters  = RELAX_ITER_COUNT;
+    };
+
+    // a disc of cells that takes an amount of a scalar, or a push of
+    //  the velocity, see AddSplats()
+    struct Splat
+    {
+        static const int TARGET_VELOCITY = -1;
+
+        // in cells, cell (i,j) covering [i-1,i) x [j-1,j)
+        float   pos[2] {};
+        // cells with the center within it, or only the one at pos if zero
+        float   radius  = 0;
+        // 0 for the same amount over the disc, 1 for the amount at the
+        //  center going down to zero at the radius
+        float   falloff = 0;
+        // the scalar channel, or TARGET_VELOCITY
+        int     target  = 0;
+        // of the scalar, or of the velocity components
+        float   amount[2] {};
+    };
+
+    // splats are sorted to blocks of SPLAT_BIN x SPLAT_BIN cells, which
+    //  are the tiles of GridLayoutTiled
+    static const int SPLAT_BIN = GridTileSpan::TILE;
+
+    // cells at or under both count as empty, see SetSparse()
+    struct SparseParams
+    {
+        float   velocityThreshold = 0.05f;  // in cells moved per step
+        float   scalarThreshold   = 1e-4f;
+    };
+
+protected:
+    static const int DIMS_N = 2;
+
+    const int       mNX;
+    const int       mNY;
+    const bool      mDoBound;
+    const unsigned  mPolicy;
+    // type of the cells of the scalars and of their scratch fields
+    const FluidStorage  mScalStorage;
+    // storage order of the cells of all the fields
+    const FluidLayout   mGridLayout;
+
+    FluidField  mCurVel[DIMS_N];
+    // passive scalars carried by the flow, the first is the density
+    std::vector<FluidBuffer>    mCurScal;
+    std::vector<float>      mScalDiffSca;
+    // pressure of the two projections of vel_step, kept to warm-start
+    //  the solve of the next step
+    FluidField  mCurPre[2];
+
+    // finer grid of the scalars, see SetScalarScale()
+    int                                 mScalScale = 1;
+    std::unique_ptr<FluidSolverBase>    moScalGrid;
+    // bilinear taps of the velocity for each column and row of it
+    struct UpsampleTap
+    {
+        int     i0;
+        float   w1;
+    };
+    std::vector<UpsampleTap>            mUpsTapsX;
+    std::vector<UpsampleTap>            mUpsTapsY;
+
+    // see SetSparse()
+    bool                mIsSparse = false;
+    SparseParams        mSparseParams;
+    FluidActiveTiles    mActTiles;
+
+    // splats of AddSplats() by bin, those of bin b being the indices
+    //  idx[start[b]] to idx[start[b+1]-1], in their order
+    struct SplatBins
+    {
+        int                 binsX {};
+        int                 binsY {};
+        std::vector<int>    start;
+        std::vector<int>    idx;
+        std::vector<int>    fill;
+    };
+    SplatBins           mSplatBins;
+    std::vector<Splat>  mSplatsTmp;
+
+    // scratch fields of the steps, made at the first step if not set
+    std::shared_ptr<FluidWorkspace> moWorkspace;
+
+    RelaxMode   mRelaxMode = RELAX_GAUSS_SEIDEL;
+    ThreadPool  *mpPool {};
+    bool        mWarmStartPressure = true;
+    int         mOpenSides = 0;
+    // 1/h, with the longest side of the domain being of unit length
+    float       mInvH;
+    // SIMD row kernels, used with linear layouts
+    const FluidKernels *mpKernels = GetFluidKernels( DetectFluidISA() );
+
+    RelaxParams                 mRelaxParams;
+    int                         mLastRelaxItersN {};
+    int                         mLastPressureRelaxItersN {};
+
+    PressureSolver              mPressureSolver = PSOLVER_RELAX;
+    PoissonMG::Params           mMGParams;
+    std::unique_ptr<PoissonMG>  moPoissonMG;
+    PoissonPCG::Params          mPCGParams;
+    std::unique_ptr<PoissonPCG> moPoissonPCG;
+
+    // a step of StepSliced() was started and isn't done yet
+    bool                        mIsStepPending = false;
+
+public:
+    FluidSolverBase( int nx, int ny, bool doBound, unsigned policy, FluidStorage scalStorage,
+                     FluidLayout gridLayout, size_t cellsN )
+        : mNX(nx)
+        , mNY(ny)
+        , mDoBound(doBound)
+        , mPolicy(policy)
+        , mScalStorage(scalStorage)
+        , mGridLayout(gridLayout)
+        , mInvH((float)std::max( nx, ny ))
+    {
+        mCurVel[0].resize( cellsN );
+        mCurVel[1].resize( cellsN );
+        mCurScal.resize( 1 );
+        mCurScal[0].resize( scalarFieldSize() );
+        mScalDiffSca.resize( 1, 1.f );
+        mCurPre[0].resize( cellsN );
+        mCurPre[1].resize( cellsN );
+
+        Clear();
+    }
+
+    virtual ~FluidSolverBase() = default;
+
+    int GetNX() const { return mNX; }
+    int GetNY() const { return mNY; }
+
+    // a pending StepSliced() is dropped
+    void Clear()
+    {
+        mIsStepPending = false;
+
+        for (int i=0; i < DIMS_N; ++i)
+            for (auto &x : mCurVel[i])
+                x = 0;
+
+        // all bits zero is 0 for all the storage types
+        for (auto &f : mCurScal)
+            std::fill( f.begin(), f.end(), (uint8_t)0 );
+
+        for (int i=0; i < 2; ++i)
+            for (auto &x : mCurPre[i])
+                x = 0;
+
+        if ( moScalGrid )
+            moScalGrid->Clear();
+    }
+
+    // scalars like dye colors, temperature or fuel, moved with the
+    //  density and diffused and advected in the same passes. New
+    //  channels start at zero
+    void SetScalarsN( int n )
+    {
+        assert( n >= 1 && n <= SCALARS_MAX );
+        if ( moScalGrid )
+        {
+            moScalGrid->SetScalarsN( n );
+            return;
+        }
+        mCurScal.resize( (size_t)n, FluidBuffer( scalarFieldSize(), 0 ) );
+        mScalDiffSca.resize( (size_t)n, 1.f );
+    }
+    int GetScalarsN() const { return moScalGrid ? moScalGrid->GetScalarsN() : (int)mCurScal.size(); }
+
+    // float, or 16 bits for half the traffic of the scalar passes (see
+    //  FluidSolverT)
+    FluidStorage GetScalarStorage() const { return mScalStorage; }
+
+    FluidLayout GetGridLayout() const { return mGridLayout; }
+
+    // the diffusion of channel ch is the diff of the step times sca
+    void SetScalarDiffusionScale( int ch, float sca )
+    {
+        if ( moScalGrid )
+            moScalGrid->SetScalarDiffusionScale( ch, sca );
+        else
+            mScalDiffSca[ch] = sca;
+    }
+    float GetScalarDiffusionScale( int ch ) const
+    {
+        return moScalGrid ? moScalGrid->GetScalarDiffusionScale( ch ) : mScalDiffSca[ch];
+    }
+
+    // scalars on a grid of scale times the cells per side, moved along
+    //  the velocity interpolated from this one. The visible detail of
+    //  the fine grid for about the cost of the coarse velocity solve.
+    //  Scalars restart at zero, channels and diffusion scales are kept.
+    //  Not for solvers with open sides (see FluidDomain)
+    void SetScalarScale( int scale );
+    int GetScalarScale() const { return mScalScale; }
+    // cells of SMPDen() and SMPScalar()
+    int GetScalarNX() const { return mNX * mScalScale; }
+    int GetScalarNY() const { return mNY * mScalScale; }
+
+    // steps only the blocks of cells with velocity or scalars, and
+    //  those that the fluid can reach in a step. The cells out of them
+    //  are taken as zero, so diffusion and pressure are cut at least a
+    //  block past the fluid. Used by linear layouts, where the
+    //  multigrid and PCG pressure solves still cover the whole grid.
+    //  A step only looks at the blocks active in the last one and at
+    //  those written since, by splats, CopyCellsIn(), the cell
+    //  accessors or a checkpoint. References to cells are marked when
+    //  taken, not when written through
+    void SetSparse( bool onOff )
+    {
+        mIsSparse = onOff;
+        if ( !onOff )
+            return;
+
+        // the fields aren't tracked while it's off
+        if ( mActTiles.GetBlocksX() )
+            mActTiles.MarkAllDirty();
+        else
+            mActTiles.Setup( mNX, mNY );
+    }
+    bool IsSparse() const { return mIsSparse; }
+
+    // values under the thresholds are cleared once their block goes
+    //  idle. The pressure reaches the whole domain, so the velocity
+    //  needs a threshold well above zero for blocks to go idle
+    void SetSparseParams( const SparseParams &par ) { mSparseParams = par; }
+    const SparseParams &GetSparseParams() const { return mSparseParams; }
+    // blocks of the last step, when sparse
+    const FluidActiveTiles &GetActiveTiles() const { return mActTiles; }
+
+    // red-black runs serially if no pool is set
+    void SetRelaxMode( RelaxMode mode ) { mRelaxMode = mode; }
+    void SetThreadPool( ThreadPool *pPool )
+    {
+        mpPool = pPool;
+        if ( moPoissonMG ) moPoissonMG->SetThreadPool( pPool );
+    }
+
+    // start each pressure solve from the previous step's pressure,
+    //  rather than from zero
+    void SetWarmStartPressure( bool onOff ) { mWarmStartPressure = onOff; }
+
+    // defaults to the best set for the CPU. Sets that aren't built in
+    //  are ignored
+    void SetKernelISA( FluidISA isa )
+    {
+        if ( const auto *pK = GetFluidKernels( isa ) )
+            mpKernels = pK;
+    }
+    FluidISA GetKernelISA() const { return mpKernels->isa; }
+
+    void SetPressureSolver( PressureSolver ps )
+    {
+        mPressureSolver = ps;
+        // the solvers of the whole grid leave pressure in the gaps
+        markAllDirty();
+        if ( ps == PSOLVER_MULTIGRID && !moPoissonMG )
+        {
+            moPoissonMG = std::make_unique<PoissonMG>( mNX, mNY, mDoBound );
+            moPoissonMG->SetThreadPool( mpPool );
+        }
+        if ( ps == PSOLVER_PCG && !moPoissonPCG )
+            moPoissonPCG = std::make_unique<PoissonPCG>( mNX, mNY, mDoBound );
+    }
+    // sweeps stop at maxIters or once the residual is below tolerance.
+    //  Solves with no coupling between cells (zero diffusion) take
+    //  one sweep
+    void SetRelaxParams( const RelaxParams &par ) { mRelaxParams = par; }
+    const RelaxParams &GetRelaxParams() const { return mRelaxParams; }
+    // sweeps of the last lin_solve
+    int GetLastRelaxItersN() const { return mLastRelaxItersN; }
+
+    void SetMultigridParams( const PoissonMG::Params &par ) { mMGParams = par; }
+    const PoissonMG::Params &GetMultigridParams() const { return mMGParams; }
+    // last solve stats, when using PSOLVER_MULTIGRID
+    const PoissonMG *GetPoissonMG() const { return moPoissonMG.get(); }
+
+    void SetPCGParams( const PoissonPCG::Params &par ) { mPCGParams = par; }
+    const PoissonPCG::Params &GetPCGParams() const { return mPCGParams; }
+    // last solve stats, when using PSOLVER_PCG
+    const PoissonPCG *GetPoissonPCG() const { return moPoissonPCG.get(); }
+
+    PressureSolver GetPressureSolver() const { return mPressureSolver; }
+    // sweeps, cycles or iterations of the last pressure solve
+    int GetLastPressureItersN() const
+    {
+        switch ( mPressureSolver )
+        {
+        case PSOLVER_MULTIGRID: return moPoissonMG->GetLastCyclesN();
+        case PSOLVER_PCG:       return moPoissonPCG->GetLastItersN();
+        default:                return mLastPressureRelaxItersN;
+        }
+    }
+
+    // the ghost cells of open sides are left to the caller, which
+    //  fills them from a neighbor solver before each step (see
+    //  FluidDomain). With doBound, the multigrid and PCG pressure
+    //  solvers still treat open sides as walls
+    void SetOpenSides( int sidesMask ) { mOpenSides = sidesMask; }
+    int GetOpenSides() const { return mOpenSides; }
+
+    // size in cells of the whole domain when this solver is a part of
+    //  it, so that the cells have the size of the domain's ones
+    void SetDomainSize( int domNX, int domNY )
+    {
+        mInvH = (float)std::max( domNX, domNY );
+        if ( moScalGrid )
+            moScalGrid->mInvH = mInvH * (float)mScalScale;
+    }
+
+    // the splats summed into the fields, in their order. A batch is
+    //  one pass: splats are sorted to the bins of the cells they cover,
+    //  and the bins go over the thread pool, a run of cells at a time
+    //  with the SIMD kernels. Splats of scalar channels that aren't
+    //  there are skipped. With a scalar grid, the scalars are splatted
+    //  into its cells
+    void AddSplats( const Splat *pSplats, size_t splatsN );
+
+    // copy of the cells [i0,i1] x [j0,j1] of a field, row by row
+    virtual void CopyCellsOut( Field f, int i0, int i1, int j0, int j1, float *pDst ) const = 0;
+    virtual void CopyCellsIn( Field f, int i0, int i1, int j0, int j1, const float *pSrc ) = 0;
+
+    // solvers stepped on the same thread can share a workspace, to
+    //  keep a single set of scratch fields hot in the cache
+    void SetWorkspace( std::shared_ptr<FluidWorkspace> oWS ) { moWorkspace = std::move( oWS ); }
+    const std::shared_ptr<FluidWorkspace> &GetWorkspace() const { return moWorkspace; }
+
+    // slower than the ones of FluidSolverT, which hide these
+    template <int DIM_IDX>
+    const float &SMPVel(int i, int j) const { return smpVel( DIM_IDX, i, j ); }
+    template <int DIM_IDX>
+          float &SMPVel(int i, int j)
+    {
+        markDirty( i, i, j, j );
+        return const_cast<float &>( smpVel( DIM_IDX, i, j ) );
+    }
+
+    float        SMPDen(int i, int j) const { return SMPScalar( 0, i, j ); }
+    FluidCellRef SMPDen(int i, int j)       { return SMPScalar( 0, i, j ); }
+
+    // the cells are of GetScalarStorage() type
+    float SMPScalar(int ch, int i, int j) const
+    {
+        return FluidCellRef( const_cast<void *>( scalarCell( ch, i, j ) ), mScalStorage );
+    }
+    FluidCellRef SMPScalar(int ch, int i, int j)
+    {
+        markScalarsDirty( i, i, j, j );
+        return { const_cast<void *>( scalarCell( ch, i, j ) ), mScalStorage };
+    }
+
+    // references to the cells, which are floats with FLUIDSTORAGE_F32
+    //  only. SMPDen() and SMPScalar() are values or proxies otherwise
+    const float &SMPDenF32(int i, int j) const { return SMPScalarF32( 0, i, j ); }
+          float &SMPDenF32(int i, int j)       { return SMPScalarF32( 0, i, j ); }
+    const float &SMPScalarF32(int ch, int i, int j) const
+    {
+        assert( mScalStorage == FLUIDSTORAGE_F32 );
+        return *(const float *)scalarCell( ch, i, j );
+    }
+          float &SMPScalarF32(int ch, int i, int j)
+    {
+        markScalarsDirty( i, i, j, j );
+        return const_cast<float &>( std::as_const( *this ).SMPScalarF32( ch, i, j ) );
+    }
+
+    virtual void dens_step( float diff, float dt ) = 0;
+    virtual void vel_step( float visc, float dt ) = 0;
+
+    // vel_step() and dens_step() in one, with a single advection pass
+    //  for velocity and scalars. The scalars move along the velocity
+    //  of the first projection rather than the final one, which is
+    //  also divergence-free, so results differ slightly from the two
+    //  separate steps. With a scalar grid, it's the two steps
+    virtual void Step( float visc, float diff, float dt ) = 0;
+
+    // clock of the deadlines of StepSliced()
+    using StepClock = std::chrono::steady_clock;
+
+    // cells of a slice of StepSliced(), a whole number of rows
+    static const int STEP_SLICE_CELLS = 1 << 16;
+
+    // Step() in slices, returning once the deadline has passed, for a
+    //  step to be spread over frames. A slice is a band of rows of a
+    //  relaxation sweep or of a pass, the setup of the step and the
+    //  multigrid and PCG pressure solves being a slice each. At least
+    //  one is done per call.
+    //  Returns true when the step is done, the next call starting a
+    //  new one. visc, diff and dt are those of the step being started,
+    //  and are ignored while one is pending. Until then the fields are
+    //  halfway through the step: they shouldn't be written, and the
+    //  workspace shouldn't be used by other solvers. Other steps finish
+    //  the pending one first
+    bool StepSliced( float visc, float diff, float dt, StepClock::time_point deadline );
+    bool IsStepPending() const { return mIsStepPending; }
+
+    // the fields and the parameters that go with them to a file (see
+    //  FluidCheckpoint.h), for a run to be restarted from there. The
+    //  file is written under a temporary name and then renamed, so an
+    //  earlier one is only replaced by a whole one. False if it can't
+    //  be written, or while a StepSliced() is pending
+    bool SaveCheckpoint( const char *pFName ) const;
+    // the same, with the fields copied at the call and the file written
+    //  on a thread of its own, for the steps to go on. The destructor
+    //  of the future waits for the write
+    std::future<bool> SaveCheckpointAsync( std::string fname ) const;
+    // the state of a checkpoint, with its scalar channels and scale.
+    //  The file is mapped, and each field copied from it in one go. A
+    //  pending StepSliced() is dropped. False if the file can't be read,
+    //  is of another kind of solver or its blocks don't match the
+    //  fields, leaving this one as it was.
+    //  The steps that follow are those of the saved solver
+    bool LoadCheckpoint( const char *pFName );
+
+protected:
+    // the fields moved by a step
+    enum StepMode
+    {
+        STEP_ALL,       // Step()
+        STEP_VELOCITY,  // vel_step()
+        STEP_SCALARS,   // dens_step()
+    };
+
+    // sets up a step for stepSlice() to go through, in slices of about
+    //  STEP_SLICE_CELLS cells if isSliced, or else of whole passes
+    virtual void beginStep( StepMode mode, float visc, float diff, float dt, bool isSliced ) = 0;
+    // the next slice of the step, true if it was the last
+    virtual bool stepSlice() = 0;
+
+    // a whole step, after the pending one if any
+    void runStep( StepMode mode, float visc, float diff, float dt )
+    {
+        finishPendingStep();
+        beginStep( mode, visc, diff, dt, false );
+        while ( !stepSlice() )
+        {
+        }
+    }
+    void finishPendingStep()
+    {
+        while ( mIsStepPending )
+            mIsStepPending = !stepSlice();
+    }
+
+    // the step of the scalar grid, along the velocity set by the caller
+    void beginScalarGridStep( float diff, float dt, bool isSliced )
+    {
+        moScalGrid->beginStep( STEP_SCALARS, 0, diff, dt, isSliced );
+    }
+    bool scalarGridSlice() { return moScalGrid->stepSlice(); }
+
+    virtual const float &smpVel( int dimIdx, int i, int j ) const = 0;
+    // the cell of a channel of this solver, of mScalStorage type
+    virtual const void *smpScalar( int ch, int i, int j ) const = 0;
+
+    // the same, or the one of the scalar grid if set
+    const void *scalarCell( int ch, int i, int j ) const
+    {
+        return moScalGrid ? moScalGrid->scalarCell( ch, i, j ) : smpScalar( ch, i, j );
+    }
+
+    // cells written out of the steps, that the next sparse map looks at
+    //  (see FluidActiveTiles)
+    void markDirty( int i0, int i1, int j0, int j1 )
+    {
+        if ( mIsSparse )
+            mActTiles.MarkDirty( i0, i1, j0, j1 );
+    }
+    void markAllDirty()
+    {
+        if ( mIsSparse )
+            mActTiles.MarkAllDirty();
+        if ( moScalGrid )
+            moScalGrid->markAllDirty();
+    }
+    // cells of the scalars, on the scalar grid if set
+    void markScalarsDirty( int i0, int i1, int j0, int j1 )
+    {
+        if ( moScalGrid )
+            moScalGrid->markDirty( i0, i1, j0, j1 );
+        else
+            markDirty( i0, i1, j0, j1 );
+    }
+
+    // the fields that are always float, the ones before FIELD_DEN
+    const float *getField( Field f ) const
+    {
+        switch ( f )
+        {
+        case FIELD_VEL0: return mCurVel[0].data();
+        case FIELD_VEL1: return mCurVel[1].data();
+        case FIELD_PRE0: return mCurPre[0].data();
+        case FIELD_PRE1: return mCurPre[1].data();
+        default:
+            assert( 0 );
+            return nullptr;
+        }
+    }
+    float *getField( Field f ) { return const_cast<float *>( std::as_const( *this ).getField( f ) ); }
+
+    size_t scalarFieldSize() const
+    {
+        return mCurVel[0].size() * FluidStorageCellSize( mScalStorage );
+    }
+
+    // scratch field idx of the workspace, with room for fieldsN fields.
+    //  Fields are sized for floats, also when taken as a smaller type
+    template <typename T = float>
+    T *getTempField( int idx, int fieldsN )
+    {
+        if ( !moWorkspace )
+            moWorkspace = std::make_shared<FluidWorkspace>();
+
+        moWorkspace->Reserve( fieldsN, mCurVel[0].size() );
+        return (T *)moWorkspace->GetField( idx );
+    }
+
+    float getInvH() const { return mInvH; }
+
+    // header and blocks of a checkpoint of the current state, and the
+    //  cells of each block
+    void getCheckpoint( FluidCheckpointHeader &hdr,
+                        std::vector<FluidCheckpointBlock> &blocks,
+                        std::vector<const uint8_t *> &blocksData ) const;
+
+    // the splats of mSplatBins into the fields
+    virtual void addBinnedSplats( const Splat *pSplats ) = 0;
+
+    // rows [j0,j1] with cells of a splat, and its cells [i0,i1] of row j.
+    //  Not clipped to the grid
+    static void splatRows( const Splat &s, int &j0, int &j1 )
+    {
+        const float r = std::max( s.radius, 0.f );
+        j0 = r > 0 ? (int)ceilf( s.pos[1] - r + 0.5f ) : (int)floorf( s.pos[1] ) + 1;
+        j1 = r > 0 ? (int)floorf( s.pos[1] + r + 0.5f ) : j0;
+    }
+    static void splatRowCells( const Splat &s, int j, int &i0, int &i1 )
+    {
+        if ( s.radius <= 0 )
+        {
+            i0 = i1 = (int)floorf( s.pos[0] ) + 1;
+            return;
+        }
+        const float dy = (j - 0.5f) - s.pos[1];
+        const float hx = sqrtf( std::max( s.radius * s.radius - dy * dy, 0.f ) );
+        i0 = (int)ceilf(  s.pos[0] - hx + 0.5f );
+        i1 = (int)floorf( s.pos[0] + hx + 0.5f );
+    }
+
+    // settings of this solver that the scalar grid follows
+    void syncScalarGrid()
+    {
+        auto &g = *moScalGrid;
+        g.mRelaxMode    = mRelaxMode;
+        g.mpPool        = mpPool;
+        g.mRelaxParams  = mRelaxParams;
+        g.mpKernels     = mpKernels;
+        g.mSparseParams = mSparseParams;
+        if ( g.mIsSparse != mIsSparse )
+            g.SetSparse( mIsSparse );
+        // the upsampling writes all of its velocity, in parallel bands
+        //  whose marks then find the blocks set already
+        g.markAllDirty();
+        // the scratch fields are taken at the larger size
+        if ( !moWorkspace )
+            moWorkspace = std::make_shared<FluidWorkspace>();
+        g.moWorkspace   = moWorkspace;
+    }
+};
+
+// reaches the internal kernels, for the benchmark (see JSFluid_Bench)
+struct FluidBenchAccess;
+
+//==================================================================
+/// A size of 0 makes the solver take it at runtime, the fixed sizes
+/// let the compiler specialize the kernels.
+/// POLICY is a mask of FluidSolverBase::Policy, for the stages to
+/// leave out. A zero visc or diff also skips the diffusion at runtime.
+/// STORAGE is the type of the scalars and of their scratch fields:
+/// float, FluidHalf or FluidBFloat16 (see FluidStorage.h). The 16 bit
+/// types halve the memory and the traffic of the scalar passes, with
+/// the math still in float. The velocity and the pressure stay float,
+/// as the relaxation and the projection would stall at 16 bits.
+/// LAYOUT is the storage order of the fields (see GridLayout.h). The
+/// SIMD row kernels and the sparse stepping need GridLayoutLinear,
+/// the others go a run of contiguous cells at a time
+//==================================================================
+template <int NX_, int NY_, bool DO_BOUND,
+          template <int,int> class LAYOUT = GridLayoutLinear,
+          unsigned POLICY = 0,
+          typename STORAGE = float>
+class FluidSolverT final : public FluidSolverBase
+{
+    friend struct FluidBenchAccess;
+
+    using Layout = LAYOUT<NX_,NY_>;
+
+    static const bool IS_SCALAR_F32 = std::is_same_v<STORAGE, float>;
+
+    Layout  mLayout;
+
+    // blocks stepped by the current stage, null for all
+    const FluidActiveTiles  *mpAct {};
+
+    // linear copies of the pressure solve, for the multigrid and PCG
+    //  solvers with layouts that aren't linear
+    FluidField  mLinearP;
+    FluidField  mLinearDiv;
+
+    enum BType
+    {
+        BTYPE_REPEL0, // repel on x
+        BTYPE_REPEL1, // repel on y
+        BTYPE_EXPAND  // spill onto the border
+    };
+
+public:
+    FluidSolverT( int nx = NX_, int ny = NY_ )
+        : FluidSolverBase( nx, ny, DO_BOUND, POLICY, FluidStorageOf<STORAGE>::value,
+                           Layout::TYPE, Layout( nx, ny ).GetCellsN() )
+        , mLayout( nx, ny )
+    {
+        assert( nx > 0 && ny > 0 );
+        assert( (!NX_ || nx == NX_) && (!NY_ || ny == NY_) );
+    }
+
+    template <typename T>
+    T &SMP( T *p, int i, int j ) const { return p[ mLayout.IX(i,j) ]; }
+    const float &SMP(const FluidField &v, int i, int j) const { return v[ mLayout.IX(i,j) ]; }
+
+    template <int DIM_IDX>
+    const float &SMPVel(int i, int j) const { return mCurVel[DIM_IDX][ mLayout.IX(i,j) ]; }
+    template <int DIM_IDX>
+          float &SMPVel(int i, int j)
+    {
+        markDirty( i, i, j, j );
+        return mCurVel[DIM_IDX][ mLayout.IX(i,j) ];
+    }
+
+    // the cells of the scalar grid, if set
+    const STORAGE &SMPDen(int i, int j) const { return SMPScalar( 0, i, j ); }
+          STORAGE &SMPDen(int i, int j)       { return SMPScalar( 0, i, j ); }
+
+    const STORAGE &SMPScalar(int ch, int i, int j) const
+    {
+        return moScalGrid ? *(const STORAGE *)scalarCell( ch, i, j )
+                          : scalarField( ch )[ mLayout.IX(i,j) ];
+    }
+          STORAGE &SMPScalar(int ch, int i, int j)
+    {
+        markScalarsDirty( i, i, j, j );
+        return const_cast<STORAGE &>( std::as_const( *this ).SMPScalar( ch, i, j ) );
+    }
+
+    void dens_step( float diff, float dt ) override;
+    void vel_step( float visc, float dt ) override;
+    void Step( float visc, float diff, float dt ) override;
+
+    // the scalars are converted from and to float
+    void CopyCellsOut( Field f, int i0, int i1, int j0, int j1, float *pDst ) const override
+    {
+        auto copy = [&]( const auto *pF )
+        {
+            for (int j=j0; j <= j1; ++j)
+                for (int i=i0; i <= i1; ++i)
+                    *pDst++ = SMP( pF, i, j );
+        };
+        if ( f >= FIELD_DEN )
+            copy( scalarField( f - FIELD_DEN ) );
+        else
+            copy( getField( f ) );
+    }
+    void CopyCellsIn( Field f, int i0, int i1, int j0, int j1, const float *pSrc ) override
+    {
+        auto copy = [&]( auto *pF )
+        {
+            for (int j=j0; j <= j1; ++j)
+                for (int i=i0; i <= i1; ++i)
+                    SMP( pF, i, j ) = *pSrc++;
+        };
+        markDirty( i0, i1, j0, j1 );
+        if ( f >= FIELD_DEN )
+            copy( scalarField( f - FIELD_DEN ) );
+        else
+            copy( getField( f ) );
+    }
+
+protected:
+    const float &smpVel( int dimIdx, int i, int j ) const override
+    {
+        return mCurVel[dimIdx][ mLayout.IX(i,j) ];
+    }
+    const void *smpScalar( int ch, int i, int j ) const override
+    {
+        return &scalarField( ch )[ mLayout.IX(i,j) ];
+    }
+
+private:
+    const STORAGE *scalarField( int ch ) const
+    {
+        assert( !moScalGrid && ch >= 0 && ch < GetScalarsN() );
+        return (const STORAGE *)mCurScal[ch].data();
+    }
+    STORAGE *scalarField( int ch )
+    {
+        return const_cast<STORAGE *>( std::as_const( *this ).scalarField( ch ) );
+    }
+
+    template <typename T> void initPadding( T *x, const T *src );
+    template <typename T> void setBoundary( BType b, T *x );
+    // velocity and all the scalars
+    static const int BATCH_MAX = DIMS_N + SCALARS_MAX;
+
+    // one of the independent systems relaxed together by lin_solve.
+    //  ooc and deltaSca are set by lin_solve. T is float or STORAGE
+    template <typename T>
+    struct RelaxField
+    {
+        BType       b;
+        T           *x;
+        const T     *x0;
+        float       a;
+        float       c;
+        float       ooc;
+        float       deltaSca;   // 1 / the change that counts as converged
+    };
+
+    template <typename T>
+    struct DiffuseField
+    {
+        BType       b;
+        T           *x;
+        const T     *x0;
+        float       diff;
+    };
+
+    // a lin_solve() that goes a band of rows of a sweep at a time. The
+    //  fields are relaxed all at once or one after the other, a group
+    //  at a time
+    template <typename T>
+    struct RelaxJob
+    {
+        RelaxField<T>   fields[BATCH_MAX];
+        int             fieldsN {};
+        // rows of a slice, 0 for whole sweeps (or colors of red-black)
+        int             sliceRows {};
+        // the group being relaxed, the job is done at fieldsN
+        int             groupBegin {};
+        int             groupEnd {};
+        int             maxIters {};
+        bool            doDelta {};
+        int             iter {};
+        // where the sweep is at, and its largest change so far
+        int             color {};
+        int             jNext = 1;
+        float           maxDelta {};
+        // the most sweeps of the groups done
+        int             itersN {};
+    };
+
+    // the fields set in the job, from the first group
+    template <typename T> void beginRelax( RelaxJob<T> &job );
+    template <typename T> void beginRelaxGroup( RelaxJob<T> &job );
+    // a slice of a sweep of the group, moving to the next group once
+    //  it's converged. False if the job was already done. Sets
+    //  mLastRelaxItersN when done
+    template <typename T> bool relaxSlice( RelaxJob<T> &job );
+
+    // returns the sweeps done
+    template <typename T>
+    int lin_solve( RelaxField<T> *pFields, int fieldsN );
+    template <typename T>
+    int lin_solve( BType b, T *x, const T *x0, float a, float c )
+    {
+        RelaxField<T> f { b, x, x0, a, c, 0, 0 };
+        return lin_solve( &f, 1 );
+    }
+    // the rows [jBegin,jEnd) of a sweep, returning the largest change
+    //  of a cell (times deltaSca) if doDelta. Red-black goes over the
+    //  cells of a color, for all the fields at once
+    template <typename T>
+    float relaxSweepGS( const RelaxField<T> &f, bool doDelta, int jBegin, int jEnd );
+    template <typename T>
+    float relaxSweepRB( const RelaxField<T> *pFields, int fieldsN, bool doDelta,
+                        int color, int jBegin, int jEnd );
+    // Gauss-Seidel sweep for layouts that aren't linear, a run at a time
+    //  in memory order. Rows are split at the rows of tiles
+    template <typename T>
+    float relaxRunsGS( const RelaxField<T> &f, bool doDelta, int jBegin, int jEnd );
+    // x0 into x for all the fields, those with no diffusion are copied
+    //  and the others set to be relaxed together by the job
+    template <typename T>
+    void beginDiffuse( const DiffuseField<T> *pFields, int fieldsN, float dt, RelaxJob<T> &job );
+
+    // the row and tile kernels for fields of type T
+    template <typename T>
+    FluidStorageKernels<T> kernelsOf() const
+    {
+        const auto &k = *mpKernels;
+        if constexpr ( std::is_same_v<T, FluidHalf> )
+            return k.f16;
+        else
+        if constexpr ( std::is_same_v<T, FluidBFloat16> )
+            return k.bf16;
+        else
+            return { k.RelaxRowRB, k.RelaxRowRBDelta, k.AdvectRowN,
+                     k.RelaxTileRB, k.RelaxTileRBDelta, k.AdvectTileN,
+                     k.SplatRunN };
+    }
+
+    float velocityDiff( float visc ) const
+    {
+        return (POLICY & POLICY_INVISCID) ? 0.f : visc;
+    }
+    float scalarDiff( int ch, float diff ) const
+    {
+        return (POLICY & POLICY_NO_DIFFUSION) ? 0.f : diff * mScalDiffSca[ch];
+    }
+
+    // the fieldsN fields of ppD0 into ppD, along the same trace
+    template <typename T>
+    void advect(
+        T *const *ppD,
+        const T *const *ppD0,
+        int fieldsN,
+        const float *u,
+        const float *v,
+        float dt );
+
+    template <typename T>
+    void advect( T *d, const T *d0, const float *u, const float *v, float dt )
+    {
+        advect( &d, &d0, 1, u, v, dt );
+    }
+    // the same, for the rows [jBegin,jEnd)
+    template <typename T>
+    void advectRows(
+        T *const *ppD,
+        const T *const *ppD0,
+        int fieldsN,
+        const float *u,
+        const float *v,
+        float dt,
+        int jBegin,
+        int jEnd );
+
+    void project( float *u, float *v, float *p, float *div );
+    // the steps of project(): the divergence by rows, the pressure
+    //  solve, which is left to the job if it's relaxed, the gradient
+    //  taken off by rows and the boundaries
+    void divergenceRows( const float *u, const float *v, float *div, int jBegin, int jEnd );
+    void beginPressure( float *p, float *div, RelaxJob<float> &job );
+    void subGradientRows( float *u, float *v, const float *p, int jBegin, int jEnd );
+    void endProject( float *u, float *v, const RelaxJob<float> &job );
+    void addBinnedSplats( const Splat *pSplats ) override;
+    // multigrid or PCG solve of the pressure
+    void solvePoisson( float *p, const float *div );
+
+    // the velocity interpolated to the rows [jBegin,jEnd) of the
+    //  scalar grid, for its step
+    void upsampleToScalarGrid( int jBegin, int jEnd );
+
+    // stages of a step, see stepSlice()
+    enum StepStage
+    {
+        STAGE_DIFFUSE,          // the velocity, with float scalars
+        STAGE_DIFFUSE_SCALARS,  // the scalars on their own
+        STAGE_DIVERGENCE,       // of the projection projIdx
+        STAGE_PRESSURE,
+        STAGE_SUB_GRADIENT,
+        STAGE_ADVECT,
+        STAGE_UPSAMPLE,         // the velocity to the scalar grid
+        STAGE_SCALAR_GRID,      // slices of the scalar grid's step
+        STAGE_DONE,
+    };
+
+    // what a step keeps across its slices
+    struct StepState
+    {
+        StepMode    mode  = STEP_ALL;
+        StepStage   stage = STAGE_DONE;
+        bool        isSliced {};
+        // rows of a slice of a pass, 0 for whole passes, and the next
+        //  row of the current pass
+        int         sliceRows {};
+        int         jNext = 1;
+        int         projIdx {};
+        float       diff {};
+        float       dt {};
+        float       *pTmpVel[DIMS_N] {};
+        // channels of this grid that the step moves
+        int         scalN {};
+        STORAGE     *ppScalDst[SCALARS_MAX] {};
+        STORAGE     *ppScalTmp[SCALARS_MAX] {};
+        // the velocity, and the scalars if they're float
+        RelaxJob<float>     velJob;
+        RelaxJob<STORAGE>   scalJob;
+        RelaxJob<float>     preJob;
+        int                 velItersN {};
+    };
+    StepState   mStep;
+
+    void beginStep( StepMode mode, float visc, float diff, float dt, bool isSliced ) override;
+    bool stepSlice() override;
+    // the next band of rows [jBegin,jEnd) of a pass of the step, true
+    //  if it's the last one
+    bool nextStepRows( int &jBegin, int &jEnd );
+    // diffusion of the scalars of the step
+    void scalarDiffs( DiffuseField<STORAGE> *pOut ) const;
+    // the advection of the step for the rows [jBegin,jEnd), with the
+    //  boundaries after the last ones
+    void advectStep( int jBegin, int jEnd, bool isLast );
+
+    // float fields and scalar ones
+    struct FieldSet
+    {
+        float   *const *ppF;
+        int     fN;
+        STORAGE *const *ppS;
+        int     sN;
+    };
+    // sets mpAct from the cells of the fields over the thresholds, when
+    //  sparse. The float fields of cur are the velocity, and come with
+    //  the pressure. The gaps of all read as empty
+    void beginSparse( const FieldSet &cur, const FieldSet &scratch, float dt );
+    void endSparse() { mpAct = nullptr; }
+
+    // fn( j, i0, i1 ) for the rows [jBegin,jEnd), whole or only their
+    //  active spans
+    template <typename F>
+    void forEachSpan( int jBegin, int jEnd, const F &fn ) const
+    {
+        const int NX = mLayout.NX();
+        for (int j=jBegin; j < jEnd; ++j)
+        {
+            if ( mpAct )
+                mpAct->ForEachSpan( j, [&]( int i0, int i1 ) { fn( j, i0, i1 ); } );
+            else
+                fn( j, 1, NX );
+        }
+    }
+
+    // fn( bandBegin, bandEnd ) over bands of the rows [jBegin,jEnd), on
+    //  the pool if set. Bands are whole rows of tiles with tiled layouts,
+    //  for a jBegin at the start of one
+    template <typename F>
+    void forEachBand( int jBegin, int jEnd, const F &fn ) const
+    {
+        const int B = Layout::BAND_ROWS;
+        auto bands = [&]( int b0, int b1 )
+        {
+            fn( jBegin + b0 * B, std::min( jBegin + b1 * B, jEnd ) );
+        };
+
+        const int bandsN = (jEnd - jBegin + B-1) / B;
+        if ( mpPool )
+            mpPool->ParallelFor( 0, bandsN, bands );
+        else
+            bands( 0, bandsN );
+    }
+
+    // ForEachCell() of the rows [jBegin,jEnd) of the interior, or of
+    //  their active cells
+    template <typename F>
+    void forEachActiveCell( int jBegin, int jEnd, const F &fn ) const
+    {
+        if ( !mpAct )
+        {
+            mLayout.ForEachCell( 1, mLayout.NX(), jBegin, jEnd-1, fn );
+            return;
+        }
+        forEachSpan( jBegin, jEnd, [&]( int j, int i0, int i1 )
+        {
+            for (int i=i0; i <= i1; ++i)
+                fn( i, j );
+        });
+    }
+    template <typename F>
+    void forEachActiveCell( const F &fn ) const { forEachActiveCell( 1, mLayout.NY()+1, fn ); }
+};
+
+// square solver of size fixed at compile time
+template <int N, bool DO_BOUND, template <int,int> class LAYOUT = GridLayoutLinear,
+          unsigned POLICY = 0, typename STORAGE = float>
+using FluidSolver = FluidSolverT<N,N,DO_BOUND,LAYOUT,POLICY,STORAGE>;
+
+// picks a specialized solver for the size if there's one, or the
+//  generic one otherwise. policy is a mask of FluidSolverBase::Policy,
+//  scalStorage the type of the scalars. Only float scalars in linear
+//  layouts have solvers specialized for the size
+std::unique_ptr<FluidSolverBase> CreateFluidSolver( int nx, int ny, bool doBound, unsigned policy=0,
+                                                    FluidStorage scalStorage=FLUIDSTORAGE_F32,
+                                                    FluidLayout gridLayout=FLUIDLAYOUT_LINEAR );
+
+//==================================================================
+#define FS_TEMPLATE template <int NX_, int NY_, bool DO_BOUND, template <int,int> class LAYOUT, \
+                              unsigned POLICY, typename STORAGE>
+#define FS_CLASS    FluidSolverT<NX_,NY_,DO_BOUND,LAYOUT,POLICY,STORAGE>
+
+//==================================================================
+FS_TEMPLATE
+template <typename T>
+void FS_CLASS::setBoundary( BType b, T *x )
+{
+    FLUID_TRACE_SCOPE( "setBoundary" );
+
+    const int NX = mLayout.NX();
+    const int NY = mLayout.NY();
+
+    // open sides belong to the neighbors
+    const int open = mOpenSides;
+
+    // bottom and top rows are contiguous, the side columns are visited
+    //  a row at a time
+    const float sy = b==BTYPE_REPEL1 ? -1.f : 1.f;
+    if ( !(open & SIDE_BOTTOM) )
+        for (int i=1; i <= NX; ++i)
+            SMP(x, i   ,    0) = sy * SMP(x, i, 1 );
+
+    if ( !(open & SIDE_TOP) )
+        for (int i=1; i <= NX; ++i)
+            SMP(x, i   , NY+1) = sy * SMP(x, i, NY);
+
+    const float sx = b==BTYPE_REPEL0 ? -1.f : 1.f;
+    if ( !(open & SIDE_LEFT) )
+        for (int j=1; j <= NY; ++j)
+            SMP(x, 0   ,    j) = sx * SMP(x, 1 , j);
+
+    if ( !(open & SIDE_RIGHT) )
+        for (int j=1; j <= NY; ++j)
+            SMP(x, NX+1,    j) = sx * SMP(x, NX, j);
+
+    // a corner between two open sides comes from the diagonal neighbor
+    auto isCornerSet = [open]( int sides ) { return (open & sides) != sides; };
+
+    if ( isCornerSet( SIDE_LEFT  | SIDE_BOTTOM ) )
+        SMP(x, 0   ,0   ) = 0.5f * (SMP(x, 1 , 0   ) + SMP(x, 0   , 1 ));
+    if ( isCornerSet( SIDE_LEFT  | SIDE_TOP ) )
+        SMP(x, 0   ,NY+1) = 0.5f * (SMP(x, 1 , NY+1) + SMP(x, 0   , NY));
+    if ( isCornerSet( SIDE_RIGHT | SIDE_BOTTOM ) )
+        SMP(x, NX+1,0   ) = 0.5f * (SMP(x, NX, 0   ) + SMP(x, NX+1, 1 ));
+    if ( isCornerSet( SIDE_RIGHT | SIDE_TOP ) )
+        SMP(x, NX+1,NY+1) = 0.5f * (SMP(x, NX, NY+1) + SMP(x, NX+1, NY));
+}
+
+FS_TEMPLATE
+template <typename T>
+void FS_CLASS::beginRelax( RelaxJob<T> &job )
+{
+    job.groupBegin = 0;
+    job.itersN = 0;
+    if ( job.fieldsN )
+        beginRelaxGroup( job );
+    else
+        mLastRelaxItersN = 0;
+}
+
+FS_TEMPLATE
+template <typename T>
+void FS_CLASS::beginRelaxGroup( RelaxJob<T> &job )
+{
+    // batching only pays with a pool, where all the fields share the
+    //  dispatch of a sweep. Serially, a field at a time stays in cache
+    //  across the sweeps
+    const bool isBatched = mpPool && mRelaxMode == RELAX_RED_BLACK;
+    job.groupEnd = isBatched ? job.fieldsN : job.groupBegin + 1;
+    job.iter = 0;
+    job.color = 0;
+    job.jNext = 1;
+    job.maxDelta = 0;
+
+    auto *pFields = job.fields + job.groupBegin;
+    const int fieldsN = job.groupEnd - job.groupBegin;
+
+    // with no coupling between cells the first sweep is the solution
+    bool isCoupled = false;
+    for (int k=0; k < fieldsN; ++k)
+    {
+        pFields[k].ooc = 1.f / pFields[k].c;
+        isCoupled = isCoupled || pFields[k].a != 0;
+    }
+    job.maxIters = isCoupled ? std::max( mRelaxParams.maxIters, 1 ) : 1;
+
+    // a cell changes by its residual / c, so the largest change of a
+    //  sweep gives the residual that it started from (max norm).
+    //  Changes are scaled per field, so that all converge at 1
+    job.doDelta = mRelaxParams.tolerance > 0 && job.maxIters > 1;
+    if ( job.doDelta )
+    {
+        for (int k=0; k < fieldsN; ++k)
+        {
+            auto &f = pFields[k];
+            float x0Max = 0;
+            forEachActiveCell( [&]( int i, int j )
+            {
+                x0Max = std::max( x0Max, fabsf( SMP(f.x0, i, j) ) );
+            });
+            f.deltaSca = 1.f / (mRelaxParams.tolerance * std::max( x0Max, 1e-20f ) * f.ooc);
+        }
+    }
+}
+
+FS_TEMPLATE
+template <typename T>
+bool FS_CLASS::relaxSlice( RelaxJob<T> &job )
+{
+    if ( job.groupBegin >= job.fieldsN )
+        return false;
+
+    // Gauss-Seidel relaxation:
+    //  http://en.wikipedia.org/wiki/Gauss%E2%80%93Seidel_method
+    const auto *pFields = job.fields + job.groupBegin;
+    const int fieldsN = job.groupEnd - job.groupBegin;
+
+    const int NY = mLayout.NY();
+    const bool isRB = mRelaxMode == RELAX_RED_BLACK;
+
+    const int jBegin = job.jNext;
+    const int jEnd = job.sliceRows ? std::min( jBegin + job.sliceRows, NY+1 ) : NY+1;
+    job.maxDelta = std::max( job.maxDelta, isRB
+                    ? relaxSweepRB( pFields, fieldsN, job.doDelta, job.color, jBegin, jEnd )
+                    : relaxSweepGS( pFields[0], job.doDelta, jBegin, jEnd ) );
+
+    // the rest of the sweep, or of the other color, in the next slices
+    job.jNext = jEnd > NY ? 1 : jEnd;
+    if ( jEnd <= NY )
+        return true;
+
+    if ( isRB && !job.color )
+    {
+        job.color = 1;
+        return true;
+    }
+    job.color = 0;
+
+    const float maxDelta = job.maxDelta;
+    job.maxDelta = 0;
+    ++job.iter;
+
+    if ( DO_BOUND )
+        for (int k=0; k < fieldsN; ++k)
+            setBoundary( pFields[k].b, pFields[k].x );
+
+    if ( job.iter < job.maxIters && !(job.doDelta && maxDelta <= 1.f) )
+        return true;
+
+    job.itersN = std::max( job.itersN, job.iter );
+    job.groupBegin = job.groupEnd;
+    if ( job.groupBegin < job.fieldsN )
+        beginRelaxGroup( job );
+    else
+        mLastRelaxItersN = job.itersN;
+
+    return true;
+}
+
+FS_TEMPLATE
+template <typename T>
+int FS_CLASS::lin_solve( RelaxField<T> *pFields, int fieldsN )
+{
+    FLUID_TRACE_SCOPE( "lin_solve" );
+
+    RelaxJob<T> job;
+    job.fieldsN = fieldsN;
+    std::copy( pFields, pFields + fieldsN, job.fields );
+
+    beginRelax( job );
+    while ( relaxSlice( job ) )
+    {
+    }
+    return job.itersN;
+}
+
+FS_TEMPLATE
+template <typename T>
+float FS_CLASS::relaxSweepGS( const RelaxField<T> &f, bool doDelta, int jBegin, int jEnd )
+{
+    if constexpr ( !Layout::IS_LINEAR )
+        return relaxRunsGS( f, doDelta, jBegin, jEnd );
+
+    float maxDelta = 0;
+    forEachActiveCell( jBegin, jEnd, [&]( int i, int j )
+    {
+        const float nx = (    SMP(f.x0, i  , j  ) +
+                         f.a*(SMP(f.x , i-1, j  ) +
+                              SMP(f.x , i+1, j  ) +
+                              SMP(f.x , i  , j-1) +
+                              SMP(f.x , i  , j+1))) * f.ooc;
+        if ( doDelta )
+            maxDelta = std::max( maxDelta, fabsf( nx - SMP(f.x,i,j) ) * f.deltaSca );
+
+        SMP(f.x,i,j) = nx;
+    });
+    return maxDelta;
+}
+
+FS_TEMPLATE
+template <typename T>
+float FS_CLASS::relaxSweepRB(
+        const RelaxField<T> *pFields, int fieldsN, bool doDelta, int color, int jBegin, int jEnd )
+{
+    // Red-black ordering: cells of one color only depend on cells of the
+    //  other color, so each half-sweep can be split in bands of rows
+    //  with no ordering constraints between them. All the fields go
+    //  through a band at once, one dispatch per color
 
-    enum BType
+    // the largest of the bands, which are usually few
+    std::atomic<float> maxDelta {0.f};
+    auto mergeDelta = [&]( float d )
     {
-        BTYPE_REPEL0, // repel on x
-        BTYPE_REPEL1, // repel on y
-        BTYPE_EXPAND  // spill onto the border
+        auto cur = maxDelta.load( std::memory_order_relaxed );
+        while ( d > cur && !maxDelta.compare_exchange_weak( cur, d, std::memory_order_relaxed ) )
+        {
+        }
     };
 
-public:
-    FluidSolver()
+    auto relaxRows = [&]( int bandBegin, int bandEnd )
     {
-        const auto size = (N+2) *(N+2);
+        float bandDelta = 0;
+        // a field at a time, to keep its band in cache
+        const auto kern = kernelsOf<T>();
+        if constexpr ( Layout::IS_LINEAR )
+        {
+            const int stride = mLayout.RowStride();
+            for (int k=0; k < fieldsN; ++k)
+            {
+                const auto &f = pFields[k];
+                forEachSpan( bandBegin, bandEnd, [&]( int j, int i0, int i1 )
+                {
+                    if ( doDelta )
+                        bandDelta = std::max( bandDelta, f.deltaSca *
+                            kern.RelaxRowRBDelta( f.x, f.x0, stride, j, i0, i1, color, f.a, f.ooc ) );
+                    else
+                        kern.RelaxRowRB( f.x, f.x0, stride, j, i0, i1, color, f.a, f.ooc );
+                });
+            }
+        }
+        else
+        {
+            for (int k=0; k < fieldsN; ++k)
+            {
+                const auto &f = pFields[k];
+                mLayout.ForEachTile( 1, mLayout.NX(), bandBegin, bandEnd-1, [&]( const GridTileSpan &t )
+                {
+                    if ( doDelta )
+                        bandDelta = std::max( bandDelta, f.deltaSca *
+                            kern.RelaxTileRBDelta( f.x, f.x0, t, color, f.a, f.ooc ) );
+                    else
+                        kern.RelaxTileRB( f.x, f.x0, t, color, f.a, f.ooc );
+                });
+            }
+        }
 
-        mCurVel[0].resize( size );
-        mCurVel[1].resize( size );
-        mCurDen.resize( size );
+        if ( doDelta )
+            mergeDelta( bandDelta );
+    };
 
-        Clear();
-    }
+    forEachBand( jBegin, jEnd, relaxRows );
 
-    void Clear()
+    return maxDelta.load( std::memory_order_relaxed );
+}
+
+FS_TEMPLATE
+template <typename T>
+float FS_CLASS::relaxRunsGS( const RelaxField<T> &f, bool doDelta, int jBegin, int jEnd )
+{
+    float maxDelta = 0;
+    mLayout.ForEachRun( 1, mLayout.NX(), jBegin, jEnd-1, [&]( int j, int i0, int i1, int idx )
     {
-        for (int i=0; i < DIMS_N; ++i)
-            for (auto &x : mCurVel[i])
-                x = 0;
+        // the rows above and below are runs as well, the cells on the
+        //  sides may be in other tiles
+        T       *pX  = f.x + idx;
+        const T *pX0 = f.x0 + idx;
+        const T *pN  = &SMP( f.x, i0, j+1 );
+        const T *pS  = &SMP( f.x, i0, j-1 );
+        const T *pW  = &SMP( f.x, i0-1, j );
+        const T *pE  = &SMP( f.x, i1+1, j );
+        const int last = i1 - i0;
 
-        for (auto &x : mCurDen)
-            x = 0;
-    }
+        for (int k=0; k <= last; ++k)
+        {
+            const float nx = (pX0[k] + f.a * ((k ? pX[k-1] : *pW) + (k < last ? pX[k+1] : *pE) +
+                                              pS[k] + pN[k])) * f.ooc;
+            if ( doDelta )
+                maxDelta = std::max( maxDelta, fabsf( nx - pX[k] ) * f.deltaSca );
 
-    static size_t GetTempBuffMaxSize()
-    {
-        return std::max(
-                getVelCoordBuffSize() * DIMS_N,
-                getDenBuffSize() );
-    }
+            pX[k] = nx;
+        }
+    });
+    return maxDelta;
+}
 
-    static       float &SMP(      float *p, int i, int j) { return p[ i + (N+2) *j ]; }
-    static const float &SMP(const float *p, int i, int j) { return p[ i + (N+2) *j ]; }
-    static const float &SMP(const std::vector<float> &v, int i, int j) { return v[ i + (N+2) *j ]; }
+FS_TEMPLATE
+template <typename T>
+void FS_CLASS::beginDiffuse( const DiffuseField<T> *pFields, int fieldsN, float dt, RelaxJob<T> &job )
+{
+    FLUID_TRACE_SCOPE( "diffuse" );
 
-    template <int DIM_IDX>
-    const float &SMPVel(int i, int j) const { return mCurVel[DIM_IDX][ i + (N+2) *j ]; }
-    template <int DIM_IDX>
-          float &SMPVel(int i, int j)       { return mCurVel[DIM_IDX][ i + (N+2) *j ]; }
+    assert( fieldsN <= BATCH_MAX );
 
-    const float &SMPDen(int i, int j) const { return mCurDen[ i + (N+2) *j ]; }
-          float &SMPDen(int i, int j)       { return mCurDen[ i + (N+2) *j ]; }
+    const float invH = getInvH();
 
-    void dens_step( char *pTmpBuff, float diff, float dt );
-    void vel_step( char *pTmpBuff, float visc, float dt );
+    job.fieldsN = 0;
+    for (int k=0; k < fieldsN; ++k)
+    {
+        const auto &f = pFields[k];
+        if ( f.diff != 0 )
+        {
+            float a = dt * f.diff * invH * invH;
+            job.fields[job.fieldsN++] = { f.b, f.x, f.x0, a, 1+4*a, 0, 0 };
 
-private:
-    static void clearPadding( float *x );
-    void setBoundary( BType b, float *x );
-    void lin_solve( BType b, float *x, const float *x0, float a, float c );
-    void diffuse( BType b, float *x, const float *x0, float diff, float dt );
+            // the relaxation starts from what's in x, a scratch field
+            //  that other passes and the solvers sharing the workspace
+            //  write, so it starts from x0 instead, for a step to only
+            //  depend on the fields (see LoadCheckpoint())
+            forEachActiveCell( [&]( int i, int j ) { SMP(f.x, i, j) = SMP(f.x0, i, j); } );
+            continue;
+        }
 
-    void advect(
-        float *d,
-        const float *d0,
+        // what a relaxation with no coupling gives
+        forEachActiveCell( [&]( int i, int j )
+        {
+            SMP(f.x, i, j) = SMP(f.x0, i, j);
+        });
+        if ( DO_BOUND ) setBoundary( f.b, f.x );
+    }
+
+    beginRelax( job );
+}
+
+FS_TEMPLATE
+template <typename T>
+void FS_CLASS::advect(
+        T *const *ppD,
+        const T *const *ppD0,
+        int fieldsN,
         const float *u,
         const float *v,
-        float dt );
+        float dt )
+{
+    advectRows( ppD, ppD0, fieldsN, u, v, dt, 1, mLayout.NY()+1 );
+}
 
-    void project( float *u, float *v, float *p, float *div );
+FS_TEMPLATE
+template <typename T>
+void FS_CLASS::advectRows(
+        T *const *ppD,
+        const T *const *ppD0,
+        int fieldsN,
+        const float *u,
+        const float *v,
+        float dt,
+        int jBegin,
+        int jEnd )
+{
+    FLUID_TRACE_SCOPE( "advect" );
 
-    static size_t getVelCoordBuffSize() { return (N+2) * (N+2) * sizeof(float); }
-    static size_t getDenBuffSize()      { return (N+2) * (N+2) * sizeof(float); }
-};
+    const int NX = mLayout.NX();
+    const int NY = mLayout.NY();
 
-//==================================================================
-template <int N, bool DO_BOUND>
-void FluidSolver<N,DO_BOUND>::setBoundary( BType b, float *x )
+    float dt0 = dt * getInvH();
+
+    if constexpr ( Layout::IS_LINEAR )
+    {
+        const int stride = mLayout.RowStride();
+        forEachSpan( jBegin, jEnd, [&]( int j, int i0, int i1 )
+        {
+            kernelsOf<T>().AdvectRowN( ppD, ppD0, fieldsN, u, v, stride, j, i0, i1,
+                                       dt0, NX + 0.5f, NY + 0.5f );
+        });
+    }
+    else
+    {
+        const int tilesX = mLayout.GetTilesX();
+        mLayout.ForEachTile( 1, NX, jBegin, jEnd-1, [&]( const GridTileSpan &t )
+        {
+            kernelsOf<T>().AdvectTileN( ppD, ppD0, fieldsN, u, v, t, tilesX,
+                                        dt0, NX + 0.5f, NY + 0.5f );
+        });
+    }
+}
+
+FS_TEMPLATE
+void FS_CLASS::project( float *u, float *v, float *p, float *div )
 {
-    for (int i=1; i <= N; ++i)
+    FLUID_TRACE_SCOPE( "project" );
+
+    const int NY = mLayout.NY();
+
+    RelaxJob<float> job;
+    divergenceRows( u, v, div, 1, NY+1 );
+    beginPressure( p, div, job );
+    while ( relaxSlice( job ) )
     {
-        SMP(x, 0  ,   i) = b==BTYPE_REPEL0 ? -SMP(x, 1, i) : SMP(x, 1, i);
-        SMP(x, N+1,   i) = b==BTYPE_REPEL0 ? -SMP(x, N, i) : SMP(x, N, i);
-        SMP(x, i  ,   0) = b==BTYPE_REPEL1 ? -SMP(x, i, 1) : SMP(x, i, 1);
-        SMP(x, i  , N+1) = b==BTYPE_REPEL1 ? -SMP(x, i, N) : SMP(x, i, N);
     }
-    SMP(x, 0  ,0  ) = 0.5f * (SMP(x, 1, 0  ) + SMP(x, 0  , 1));
-    SMP(x, 0  ,N+1) = 0.5f * (SMP(x, 1, N+1) + SMP(x, 0  , N));
-    SMP(x, N+1,0  ) = 0.5f * (SMP(x, N, 0  ) + SMP(x, N+1, 1));
-    SMP(x, N+1,N+1) = 0.5f * (SMP(x, N, N+1) + SMP(x, N+1, N));
+    subGradientRows( u, v, p, 1, NY+1 );
+    endProject( u, v, job );
 }
 
-template <int N, bool DO_BOUND>
-void FluidSolver<N,DO_BOUND>::lin_solve( BType b, float *x, const float *x0, float a, float c )
+FS_TEMPLATE
+void FS_CLASS::divergenceRows( const float *u, const float *v, float *div, int jBegin, int jEnd )
 {
-    // Gauss-Seidel relaxation:
-    //  http://en.wikipedia.org/wiki/Gauss%E2%80%93Seidel_method
+    const float sca = -0.5f / getInvH();
+    if constexpr ( Layout::IS_LINEAR )
+    {
+        const int stride = mLayout.RowStride();
+        forEachSpan( jBegin, jEnd, [&]( int j, int i0, int i1 )
+        {
+            mpKernels->DivergenceRow( div, u, v, stride, j, i0, i1, sca );
+        });
+    }
+    else
+    {
+        mLayout.ForEachTile( 1, mLayout.NX(), jBegin, jEnd-1, [&]( const GridTileSpan &t )
+        {
+            mpKernels->DivergenceTile( div, u, v, t, sca );
+        });
+    }
+}
+
+FS_TEMPLATE
+void FS_CLASS::beginPressure( float *p, float *div, RelaxJob<float> &job )
+{
+    if ( !mWarmStartPressure )
+        forEachActiveCell( [&]( int i, int j ) { SMP(p, i, j) = 0; } );
+
+    if ( DO_BOUND ) setBoundary( BTYPE_EXPAND, div );
+    if ( DO_BOUND ) setBoundary( BTYPE_EXPAND, p );
 
-    float ooc = 1.f / c;
+    job.fieldsN = 0;
+    if ( mPressureSolver == PSOLVER_RELAX )
+    {
+        job.fields[job.fieldsN++] = { BTYPE_EXPAND, p, div, 1, 4, 0, 0 };
+        beginRelax( job );
+    }
+    else
+        solvePoisson( p, div );
+}
 
-    for (int k=0 ; k < RELAX_ITER_COUNT; ++k)
+FS_TEMPLATE
+void FS_CLASS::subGradientRows( float *u, float *v, const float *p, int jBegin, int jEnd )
+{
+    const float sca = 0.5f * getInvH();
+    if constexpr ( Layout::IS_LINEAR )
     {
-        for (int i=1; i <= N; ++i)
+        const int stride = mLayout.RowStride();
+        forEachSpan( jBegin, jEnd, [&]( int j, int i0, int i1 )
         {
-            for (int j=1; j <= N; ++j)
-            {
-                SMP(x,i,j) = (    SMP(x0, i  , j  ) +
-                               a*(SMP(x , i-1, j  ) +
-                                  SMP(x , i+1, j  ) +
-                                  SMP(x , i  , j-1) +
-                                  SMP(x , i  , j+1))) * ooc;
-            }
-        }
-        if ( DO_BOUND ) setBoundary( b, x );
+            mpKernels->SubGradientRow( u, v, p, stride, j, i0, i1, sca );
+        });
+    }
+    else
+    {
+        mLayout.ForEachTile( 1, mLayout.NX(), jBegin, jEnd-1, [&]( const GridTileSpan &t )
+        {
+            mpKernels->SubGradientTile( u, v, p, t, sca );
+        });
     }
 }
 
-template <int N, bool DO_BOUND>
-void FluidSolver<N,DO_BOUND>::diffuse( BType b, float *x, const float *x0, float diff, float dt )
+FS_TEMPLATE
+void FS_CLASS::endProject( float *u, float *v, const RelaxJob<float> &job )
 {
-    float a = dt * diff * N * N;
+    if ( job.fieldsN )
+        mLastPressureRelaxItersN = job.itersN;
 
-    lin_solve( b, x, x0, a, 1+4*a );
+    if ( DO_BOUND ) setBoundary( BTYPE_REPEL0, u );
+    if ( DO_BOUND ) setBoundary( BTYPE_REPEL1, v );
 }
 
-inline float clamp( float x, float mi, float ma )
+//==================================================================
+FS_TEMPLATE
+void FS_CLASS::addBinnedSplats( const Splat *pSplats )
 {
-    auto t = x < mi ? mi : x;
-    return t > ma ? ma : t;
+    const auto &bins = mSplatBins;
+    const auto kF = kernelsOf<float>();
+    const auto kS = kernelsOf<STORAGE>();
+
+    const int NX = mLayout.NX();
+    const int NY = mLayout.NY();
+    const int B  = SPLAT_BIN;
+
+    // the bins don't share cells, so they go in any order
+    auto doBins = [&]( int begin, int end )
+    {
+        for (int b=begin; b < end; ++b)
+        {
+            const int bi0 = 1 + (b % bins.binsX) * B;
+            const int bj0 = 1 + (b / bins.binsX) * B;
+            const int bi1 = std::min( bi0 + B-1, NX );
+            const int bj1 = std::min( bj0 + B-1, NY );
+
+            for (int k=bins.start[b]; k < bins.start[b+1]; ++k)
+            {
+                const auto &s = pSplats[ bins.idx[k] ];
+                const bool isVel = s.target == Splat::TARGET_VELOCITY;
+                const float invR2 = s.radius > 0 ? 1.f / (s.radius * s.radius) : 0.f;
+
+                int j0, j1;
+                splatRows( s, j0, j1 );
+                for (int j=std::max( j0, bj0 ); j <= std::min( j1, bj1 ); ++j)
+                {
+                    int i0, i1;
+                    splatRowCells( s, j, i0, i1 );
+                    i0 = std::max( i0, bi0 );
+                    i1 = std::min( i1, bi1 );
+                    if ( i0 > i1 )
+                        continue;
+
+                    const float dy = (j - 0.5f) - s.pos[1];
+                    mLayout.ForEachRun( i0, i1, j, j, [&]( int, int ri0, int ri1, int idx )
+                    {
+                        const float dx0 = (ri0 - 0.5f) - s.pos[0];
+                        if ( isVel )
+                        {
+                            float *const ppRuns[] = { mCurVel[0].data() + idx, mCurVel[1].data() + idx };
+                            kF.SplatRunN( ppRuns, s.amount, 2, ri1 - ri0 + 1,
+                                          dx0, dy * dy, invR2, s.falloff );
+                        }
+                        else
+                        {
+                            STORAGE *const ppRuns[] = { scalarField( s.target ) + idx };
+                            kS.SplatRunN( ppRuns, s.amount, 1, ri1 - ri0 + 1,
+                                          dx0, dy * dy, invR2, s.falloff );
+                        }
+                    });
+                }
+            }
+        }
+    };
+
+    const int binsN = bins.binsX * bins.binsY;
+    if ( mpPool )
+        mpPool->ParallelFor( 0, binsN, doBins );
+    else
+        doBins( 0, binsN );
 }
 
-template <int N, bool DO_BOUND>
-void FluidSolver<N,DO_BOUND>::advect(
-        float *d,
-        const float *d0,
-        const float *u,
-        const float *v,
-        float dt )
+FS_TEMPLATE
+void FS_CLASS::solvePoisson( float *p, const float *div )
 {
-    float dt0 = dt * N;
+    auto solve = [&]( float *pP, const float *pDiv )
+    {
+        if ( mPressureSolver == PSOLVER_MULTIGRID )
+            moPoissonMG->Solve( pP, pDiv, mMGParams );
+        else
+            moPoissonPCG->Solve( pP, pDiv, mPCGParams );
+    };
 
-    for (int i=1; i <= N; ++i)
+    if constexpr ( Layout::IS_LINEAR )
+    {
+        solve( p, div );
+    }
+    else
     {
-        for (int j=1; j <= N; ++j)
+        // the solvers take linear fields, with the padding
+        const int NX = mLayout.NX();
+        const int NY = mLayout.NY();
+        const int linStride = NX + 2;
+
+        mLinearP.resize( (size_t)linStride * (NY + 2) );
+        mLinearDiv.resize( mLinearP.size() );
+
+        mLayout.ForEachRun( 0, NX+1, 0, NY+1, [&]( int j, int i0, int i1, int idx )
         {
-            float x = i - dt0 * SMP(u,i,j);
-            float y = j - dt0 * SMP(v,i,j);
+            std::copy( p   + idx, p   + idx + (i1 - i0 + 1), &mLinearP[ i0 + linStride * j ] );
+            std::copy( div + idx, div + idx + (i1 - i0 + 1), &mLinearDiv[ i0 + linStride * j ] );
+        });
+
+        solve( mLinearP.data(), mLinearDiv.data() );
 
-            x = clamp( x, 0.5f, N + 0.5f );
+        mLayout.ForEachRun( 0, NX+1, 0, NY+1, [&]( int j, int i0, int i1, int idx )
+        {
+            const auto *pSrc = &mLinearP[ i0 + linStride * j ];
+            std::copy( pSrc, pSrc + (i1 - i0 + 1), p + idx );
+        });
+    }
+}
 
-            int i0 = (int)x;
-            int i1 = i0+1;
+FS_TEMPLATE
+void FS_CLASS::upsampleToScalarGrid( int jBegin, int jEnd )
+{
+    FLUID_TRACE_SCOPE( "upsampleVelocity" );
 
-            y = clamp( y, 0.5f, N + 0.5f );
+    auto &g = *moScalGrid;
+    const int gNX = g.GetNX();
 
-            int j0 = (int)y;
-            int j1 = j0+1;
+    const auto *pCurVel0 = mCurVel[0].data();
+    const auto *pCurVel1 = mCurVel[1].data();
 
-            float s1 = x - i0;
-            float s0 = 1 - s1;
-            float t1 = y - j0;
-            float t0 = 1 - t1;
+    // the rows go through the scratch fields, which the step is done
+    //  with at this stage, a row each for the bands to be apart
+    moWorkspace->Reserve( DIMS_N, (size_t)gNX * g.GetNY() );
+    float *pRows0 = moWorkspace->GetField( 0 );
+    float *pRows1 = moWorkspace->GetField( 1 );
 
-            SMP(d,i,j) = s0 * (t0 * SMP(d0,i0,j0) + t1 * SMP(d0,i0,j1)) +
-                         s1 * (t0 * SMP(d0,i1,j0) + t1 * SMP(d0,i1,j1));
+    // bilinear velocity at the fine cells, a row at a time. Both grids
+    //  span the same domain, so the velocity needs no rescaling
+    auto upsampleRows = [&]( int jBegin, int jEnd )
+    {
+        for (int j=jBegin; j < jEnd; ++j)
+        {
+            float *row0 = pRows0 + (size_t)gNX * (j-1);
+            float *row1 = pRows1 + (size_t)gNX * (j-1);
+            const auto [j0, t1] = mUpsTapsY[j-1];
+            const float t0 = 1 - t1;
+            for (int i=1; i <= gNX; ++i)
+            {
+                const auto [i0, s1] = mUpsTapsX[i-1];
+                const float s0 = 1 - s1;
+                auto smp = [&]( const float *d )
+                {
+                    return s0 * (t0 * SMP(d,i0  ,j0) + t1 * SMP(d,i0  ,j0+1)) +
+                           s1 * (t0 * SMP(d,i0+1,j0) + t1 * SMP(d,i0+1,j0+1));
+                };
+                row0[i-1] = smp( pCurVel0 );
+                row1[i-1] = smp( pCurVel1 );
+            }
+            g.CopyCellsIn( FIELD_VEL0, 1, gNX, j, j, row0 );
+            g.CopyCellsIn( FIELD_VEL1, 1, gNX, j, j, row1 );
         }
-    }
+    };
+
+    if ( mpPool )
+        mpPool->ParallelFor( jBegin, jEnd, upsampleRows );
+    else
+        upsampleRows( jBegin, jEnd );
 }
 
-template <int N, bool DO_BOUND>
-void FluidSolver<N,DO_BOUND>::project( float *u, float *v, float *p, float *div )
+FS_TEMPLATE
+void FS_CLASS::beginSparse( const FieldSet &cur, const FieldSet &scratch, float dt )
 {
-    const float sca = -0.5f / N;
-    for (int i=1; i <= N; ++i)
+    mpAct = nullptr;
+    if constexpr ( Layout::IS_LINEAR )
     {
-        for (int j=1; j <= N; ++j)
+        if ( !mIsSparse )
+            return;
+
+        FLUID_TRACE_SCOPE( "beginSparse" );
+
+        const int NX = mLayout.NX();
+        const int NY = mLayout.NY();
+        const int B  = FluidActiveTiles::BLOCK;
+
+        auto &act = mActTiles;
+        const int bxN = act.GetBlocksX();
+        const int byN = act.GetBlocksY();
+
+        const float velThr = dt > 0
+                                ? mSparseParams.velocityThreshold / (dt * getInvH())
+                                : 0.f;
+
+        // fn( i0, i1, j0, j1 ) for the cells of the blocks that may hold
+        //  values, with the padding next to them. The others are all zero
+        auto forEachHeld = [&]( const auto &fn )
+        {
+            for (int by=0; by < byN; ++by)
+            {
+                const int j0 = by == 0     ? 0    : by * B + 1;
+                const int j1 = by == byN-1 ? NY+1 : (by + 1) * B;
+                for (int bx=0; bx < bxN; ++bx)
+                {
+                    if ( !act.MayHoldValues( bx, by ) )
+                        continue;
+
+                    const int i0 = bx == 0     ? 0    : bx * B + 1;
+                    const int i1 = bx == bxN-1 ? NX+1 : (bx + 1) * B;
+                    fn( bx, by, i0, i1, j0, j1 );
+                }
+            }
+        };
+
+        // blocks with any cell over the threshold. The padding counts, as
+        //  it holds what comes in from the neighbors of open sides
+        act.BeginMap();
+        auto markOver = [&]( const auto *x, float thr )
+        {
+            forEachHeld( [&]( int bx, int by, int i0, int i1, int j0, int j1 )
+            {
+                for (int j=j0; j <= j1 && !act.IsMarked( bx, by ); ++j)
+                {
+                    const auto *pRow = &SMP( x, 0, j );
+                    for (int i=i0; i <= i1; ++i)
+                    {
+                        if ( fabsf( pRow[i] ) > thr )
+                        {
+                            act.Mark( bx, by );
+                            break;
+                        }
+                    }
+                }
+            });
+        };
+        for (int k=0; k < cur.fN; ++k)
+            markOver( cur.ppF[k], velThr );
+        for (int k=0; k < cur.sN; ++k)
+            markOver( cur.ppS[k], mSparseParams.scalarThreshold );
+
+        // grown by the distance of the advection plus the stencil
+        float maxSpeed = 0;
+        forEachHeld( [&]( int, int, int i0, int i1, int j0, int j1 )
+        {
+            for (int d=0; d < DIMS_N; ++d)
+                for (int j=std::max( j0, 1 ); j <= std::min( j1, NY ); ++j)
+                    for (int i=std::max( i0, 1 ); i <= std::min( i1, NX ); ++i)
+                        maxSpeed = std::max( maxSpeed, fabsf( SMP(mCurVel[d], i, j) ) );
+        });
+
+        const int reachN = (int)ceilf( maxSpeed * dt * getInvH() ) + 1;
+        act.Finalize( std::max( (reachN + B-1) / B, 1 ) );
+
+        // the fields left out still have their values in the blocks that
+        //  go idle here
+        if ( cur.fN < DIMS_N || (!moScalGrid && cur.sN < GetScalarsN()) )
+            act.KeepHeld();
+
+        if ( act.IsAllActive() )
+            return;
+
+        mpAct = &act;
+
+        // fields of the solver are cleared in the blocks that go idle, the
+        //  scratch ones as far as the step reads. The pressure solves of
+        //  the whole grid need the gaps of the pressure and of the
+        //  divergence to be clear, and leave the pressure there
+        const bool isWholeGrid = mPressureSolver != PSOLVER_RELAX;
+
+        auto clear = [&]( auto *x, const auto &forEachRun )
         {
-            float dx = SMP(u, i+1, j  ) - SMP(u, i-1, j  );
-            float dy = SMP(v, i  , j+1) - SMP(v, i  , j-1);
+            using T = std::remove_pointer_t<decltype( x )>;
+            for (int j=1; j <= NY; ++j)
+                forEachRun( j, [&]( int i0, int i1 )
+                {
+                    std::fill( &SMP(x, i0, j), &SMP(x, i1, j) + 1, T( 0.f ) );
+                });
+        };
+        auto clearStales = [&]( auto *x ) { clear( x, [&]( int j, const auto &fn ) { act.ForEachStale( j, fn ); } ); };
+        auto clearHalos  = [&]( auto *x ) { clear( x, [&]( int j, const auto &fn ) { act.ForEachHalo( j, fn ); } ); };
+        auto clearGaps   = [&]( auto *x ) { clear( x, [&]( int j, const auto &fn ) { act.ForEachGap( j, fn ); } ); };
+
+        for (int k=0; k < cur.fN; ++k)
+            clearStales( cur.ppF[k] );
+        for (int k=0; k < cur.sN; ++k)
+            clearStales( cur.ppS[k] );
+
+        for (int k=0; k < scratch.sN; ++k)
+            clearHalos( scratch.ppS[k] );
+
+        if ( !cur.fN )
+            return;
 
-            SMP(div, i, j) = sca * (dx + dy);
-            SMP(p  , i, j) = 0;
+        for (auto &p : mCurPre)
+        {
+            if ( isWholeGrid )
+                clearGaps( p.data() );
+            else
+                clearStales( p.data() );
+        }
+        for (int k=0; k < scratch.fN; ++k)
+        {
+            if ( isWholeGrid )
+                clearGaps( scratch.ppF[k] );
+            else
+                clearHalos( scratch.ppF[k] );
         }
     }
-    if ( DO_BOUND ) setBoundary( BTYPE_EXPAND, div );
-    if ( DO_BOUND ) setBoundary( BTYPE_EXPAND, p );
+}
 
-    lin_solve( BTYPE_EXPAND, p, div, 1, 4 );
+FS_TEMPLATE
+template <typename T>
+void FS_CLASS::initPadding( T *x, const T *src )
+{
+    const int NX = mLayout.NX();
+    const int NY = mLayout.NY();
 
-    for (int i=1; i <= N; ++i)
+    for (int i=0; i <= (NX+1); ++i)
     {
-        for (int j=1; j <= N; ++j)
-        {
-            SMP(u,i,j) -= (0.5f * N) * (SMP(p,i+1,j) - SMP(p,i-1,j));
-            SMP(v,i,j) -= (0.5f * N) * (SMP(p,i,j+1) - SMP(p,i,j-1));
-        }
+        SMP(x, i   , 0   ) = 0;
+        SMP(x, i   , NY+1) = 0;
+    }
+    for (int j=1; j <= NY; ++j)
+    {
+        SMP(x, 0   , j   ) = 0;
+        SMP(x, NX+1, j   ) = 0;
+    }
+
+    // open sides keep the neighbor's values of the source field
+    const int open = mOpenSides;
+    if ( !open )
+        return;
+
+    for (int i=0; i <= (NX+1); ++i)
+    {
+        if ( open & SIDE_BOTTOM ) SMP(x, i   , 0   ) = SMP(src, i   , 0   );
+        if ( open & SIDE_TOP    ) SMP(x, i   , NY+1) = SMP(src, i   , NY+1);
+    }
+    for (int j=0; j <= (NY+1); ++j)
+    {
+        if ( open & SIDE_LEFT   ) SMP(x, 0   , j   ) = SMP(src, 0   , j   );
+        if ( open & SIDE_RIGHT  ) SMP(x, NX+1, j   ) = SMP(src, NX+1, j   );
     }
-    if ( DO_BOUND ) setBoundary( BTYPE_REPEL0, u );
-    if ( DO_BOUND ) setBoundary( BTYPE_REPEL1, v );
 }
 
-template <int N, bool DO_BOUND>
-void FluidSolver<N,DO_BOUND>::dens_step( char *pTmpBuff, float diff, float dt )
+FS_TEMPLATE
+void FS_CLASS::dens_step( float diff, float dt )
 {
-    auto *pCurDen = mCurDen.data();
-    auto *pTmpDen = (float *)pTmpBuff;
+    FLUID_TRACE_SCOPE( "dens_step" );
+    runStep( STEP_SCALARS, 0, diff, dt );
+}
 
-    clearPadding( pTmpDen );
-    diffuse( BTYPE_EXPAND, pTmpDen, pCurDen, diff, dt );
+FS_TEMPLATE
+void FS_CLASS::vel_step( float visc, float dt )
+{
+    FLUID_TRACE_SCOPE( "vel_step" );
+    runStep( STEP_VELOCITY, visc, 0, dt );
+}
 
-    const auto *pCurVel0 = mCurVel[0].data();
-    const auto *pCurVel1 = mCurVel[1].data();
+FS_TEMPLATE
+void FS_CLASS::Step( float visc, float diff, float dt )
+{
+    FLUID_TRACE_SCOPE( "Step" );
+    runStep( STEP_ALL, visc, diff, dt );
+}
+
+FS_TEMPLATE
+bool FS_CLASS::nextStepRows( int &jBegin, int &jEnd )
+{
+    const int NY = mLayout.NY();
+    auto &s = mStep;
 
-    advect( pCurDen, pTmpDen, pCurVel0, pCurVel1, dt );
-    if ( DO_BOUND ) setBoundary( BTYPE_EXPAND, pCurDen );
+    jBegin = s.jNext;
+    jEnd   = s.sliceRows ? std::min( jBegin + s.sliceRows, NY+1 ) : NY+1;
+    s.jNext = jEnd > NY ? 1 : jEnd;
+    return jEnd > NY;
 }
 
-template <int N, bool DO_BOUND>
-void FluidSolver<N,DO_BOUND>::clearPadding( float *x )
+FS_TEMPLATE
+void FS_CLASS::scalarDiffs( DiffuseField<STORAGE> *pOut ) const
 {
-    for (int i=0; i <= (N+1); ++i)
+    const auto &s = mStep;
+    for (int c=0; c < s.scalN; ++c)
+        pOut[c] = { BTYPE_EXPAND, s.ppScalTmp[c], s.ppScalDst[c], scalarDiff( c, s.diff ) };
+}
+
+FS_TEMPLATE
+void FS_CLASS::beginStep( StepMode mode, float visc, float diff, float dt, bool isSliced )
+{
+    FLUID_TRACE_SCOPE( "beginStep" );
+
+    auto &s = mStep;
+    s.mode     = mode;
+    s.isSliced = isSliced;
+    s.jNext    = 1;
+    s.projIdx  = 0;
+    s.diff     = diff;
+    s.dt       = dt;
+
+    // whole bands, which the sweeps spread over the pool
+    s.sliceRows = 0;
+    if ( isSliced )
+    {
+        const int B = Layout::BAND_ROWS;
+        const int rows = std::max( STEP_SLICE_CELLS / mLayout.NX(), 1 );
+        s.sliceRows = (rows + B-1) / B * B;
+    }
+    s.velJob.sliceRows  = s.sliceRows;
+    s.scalJob.sliceRows = s.sliceRows;
+    s.preJob.sliceRows  = s.sliceRows;
+
+    // the scalars of a scalar grid are left to its own step
+    const bool doVel = mode != STEP_SCALARS;
+    s.scalN = (mode != STEP_VELOCITY && !moScalGrid) ? GetScalarsN() : 0;
+    if ( !doVel && !s.scalN )
+    {
+        syncScalarGrid();
+        s.stage = STAGE_UPSAMPLE;
+        return;
+    }
+
+    // velocity first, then the scalars
+    const int velN    = doVel ? DIMS_N : 0;
+    const int fieldsN = velN + s.scalN;
+
+    float *const ppVelDst[] = { mCurVel[0].data(), mCurVel[1].data() };
+    for (int d=0; d < DIMS_N; ++d)
+        s.pTmpVel[d] = doVel ? getTempField( d, fieldsN ) : nullptr;
+
+    for (int c=0; c < s.scalN; ++c)
+    {
+        s.ppScalDst[c] = scalarField( c );
+        s.ppScalTmp[c] = getTempField<STORAGE>( velN + c, fieldsN );
+    }
+
+    {
+        beginSparse( { ppVelDst, velN, s.ppScalDst, s.scalN },
+                     { s.pTmpVel, velN, s.ppScalTmp, s.scalN }, dt );
+    }
+
+    for (int d=0; d < velN; ++d)
+        initPadding( s.pTmpVel[d], ppVelDst[d] );
+    for (int c=0; c < s.scalN; ++c)
+        initPadding( s.ppScalTmp[c], s.ppScalDst[c] );
+
+    DiffuseField<STORAGE> scalDiffs[SCALARS_MAX] {};
+    scalarDiffs( scalDiffs );
+
+    if ( !doVel )
+    {
+        beginDiffuse( scalDiffs, s.scalN, dt, s.scalJob );
+        s.stage = STAGE_DIFFUSE_SCALARS;
+        return;
+    }
+
+    const float velDiff = velocityDiff( visc );
+    DiffuseField<float> diffs[BATCH_MAX]
     {
-        SMP(x, i  , 0  ) = 0;
-        SMP(x, i  , N+1) = 0;
-        SMP(x, 0  , i  ) = 0;
-        SMP(x, N+1, i  ) = 0;
+        { BTYPE_REPEL0, s.pTmpVel[0], ppVelDst[0], velDiff },
+        { BTYPE_REPEL1, s.pTmpVel[1], ppVelDst[1], velDiff },
+    };
+    int diffsN = DIMS_N;
+
+    // all in one batch if all are float
+    if constexpr ( IS_SCALAR_F32 )
+    {
+        std::copy( scalDiffs, scalDiffs + s.scalN, diffs + DIMS_N );
+        diffsN += s.scalN;
     }
+    beginDiffuse( diffs, diffsN, dt, s.velJob );
+    s.stage = STAGE_DIFFUSE;
 }
 
-template <int N, bool DO_BOUND>
-void FluidSolver<N,DO_BOUND>::vel_step( char *pTmpBuff, float visc, float dt )
+FS_TEMPLATE
+void FS_CLASS::advectStep( int jBegin, int jEnd, bool isLast )
 {
-    auto *pTmpVel0 = (float *)pTmpBuff;
-    auto *pTmpVel1 = (float *)(pTmpBuff + getVelCoordBuffSize());
+    const auto &s = mStep;
+    const int scalN = s.scalN;
+    float *const ppVelDst[] = { mCurVel[0].data(), mCurVel[1].data() };
+    const float *const ppVelTmp[] = { s.pTmpVel[0], s.pTmpVel[1] };
+
+    // the same trace for all, shared by a single pass if all are float.
+    //  The scalars on their own move along the current velocity
+    if ( s.mode == STEP_SCALARS )
+    {
+        advectRows( s.ppScalDst, s.ppScalTmp, scalN, ppVelDst[0], ppVelDst[1], s.dt, jBegin, jEnd );
+    }
+    else
+    if constexpr ( IS_SCALAR_F32 )
+    {
+        float *ppDst[BATCH_MAX] { ppVelDst[0], ppVelDst[1] };
+        const float *ppSrc[BATCH_MAX] { ppVelTmp[0], ppVelTmp[1] };
+        std::copy( s.ppScalDst, s.ppScalDst + scalN, ppDst + DIMS_N );
+        std::copy( s.ppScalTmp, s.ppScalTmp + scalN, ppSrc + DIMS_N );
+        advectRows( ppDst, ppSrc, DIMS_N + scalN, ppVelTmp[0], ppVelTmp[1], s.dt, jBegin, jEnd );
+    }
+    else
+    {
+        advectRows( ppVelDst, ppVelTmp, DIMS_N, ppVelTmp[0], ppVelTmp[1], s.dt, jBegin, jEnd );
+        if ( scalN )
+            advectRows( s.ppScalDst, s.ppScalTmp, scalN, ppVelTmp[0], ppVelTmp[1], s.dt, jBegin, jEnd );
+    }
+
+    if ( DO_BOUND && isLast )
+    {
+        if ( s.mode != STEP_SCALARS )
+        {
+            setBoundary( BTYPE_REPEL0, ppVelDst[0] );
+            setBoundary( BTYPE_REPEL1, ppVelDst[1] );
+        }
+        for (int c=0; c < scalN; ++c)
+            setBoundary( BTYPE_EXPAND, s.ppScalDst[c] );
+    }
+}
 
+FS_TEMPLATE
+bool FS_CLASS::stepSlice()
+{
+    auto &s = mStep;
     auto *pCurVel0 = mCurVel[0].data();
     auto *pCurVel1 = mCurVel[1].data();
 
-    clearPadding( pTmpVel0 );
-    clearPadding( pTmpVel1 );
-    diffuse( BTYPE_REPEL0, pTmpVel0, pCurVel0, visc, dt );
-    diffuse( BTYPE_REPEL1, pTmpVel1, pCurVel1, visc, dt );
+    // the first projection is of the diffused velocity, into the
+    //  scratch fields, the second one of the advected velocity
+    auto *pU   = s.projIdx ? pCurVel0 : s.pTmpVel[0];
+    auto *pV   = s.projIdx ? pCurVel1 : s.pTmpVel[1];
+    auto *pDiv = s.projIdx ? s.pTmpVel[0] : pCurVel0;
+    auto *pP   = mCurPre[s.projIdx].data();
+
+    int jBegin;
+    int jEnd;
+
+    // a stage with nothing left to do goes on to the next one in the
+    //  same slice
+    for (;;)
+    {
+        switch ( s.stage )
+        {
+        case STAGE_DIFFUSE:
+            if ( relaxSlice( s.velJob ) )
+                return false;
+
+            if constexpr ( !IS_SCALAR_F32 )
+            {
+                if ( s.scalN )
+                {
+                    s.velItersN = mLastRelaxItersN;
+                    DiffuseField<STORAGE> diffs[SCALARS_MAX] {};
+                    scalarDiffs( diffs );
+                    beginDiffuse( diffs, s.scalN, s.dt, s.scalJob );
+                    s.stage = STAGE_DIFFUSE_SCALARS;
+                    return false;
+                }
+            }
+            s.stage = STAGE_DIVERGENCE;
+            break;
+
+        case STAGE_DIFFUSE_SCALARS:
+            if ( relaxSlice( s.scalJob ) )
+                return false;
+
+            if ( s.mode == STEP_SCALARS )
+            {
+                s.stage = STAGE_ADVECT;
+                break;
+            }
+            mLastRelaxItersN = std::max( mLastRelaxItersN, s.velItersN );
+            s.stage = STAGE_DIVERGENCE;
+            break;
+
+        case STAGE_DIVERGENCE:
+            {
+                const bool isLast = nextStepRows( jBegin, jEnd );
+                divergenceRows( pU, pV, pDiv, jBegin, jEnd );
+                if ( !isLast )
+                    return false;
+            }
+            beginPressure( pP, pDiv, s.preJob );
+            s.stage = STAGE_PRESSURE;
+            return false;
+
+        case STAGE_PRESSURE:
+            if ( relaxSlice( s.preJob ) )
+                return false;
+
+            s.stage = STAGE_SUB_GRADIENT;
+            break;
+
+        case STAGE_SUB_GRADIENT:
+            {
+                const bool isLast = nextStepRows( jBegin, jEnd );
+                subGradientRows( pU, pV, pP, jBegin, jEnd );
+                if ( !isLast )
+                    return false;
+            }
+            endProject( pU, pV, s.preJob );
+
+            if ( !s.projIdx )
+            {
+                s.stage = STAGE_ADVECT;
+                return false;
+            }
+            endSparse();
+
+            // the scalars take the final velocity on their own grid
+            if ( moScalGrid && s.mode == STEP_ALL )
+            {
+                syncScalarGrid();
+                s.stage = STAGE_UPSAMPLE;
+                return false;
+            }
+            s.stage = STAGE_DONE;
+            return true;
+
+        case STAGE_ADVECT:
+            {
+                const bool isLast = nextStepRows( jBegin, jEnd );
+                advectStep( jBegin, jEnd, isLast );
+                if ( !isLast )
+                    return false;
+            }
+            if ( s.mode == STEP_SCALARS )
+            {
+                endSparse();
+                s.stage = STAGE_DONE;
+                return true;
+            }
+            s.projIdx = 1;
+            s.stage = STAGE_DIVERGENCE;
+            return false;
 
-    project( pTmpVel0, pTmpVel1, pCurVel0, pCurVel1 );
+        case STAGE_UPSAMPLE:
+            {
+                // a row here is mScalScale rows of the scalar grid
+                const bool isLast = nextStepRows( jBegin, jEnd );
+                upsampleToScalarGrid( (jBegin-1) * mScalScale + 1, (jEnd-1) * mScalScale + 1 );
+                if ( !isLast )
+                    return false;
+            }
+            beginScalarGridStep( s.diff, s.dt, s.isSliced );
+            s.stage = STAGE_SCALAR_GRID;
+            return false;
 
-    advect( pCurVel0, pTmpVel0, pTmpVel0, pTmpVel1, dt );
-    if ( DO_BOUND ) setBoundary( BTYPE_REPEL0, pCurVel0 );
+        case STAGE_SCALAR_GRID:
+            if ( !scalarGridSlice() )
+                return false;
 
-    advect( pCurVel1, pTmpVel1, pTmpVel0, pTmpVel1, dt );
-    if ( DO_BOUND ) setBoundary( BTYPE_REPEL1, pCurVel1 );
+            mLastRelaxItersN = moScalGrid->GetLastRelaxItersN();
+            s.stage = STAGE_DONE;
+            return true;
 
-    project( pCurVel0, pCurVel1, pTmpVel0, pTmpVel1 );
+        case STAGE_DONE:
+            return true;
+        }
+    }
 }
 
+#undef FS_TEMPLATE
+#undef FS_CLASS
+
 #endif
 
@@ -0,0 +1,263 @@
+//==================================================================
+/// FluidSolver3D.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include "FluidTrace.h"
+#include "FluidSolver3D.h"
+
+//==================================================================
+FluidSolver3D::FluidSolver3D( int nx, int ny, int nz, bool doBound )
+    : mNX(nx)
+    , mNY(ny)
+    , mNZ(nz)
+    , mStrideY(nx+2)
+    , mStrideZ((nx+2) * (ny+2))
+    , mDoBound(doBound)
+    , mInvH((float)std::max( nx, std::max( ny, nz ) ))
+{
+    assert( nx > 0 && ny > 0 && nz > 0 );
+
+    const size_t cellsN = (size_t)mStrideZ * (nz+2);
+    for (auto &f : mCurVel)
+        f.resize( cellsN );
+    mCurDen.resize( cellsN );
+    for (auto &f : mCurPre)
+        f.resize( cellsN );
+
+    Clear();
+}
+
+//==================================================================
+void FluidSolver3D::Clear()
+{
+    for (auto &f : mCurVel)
+        std::fill( f.begin(), f.end(), 0.f );
+
+    std::fill( mCurDen.begin(), mCurDen.end(), 0.f );
+
+    for (auto &f : mCurPre)
+        std::fill( f.begin(), f.end(), 0.f );
+}
+
+//==================================================================
+void FluidSolver3D::setBoundary( BType b, float *x )
+{
+    FLUID_TRACE_SCOPE( "setBoundary" );
+
+    const int NX = mNX;
+    const int NY = mNY;
+    const int NZ = mNZ;
+
+    const float sx = b==BTYPE_REPEL0 ? -1.f : 1.f;
+    const float sy = b==BTYPE_REPEL1 ? -1.f : 1.f;
+    const float sz = b==BTYPE_REPEL2 ? -1.f : 1.f;
+
+    // the x and y faces a plane at a time, the z ones a row at a time
+    parallelFor( 1, NZ+1, [&]( int kBegin, int kEnd )
+    {
+        for (int k=kBegin; k < kEnd; ++k)
+        {
+            for (int j=1; j <= NY; ++j)
+            {
+                x[IX(0   , j, k)] = sx * x[IX(1 , j, k)];
+                x[IX(NX+1, j, k)] = sx * x[IX(NX, j, k)];
+            }
+            for (int i=1; i <= NX; ++i)
+            {
+                x[IX(i,    0, k)] = sy * x[IX(i, 1 , k)];
+                x[IX(i, NY+1, k)] = sy * x[IX(i, NY, k)];
+            }
+        }
+    });
+
+    parallelFor( 1, NY+1, [&]( int jBegin, int jEnd )
+    {
+        for (int j=jBegin; j < jEnd; ++j)
+        {
+            for (int i=1; i <= NX; ++i)
+            {
+                x[IX(i, j,    0)] = sz * x[IX(i, j, 1 )];
+                x[IX(i, j, NZ+1)] = sz * x[IX(i, j, NZ)];
+            }
+        }
+    });
+
+    // edges from the two faces that they join, corners from the three
+    //  edges. in() is the interior neighbor of a padding coordinate
+    auto in = []( int c, int n ) { return c == 0 ? 1 : n; };
+
+    for (int j : { 0, NY+1 })
+        for (int k : { 0, NZ+1 })
+            for (int i=1; i <= NX; ++i)
+                x[IX(i,j,k)] = 0.5f * (x[IX(i, in(j,NY), k)] + x[IX(i, j, in(k,NZ))]);
+
+    for (int i : { 0, NX+1 })
+        for (int k : { 0, NZ+1 })
+            for (int j=1; j <= NY; ++j)
+                x[IX(i,j,k)] = 0.5f * (x[IX(in(i,NX), j, k)] + x[IX(i, j, in(k,NZ))]);
+
+    for (int i : { 0, NX+1 })
+        for (int j : { 0, NY+1 })
+            for (int k=1; k <= NZ; ++k)
+                x[IX(i,j,k)] = 0.5f * (x[IX(in(i,NX), j, k)] + x[IX(i, in(j,NY), k)]);
+
+    for (int i : { 0, NX+1 })
+        for (int j : { 0, NY+1 })
+            for (int k : { 0, NZ+1 })
+                x[IX(i,j,k)] = (1.f/3) * (x[IX(in(i,NX), j, k)] +
+                                          x[IX(i, in(j,NY), k)] +
+                                          x[IX(i, j, in(k,NZ))]);
+}
+
+//==================================================================
+void FluidSolver3D::lin_solve( const RelaxField *pFields, int fieldsN )
+{
+    FLUID_TRACE_SCOPE( "lin_solve" );
+
+    float ooc[DIMS_N+1];
+    assert( fieldsN <= DIMS_N+1 );
+    for (int f=0; f < fieldsN; ++f)
+        ooc[f] = 1.f / pFields[f].c;
+
+    // the cells of a color only read the other color, so the rows of
+    //  a color go in any order. All the fields go through a brick at
+    //  once, one dispatch per color
+    for (int iter=0; iter < mRelaxItersN; ++iter)
+    {
+        for (int color=0; color < 2; ++color)
+        {
+            forEachRow( [&]( const FluidRow3 &r )
+            {
+                for (int f=0; f < fieldsN; ++f)
+                {
+                    const auto &fld = pFields[f];
+                    mpKernels->RelaxRow3RB( fld.x, fld.x0, r, 1, mNX, color, fld.a, ooc[f] );
+                }
+            });
+        }
+
+        if ( mDoBound )
+            for (int f=0; f < fieldsN; ++f)
+                setBoundary( pFields[f].b, pFields[f].x );
+    }
+}
+
+//==================================================================
+void FluidSolver3D::diffuse( const RelaxField *pFields, int fieldsN )
+{
+    FLUID_TRACE_SCOPE( "diffuse" );
+
+    // the relaxation starts from x0, or ends there with no diffusion
+    parallelFor( 0, mNZ+2, [&]( int kBegin, int kEnd )
+    {
+        for (int f=0; f < fieldsN; ++f)
+            std::copy( pFields[f].x0 + (size_t)mStrideZ * kBegin,
+                       pFields[f].x0 + (size_t)mStrideZ * kEnd,
+                       pFields[f].x  + (size_t)mStrideZ * kBegin );
+    });
+
+    if ( pFields[0].a != 0 )
+        lin_solve( pFields, fieldsN );
+}
+
+//==================================================================
+void FluidSolver3D::advect(
+        float *const *ppD, const float *const *ppD0, int fieldsN,
+        const float *u, const float *v, const float *w, float dt )
+{
+    FLUID_TRACE_SCOPE( "advect" );
+
+    const float dt0 = dt * mInvH;
+
+    forEachRow( [&]( const FluidRow3 &r )
+    {
+        mpKernels->AdvectRow3N( ppD, ppD0, fieldsN, u, v, w, r, 1, mNX,
+                                dt0, mNX + 0.5f, mNY + 0.5f, mNZ + 0.5f );
+    });
+}
+
+//==================================================================
+void FluidSolver3D::project( float *u, float *v, float *w, float *p, float *div )
+{
+    FLUID_TRACE_SCOPE( "project" );
+
+    const float invH = mInvH;
+
+    const float sca = -0.5f / invH;
+    forEachRow( [&]( const FluidRow3 &r )
+    {
+        mpKernels->DivergenceRow3( div, u, v, w, r, 1, mNX, sca );
+        if ( !mWarmStartPressure )
+            std::fill( p + r.Offset() + 1, p + r.Offset() + mNX + 1, 0.f );
+    });
+    if ( mDoBound ) setBoundary( BTYPE_EXPAND, div );
+    if ( mDoBound ) setBoundary( BTYPE_EXPAND, p );
+
+    const RelaxField pre { BTYPE_EXPAND, p, div, 1, 6 };
+    lin_solve( &pre, 1 );
+
+    forEachRow( [&]( const FluidRow3 &r )
+    {
+        mpKernels->SubGradientRow3( u, v, w, p, r, 1, mNX, 0.5f * invH );
+    });
+    if ( mDoBound ) setBoundary( BTYPE_REPEL0, u );
+    if ( mDoBound ) setBoundary( BTYPE_REPEL1, v );
+    if ( mDoBound ) setBoundary( BTYPE_REPEL2, w );
+}
+
+//==================================================================
+void FluidSolver3D::dens_step( float diff, float dt )
+{
+    FLUID_TRACE_SCOPE( "dens_step" );
+
+    auto *pTmp = getTempField( 0, 1 );
+    auto *pCur = mCurDen.data();
+
+    const float a = dt * diff * mInvH * mInvH;
+    const RelaxField dif { BTYPE_EXPAND, pTmp, pCur, a, 1 + 6*a };
+    diffuse( &dif, 1 );
+
+    float *const ppDst[] = { pCur };
+    const float *const ppSrc[] = { pTmp };
+    advect( ppDst, ppSrc, 1, mCurVel[0].data(), mCurVel[1].data(), mCurVel[2].data(), dt );
+
+    if ( mDoBound ) setBoundary( BTYPE_EXPAND, pCur );
+}
+
+//==================================================================
+void FluidSolver3D::vel_step( float visc, float dt )
+{
+    FLUID_TRACE_SCOPE( "vel_step" );
+
+    float *pTmp[DIMS_N];
+    float *pCur[DIMS_N];
+    for (int d=0; d < DIMS_N; ++d)
+    {
+        pTmp[d] = getTempField( d, DIMS_N );
+        pCur[d] = mCurVel[d].data();
+    }
+
+    const float a = dt * visc * mInvH * mInvH;
+    const RelaxField difs[DIMS_N] =
+    {
+        { BTYPE_REPEL0, pTmp[0], pCur[0], a, 1 + 6*a },
+        { BTYPE_REPEL1, pTmp[1], pCur[1], a, 1 + 6*a },
+        { BTYPE_REPEL2, pTmp[2], pCur[2], a, 1 + 6*a },
+    };
+    diffuse( difs, DIMS_N );
+
+    // the current velocity is scratch until the advection writes it
+    project( pTmp[0], pTmp[1], pTmp[2], mCurPre[0].data(), pCur[0] );
+
+    advect( pCur, pTmp, DIMS_N, pTmp[0], pTmp[1], pTmp[2], dt );
+
+    if ( mDoBound ) setBoundary( BTYPE_REPEL0, pCur[0] );
+    if ( mDoBound ) setBoundary( BTYPE_REPEL1, pCur[1] );
+    if ( mDoBound ) setBoundary( BTYPE_REPEL2, pCur[2] );
+
+    project( pCur[0], pCur[1], pCur[2], mCurPre[1].data(), pTmp[0] );
+}
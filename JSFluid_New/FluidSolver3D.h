@@ -0,0 +1,181 @@
+//==================================================================
+/// FluidSolver3D.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef FLUIDSOLVER3D_H
+#define FLUIDSOLVER3D_H
+
+#include <assert.h>
+#include <algorithm>
+#include "ThreadPool.h"
+#include "FluidKernels.h"
+#include "FluidWorkspace.h"
+
+//==================================================================
+/// 3D version of FluidSolver, with the same steps on a padded
+/// (nx+2) x (ny+2) x (nz+2) grid: 3 velocity components, a density,
+/// trilinear advection and a 7-point Poisson solve for the pressure.
+/// The relaxation is red-black only, the rows of a color being
+/// independent, and all the passes go over bricks of rows spread
+/// over the thread pool. A brick is BRICK_ROWS rows of BRICK_PLANES
+/// planes, walked a plane at a time, so that the planes above and
+/// below of the 7-point stencil are still in cache from the previous
+/// one.
+/// Sizes are only known at runtime, as a 3D step is long enough for
+/// the loop setup not to matter.
+//==================================================================
+class FluidSolver3D
+{
+public:
+    static const int DIMS_N = 3;
+
+    // sweeps of lin_solve, for the diffusion and the pressure
+    static const int RELAX_ITER_COUNT = 20;
+
+    static const int BRICK_ROWS   = 16;
+    static const int BRICK_PLANES = 16;
+
+private:
+    const int   mNX;
+    const int   mNY;
+    const int   mNZ;
+    const int   mStrideY;
+    const int   mStrideZ;
+    const bool  mDoBound;
+
+    FluidField  mCurVel[DIMS_N];
+    FluidField  mCurDen;
+    // pressure of the two projections of vel_step, kept to warm-start
+    //  the solve of the next step
+    FluidField  mCurPre[2];
+
+    // scratch fields of the steps
+    FluidWorkspace  mWorkspace;
+
+    ThreadPool  *mpPool {};
+    bool        mWarmStartPressure = true;
+    int         mRelaxItersN = RELAX_ITER_COUNT;
+    // 1/h, with the longest side of the domain being of unit length
+    float       mInvH;
+    const FluidKernels *mpKernels = GetFluidKernels( DetectFluidISA() );
+
+    enum BType
+    {
+        BTYPE_REPEL0, // repel on x
+        BTYPE_REPEL1, // repel on y
+        BTYPE_REPEL2, // repel on z
+        BTYPE_EXPAND,
+    };
+
+public:
+    FluidSolver3D( int nx, int ny, int nz, bool doBound );
+
+    int GetNX() const { return mNX; }
+    int GetNY() const { return mNY; }
+    int GetNZ() const { return mNZ; }
+
+    void Clear();
+
+    // the bricks of the passes are spread over the pool, if set
+    void SetThreadPool( ThreadPool *pPool ) { mpPool = pPool; }
+
+    // start each pressure solve from the previous step's pressure,
+    //  rather than from zero
+    void SetWarmStartPressure( bool onOff ) { mWarmStartPressure = onOff; }
+
+    // sweeps of each relaxation
+    void SetRelaxItersN( int n ) { mRelaxItersN = std::max( n, 1 ); }
+    int GetRelaxItersN() const { return mRelaxItersN; }
+
+    // defaults to the best set for the CPU. Sets that aren't built in
+    //  are ignored
+    void SetKernelISA( FluidISA isa )
+    {
+        if ( const auto *pK = GetFluidKernels( isa ) )
+            mpKernels = pK;
+    }
+    FluidISA GetKernelISA() const { return mpKernels->isa; }
+
+    int IX( int i, int j, int k ) const { return i + mStrideY * j + mStrideZ * k; }
+
+    template <int DIM_IDX>
+    const float &SMPVel( int i, int j, int k ) const { return mCurVel[DIM_IDX][ IX(i,j,k) ]; }
+    template <int DIM_IDX>
+          float &SMPVel( int i, int j, int k )       { return mCurVel[DIM_IDX][ IX(i,j,k) ]; }
+
+    const float &SMPDen( int i, int j, int k ) const { return mCurDen[ IX(i,j,k) ]; }
+          float &SMPDen( int i, int j, int k )       { return mCurDen[ IX(i,j,k) ]; }
+
+    void dens_step( float diff, float dt );
+    void vel_step( float visc, float dt );
+
+private:
+    // one of the independent systems relaxed together by lin_solve
+    struct RelaxField
+    {
+        BType       b;
+        float       *x;
+        const float *x0;
+        float       a;
+        float       c;
+    };
+
+    void setBoundary( BType b, float *x );
+    void lin_solve( const RelaxField *pFields, int fieldsN );
+    // x0 into x for all the fields, relaxed together
+    void diffuse( const RelaxField *pFields, int fieldsN );
+    void advect( float *const *ppD, const float *const *ppD0, int fieldsN,
+                 const float *u, const float *v, const float *w, float dt );
+    void project( float *u, float *v, float *w, float *p, float *div );
+
+    float *getTempField( int idx, int fieldsN )
+    {
+        mWorkspace.Reserve( fieldsN, mCurDen.size() );
+        return mWorkspace.GetField( idx );
+    }
+
+    // fn( row ) for the interior rows, a brick at a time, on the pool
+    //  if set
+    template <typename F>
+    void forEachRow( const F &fn ) const
+    {
+        const int bricksY = (mNY + BRICK_ROWS-1) / BRICK_ROWS;
+        const int bricksZ = (mNZ + BRICK_PLANES-1) / BRICK_PLANES;
+
+        auto doBricks = [&]( int begin, int end )
+        {
+            FluidRow3 r { mStrideY, mStrideZ, 0, 0 };
+            for (int b=begin; b < end; ++b)
+            {
+                const int j0 = 1 + (b % bricksY) * BRICK_ROWS;
+                const int k0 = 1 + (b / bricksY) * BRICK_PLANES;
+                const int j1 = std::min( j0 + BRICK_ROWS-1, mNY );
+                const int k1 = std::min( k0 + BRICK_PLANES-1, mNZ );
+                for (r.k=k0; r.k <= k1; ++r.k)
+                    for (r.j=j0; r.j <= j1; ++r.j)
+                        fn( r );
+            }
+        };
+
+        if ( mpPool )
+            mpPool->ParallelFor( 0, bricksY * bricksZ, doBricks );
+        else
+            doBricks( 0, bricksY * bricksZ );
+    }
+
+    // fn( bandBegin, bandEnd ) over [begin,end), on the pool if set
+    template <typename F>
+    void parallelFor( int begin, int end, const F &fn ) const
+    {
+        if ( mpPool )
+            mpPool->ParallelFor( begin, end, fn );
+        else
+            fn( begin, end );
+    }
+};
+
+#endif
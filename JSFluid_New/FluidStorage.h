@@ -0,0 +1,175 @@
+//==================================================================
+/// FluidStorage.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef FLUIDSTORAGE_H
+#define FLUIDSTORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+//==================================================================
+/// Types that fields can be stored as. Math is always done in float,
+/// values are widened on load and rounded to nearest even on store.
+/// The conversions match the vector ones of FluidKernelsImpl.h
+//==================================================================
+enum FluidStorage : int
+{
+    FLUIDSTORAGE_F32,
+    FLUIDSTORAGE_F16,   // IEEE half, 11 bits of precision, up to 65504
+    FLUIDSTORAGE_BF16,  // top half of a float, 8 bits of precision
+    FLUIDSTORAGE_N
+};
+
+//==================================================================
+inline uint32_t FluidFloatBits( float x )
+{
+    uint32_t u;
+    memcpy( &u, &x, 4 );
+    return u;
+}
+
+inline float FluidBitsFloat( uint32_t u )
+{
+    float x;
+    memcpy( &x, &u, 4 );
+    return x;
+}
+
+//==================================================================
+inline float FluidHalfToFloat( uint16_t h )
+{
+    uint32_t o = (uint32_t)(h & 0x7fff) << 13;
+    const uint32_t e = o & 0x0f800000;
+    o += 0x38000000;                    // exponent bias 15 -> 127
+
+    if ( e == 0x0f800000 )              // inf, NaN
+        o += 0x38000000;
+    else
+    if ( e == 0 )                       // zero, denormal, renormalized
+        o = FluidFloatBits( FluidBitsFloat( o + 0x00800000 ) - FluidBitsFloat( 0x38800000 ) );
+
+    return FluidBitsFloat( o | (uint32_t)(h & 0x8000) << 16 );
+}
+
+inline uint16_t FluidFloatToHalf( float x )
+{
+    uint32_t u = FluidFloatBits( x );
+    const uint32_t sign = u & 0x80000000;
+    u ^= sign;
+
+    uint32_t o;
+    if ( u > 0x477fffff )               // over 65504, inf, NaN
+        o = u > 0x7f800000 ? 0x7e00 : 0x7c00;
+    else
+    if ( u < 0x38800000 )               // denormal or zero
+        o = FluidFloatBits( FluidBitsFloat( u ) + FluidBitsFloat( 0x3f000000 ) ) - 0x3f000000;
+    else
+        o = (u + 0xc8000fff + ((u >> 13) & 1)) >> 13;
+
+    return (uint16_t)(o | sign >> 16);
+}
+
+//==================================================================
+inline float FluidBFloat16ToFloat( uint16_t b )
+{
+    return FluidBitsFloat( (uint32_t)b << 16 );
+}
+
+inline uint16_t FluidFloatToBFloat16( float x )
+{
+    const uint32_t u = FluidFloatBits( x );
+    // NaN stays quiet NaN, rather than rounding into inf
+    if ( (u & 0x7fffffff) > 0x7f800000 )
+        return (uint16_t)((u >> 16) | 0x40);
+
+    return (uint16_t)((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+}
+
+//==================================================================
+/// 16 bit storage that reads and writes as a float
+//==================================================================
+struct FluidHalf
+{
+    uint16_t    bits;
+
+    FluidHalf() = default;
+    FluidHalf( float x ) : bits( FluidFloatToHalf( x ) ) {}
+
+    operator float() const { return FluidHalfToFloat( bits ); }
+
+    FluidHalf &operator +=( float x ) { return *this = *this + x; }
+    FluidHalf &operator -=( float x ) { return *this = *this - x; }
+    FluidHalf &operator *=( float x ) { return *this = *this * x; }
+};
+
+struct FluidBFloat16
+{
+    uint16_t    bits;
+
+    FluidBFloat16() = default;
+    FluidBFloat16( float x ) : bits( FluidFloatToBFloat16( x ) ) {}
+
+    operator float() const { return FluidBFloat16ToFloat( bits ); }
+
+    FluidBFloat16 &operator +=( float x ) { return *this = *this + x; }
+    FluidBFloat16 &operator -=( float x ) { return *this = *this - x; }
+    FluidBFloat16 &operator *=( float x ) { return *this = *this * x; }
+};
+
+//==================================================================
+template <typename T> struct FluidStorageOf;
+template <> struct FluidStorageOf<float>         { static const FluidStorage value = FLUIDSTORAGE_F32;  };
+template <> struct FluidStorageOf<FluidHalf>     { static const FluidStorage value = FLUIDSTORAGE_F16;  };
+template <> struct FluidStorageOf<FluidBFloat16> { static const FluidStorage value = FLUIDSTORAGE_BF16; };
+
+inline size_t FluidStorageCellSize( FluidStorage s )
+{
+    return s == FLUIDSTORAGE_F32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+//==================================================================
+/// Reference to a cell whose storage is only known at runtime
+//==================================================================
+class FluidCellRef
+{
+    void            *mp;
+    FluidStorage    mStorage;
+
+public:
+    FluidCellRef( void *p, FluidStorage s ) : mp(p), mStorage(s) {}
+
+    operator float() const
+    {
+        switch ( mStorage )
+        {
+        case FLUIDSTORAGE_F16:  return *(const FluidHalf *)mp;
+        case FLUIDSTORAGE_BF16: return *(const FluidBFloat16 *)mp;
+        default:                return *(const float *)mp;
+        }
+    }
+
+    FluidCellRef &operator =( float x )
+    {
+        switch ( mStorage )
+        {
+        case FLUIDSTORAGE_F16:  *(FluidHalf *)mp = x;     break;
+        case FLUIDSTORAGE_BF16: *(FluidBFloat16 *)mp = x; break;
+        default:                *(float *)mp = x;         break;
+        }
+        return *this;
+    }
+    // assigns the value, as with float &
+    FluidCellRef &operator =( const FluidCellRef &r ) { return *this = (float)r; }
+
+    FluidCellRef &operator +=( float x ) { return *this = *this + x; }
+    FluidCellRef &operator -=( float x ) { return *this = *this - x; }
+    FluidCellRef &operator *=( float x ) { return *this = *this * x; }
+};
+
+#endif
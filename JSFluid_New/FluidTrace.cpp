@@ -0,0 +1,201 @@
+//==================================================================
+/// FluidTrace.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include "FluidTrace.h"
+
+#ifdef JSFLUID_ENABLE_TRACE
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//==================================================================
+namespace
+{
+
+struct TraceEvent
+{
+    const char  *pName;
+    uint64_t    beginNS;
+    uint64_t    endNS;
+};
+
+//==================================================================
+/// Written by one thread only. The count only grows, events older
+/// than FLUID_TRACE_RING_SIZE are overwritten
+struct TraceRing
+{
+    std::unique_ptr<TraceEvent[]>   moEvents { new TraceEvent[ FLUID_TRACE_RING_SIZE ] };
+    std::atomic<uint64_t>           mWrittenN {0};
+    std::atomic<uint64_t>           mClearedN {0};
+    int                             mTID {};
+};
+
+//==================================================================
+/// All rings ever made. Those of exited threads are handed to new
+/// threads, so that their count doesn't grow without bounds
+struct TraceRegistry
+{
+    std::mutex                              mMutex;
+    std::vector<std::unique_ptr<TraceRing>> moRings;
+    std::vector<TraceRing *>                mpFreeRings;
+
+    static TraceRegistry &Get()
+    {
+        static TraceRegistry sReg;
+        return sReg;
+    }
+
+    TraceRing *Acquire()
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        if ( !mpFreeRings.empty() )
+        {
+            auto *pRing = mpFreeRings.back();
+            mpFreeRings.pop_back();
+            return pRing;
+        }
+        moRings.push_back( std::make_unique<TraceRing>() );
+        moRings.back()->mTID = (int)moRings.size();
+        return moRings.back().get();
+    }
+
+    void Release( TraceRing *pRing )
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mpFreeRings.push_back( pRing );
+    }
+};
+
+//==================================================================
+struct ThreadRing
+{
+    TraceRing   *mpRing = TraceRegistry::Get().Acquire();
+
+    ~ThreadRing() { TraceRegistry::Get().Release( mpRing ); }
+};
+
+static thread_local ThreadRing  tThreadRing;
+
+}
+
+//==================================================================
+void FluidTraceRecord( const char *pName, uint64_t beginNS, uint64_t endNS )
+{
+    auto &ring = *tThreadRing.mpRing;
+
+    const auto n = ring.mWrittenN.load( std::memory_order_relaxed );
+    ring.moEvents[ n & (FLUID_TRACE_RING_SIZE-1) ] = { pName, beginNS, endNS };
+    ring.mWrittenN.store( n+1, std::memory_order_release );
+}
+
+//==================================================================
+void FluidTraceClear()
+{
+    auto &reg = TraceRegistry::Get();
+    std::lock_guard<std::mutex> lock( reg.mMutex );
+
+    for (auto &oRing : reg.moRings)
+        oRing->mClearedN.store( oRing->mWrittenN.load( std::memory_order_acquire ) );
+}
+
+//==================================================================
+static void appendEscaped( std::string &out, const char *pStr )
+{
+    for (; *pStr; ++pStr)
+    {
+        if ( *pStr == '"' || *pStr == '\\' )
+            out += '\\';
+        out += *pStr;
+    }
+}
+
+//==================================================================
+std::string FluidTraceGetChromeJSON()
+{
+    struct Span
+    {
+        const TraceRing *pRing;
+        uint64_t        begin;
+        uint64_t        end;
+    };
+    std::vector<Span> spans;
+
+    auto &reg = TraceRegistry::Get();
+    std::lock_guard<std::mutex> lock( reg.mMutex );
+
+    // valid events of each ring, and the earliest time as the origin
+    uint64_t originNS = UINT64_MAX;
+    for (auto &oRing : reg.moRings)
+    {
+        const auto end = oRing->mWrittenN.load( std::memory_order_acquire );
+        const auto begin = std::max( oRing->mClearedN.load(),
+                                     end > FLUID_TRACE_RING_SIZE ? end - FLUID_TRACE_RING_SIZE : 0 );
+        if ( begin == end )
+            continue;
+
+        spans.push_back( { oRing.get(), begin, end } );
+
+        for (auto n=begin; n < end; ++n)
+            originNS = std::min( originNS, oRing->moEvents[ n & (FLUID_TRACE_RING_SIZE-1) ].beginNS );
+    }
+
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+    char buff[256];
+    bool isFirst = true;
+    auto sep = [&]() { if ( !isFirst ) out += ",\n"; isFirst = false; };
+
+    for (const auto &s : spans)
+    {
+        sep();
+        snprintf( buff, sizeof(buff),
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,"
+            "\"args\":{\"name\":\"thread %i\"}}",
+            s.pRing->mTID, s.pRing->mTID );
+        out += buff;
+
+        for (auto n=s.begin; n < s.end; ++n)
+        {
+            const auto &e = s.pRing->moEvents[ n & (FLUID_TRACE_RING_SIZE-1) ];
+
+            // complete events, times in microseconds
+            sep();
+            out += "{\"name\":\"";
+            appendEscaped( out, e.pName );
+            snprintf( buff, sizeof(buff),
+                "\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f}",
+                s.pRing->mTID,
+                (double)(e.beginNS - originNS) * 1e-3,
+                (double)(e.endNS - e.beginNS) * 1e-3 );
+            out += buff;
+        }
+    }
+
+    out += "\n]}\n";
+    return out;
+}
+
+//==================================================================
+bool FluidTraceWriteChrome( const char *pFName )
+{
+    FILE *pFile = fopen( pFName, "wb" );
+    if ( !pFile )
+        return false;
+
+    const auto json = FluidTraceGetChromeJSON();
+    const bool ok = fwrite( json.data(), 1, json.size(), pFile ) == json.size();
+
+    return fclose( pFile ) == 0 && ok;
+}
+
+#endif
+
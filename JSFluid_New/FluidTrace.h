@@ -0,0 +1,86 @@
+//==================================================================
+/// FluidTrace.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef FLUIDTRACE_H
+#define FLUIDTRACE_H
+
+#include <stdint.h>
+
+//==================================================================
+/// Scoped timing of the hot paths, exported as Chrome trace events
+/// (chrome://tracing or https://ui.perfetto.dev).
+///
+///   FLUID_TRACE_SCOPE( "advect" );
+///
+/// records the time from the macro to the end of the enclosing
+/// scope. The name must be a string literal, only its pointer is
+/// kept. Each thread writes to a ring buffer of its own, which keeps
+/// the most recent FLUID_TRACE_RING_SIZE events.
+///
+/// Only built in with JSFLUID_ENABLE_TRACE defined, otherwise the
+/// macro is empty and the export functions do nothing.
+//==================================================================
+#ifdef JSFLUID_ENABLE_TRACE
+
+#include <chrono>
+#include <string>
+
+static constexpr int FLUID_TRACE_RING_SIZE = 1 << 16;
+
+inline uint64_t FluidTraceNowNS()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void FluidTraceRecord( const char *pName, uint64_t beginNS, uint64_t endNS );
+
+//==================================================================
+class FluidTraceScope
+{
+    const char  *mpName;
+    uint64_t    mBeginNS;
+
+public:
+    explicit FluidTraceScope( const char *pName )
+        : mpName(pName)
+        , mBeginNS(FluidTraceNowNS())
+    {
+    }
+
+    ~FluidTraceScope()
+    {
+        FluidTraceRecord( mpName, mBeginNS, FluidTraceNowNS() );
+    }
+
+    FluidTraceScope( const FluidTraceScope & ) = delete;
+    FluidTraceScope &operator=( const FluidTraceScope & ) = delete;
+};
+
+#define FLUID_TRACE_CAT2(A,B)       A##B
+#define FLUID_TRACE_CAT(A,B)        FLUID_TRACE_CAT2(A,B)
+#define FLUID_TRACE_SCOPE(NAME)     FluidTraceScope FLUID_TRACE_CAT(_fluidTrace,__LINE__)( NAME )
+
+// events of all threads, to be called while the threads are idle,
+//  since the rings are read while they may be written
+std::string FluidTraceGetChromeJSON();
+bool FluidTraceWriteChrome( const char *pFName );
+
+void FluidTraceClear();
+
+#else
+
+#define FLUID_TRACE_SCOPE(NAME)     ((void)0)
+
+inline bool FluidTraceWriteChrome( const char * ) { return false; }
+inline void FluidTraceClear() {}
+
+#endif
+
+#endif
+
@@ -0,0 +1,72 @@
+//==================================================================
+/// FluidWorkspace.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#if defined(_MSC_VER)
+# include <malloc.h>
+#endif
+#include "FluidWorkspace.h"
+
+//==================================================================
+void *FluidAlignedAlloc( size_t size )
+{
+    // aligned_alloc() wants a multiple of the alignment
+    size = (size + FLUID_ALIGN-1) & ~(FLUID_ALIGN-1);
+    if ( !size )
+        size = FLUID_ALIGN;
+
+#if defined(_MSC_VER)
+    return _aligned_malloc( size, FLUID_ALIGN );
+#else
+    return aligned_alloc( FLUID_ALIGN, size );
+#endif
+}
+
+void FluidAlignedFree( void *p )
+{
+#if defined(_MSC_VER)
+    _aligned_free( p );
+#else
+    free( p );
+#endif
+}
+
+//==================================================================
+void FluidWorkspace::Reserve( int fieldsN, size_t cellsN )
+{
+    assert( fieldsN > 0 );
+
+    // whole pages, plus a skew so that fields don't line up on 4K
+    const size_t PAGE = 4096;
+    const size_t fieldSize = ((cellsN * sizeof(float) + PAGE-1) & ~(PAGE-1)) + FIELD_SKEW;
+
+    const auto pitch = std::max( mFieldPitch, fieldSize );
+    const auto n     = std::max( mFieldsN, fieldsN );
+
+    if ( pitch == mFieldPitch && n == mFieldsN )
+        return;
+
+    FluidAlignedFree( mpData );
+    mDataSize = pitch * n;
+    mpData = (char *)FluidAlignedAlloc( mDataSize );
+    if ( !mpData )
+    {
+        mDataSize = mFieldPitch = 0;
+        mFieldsN = 0;
+        throw std::bad_alloc();
+    }
+    // the relaxation starts from what's in the field, so start clean
+    memset( mpData, 0, mDataSize );
+
+    mFieldPitch = pitch;
+    mFieldsN    = n;
+}
+
@@ -0,0 +1,96 @@
+//==================================================================
+/// FluidWorkspace.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef FLUIDWORKSPACE_H
+#define FLUIDWORKSPACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+//==================================================================
+static const size_t FLUID_ALIGN = 64; // cache line, and AVX-512 vector
+
+void *FluidAlignedAlloc( size_t size );
+void FluidAlignedFree( void *p );
+
+//==================================================================
+/// std allocator returning FLUID_ALIGN aligned blocks
+//==================================================================
+template <typename T>
+class FluidAlignedAllocator
+{
+public:
+    using value_type = T;
+
+    FluidAlignedAllocator() = default;
+    template <typename U>
+    FluidAlignedAllocator( const FluidAlignedAllocator<U> & ) {}
+
+    T *allocate( size_t n )
+    {
+        if ( auto *p = FluidAlignedAlloc( n * sizeof(T) ) )
+            return (T *)p;
+
+        throw std::bad_alloc();
+    }
+    void deallocate( T *p, size_t ) { FluidAlignedFree( p ); }
+
+    template <typename U>
+    bool operator==( const FluidAlignedAllocator<U> & ) const { return true; }
+    template <typename U>
+    bool operator!=( const FluidAlignedAllocator<U> & ) const { return false; }
+};
+
+using FluidField = std::vector<float, FluidAlignedAllocator<float>>;
+// cells of a type only known at runtime, see FluidStorage.h
+using FluidBuffer = std::vector<uint8_t, FluidAlignedAllocator<uint8_t>>;
+
+//==================================================================
+/// Scratch fields for the steps of a solver.
+/// The memory is kept across steps and only grows, so a workspace can
+/// be shared by several solvers, as long as they're stepped on the
+/// same thread (see FluidSolverBase::SetWorkspace).
+/// Fields start on a FLUID_ALIGN boundary, and are spaced so that the
+/// same cell of two fields doesn't fall at the same offset in a 4K
+/// page, which would make the loads of one alias the stores of the
+/// other.
+//==================================================================
+class FluidWorkspace
+{
+    // fields i and i+1 are this far apart modulo 4K
+    static const size_t FIELD_SKEW = 256;
+
+    char    *mpData {};
+    size_t  mDataSize {};
+    size_t  mFieldPitch {};
+    int     mFieldsN {};
+
+public:
+    FluidWorkspace() = default;
+    ~FluidWorkspace() { FluidAlignedFree( mpData ); }
+
+    FluidWorkspace( const FluidWorkspace & ) = delete;
+    FluidWorkspace &operator=( const FluidWorkspace & ) = delete;
+
+    // makes room for fieldsN fields of cellsN floats. Pointers from
+    //  GetField() are invalidated if this grows the workspace
+    void Reserve( int fieldsN, size_t cellsN );
+
+    float *GetField( int idx ) const
+    {
+        return (float *)(mpData + mFieldPitch * idx);
+    }
+
+    int GetFieldsN() const { return mFieldsN; }
+    size_t GetSize() const { return mDataSize; }
+};
+
+#endif
+
@@ -0,0 +1,243 @@
+//==================================================================
+/// GridLayout.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef GRIDLAYOUT_H
+#define GRIDLAYOUT_H
+
+#include <stddef.h>
+
+// layouts that CreateFluidSolver() can pick at runtime
+enum FluidLayout : int
+{
+    FLUIDLAYOUT_LINEAR, // GridLayoutLinear
+    FLUIDLAYOUT_TILED,  // GridLayoutTiled
+    FLUIDLAYOUT_N
+};
+
+//==================================================================
+/// Storage layout and access pattern of an (NX+2) x (NY+2) padded grid.
+/// Kernels index through IX() and walk cells through the ForEach*()
+/// functions, which visit cells in the layout's memory order.
+/// A size of 0 means that it's given at runtime to the constructor.
+//==================================================================
+template <int NX_, int NY_>
+class GridLayoutLinear
+{
+    int mNX = NX_;
+    int mNY = NY_;
+
+public:
+    static constexpr FluidLayout TYPE = FLUIDLAYOUT_LINEAR;
+    // rows are contiguous, so the row kernels of FluidKernels.h apply
+    static constexpr bool IS_LINEAR = true;
+    // rows that a band of a parallel loop is made of
+    static constexpr int BAND_ROWS = 1;
+
+    GridLayoutLinear( int nx = NX_, int ny = NY_ ) : mNX(nx), mNY(ny) {}
+
+    int NX() const { return NX_ ? NX_ : mNX; }
+    int NY() const { return NY_ ? NY_ : mNY; }
+
+    size_t GetCellsN() const { return (size_t)(NX()+2) * (NY()+2); }
+
+    // i is the contiguous index
+    int IX( int i, int j ) const { return i + (NX()+2) * j; }
+    int RowStride() const { return NX()+2; }
+
+    // cells in [i0,i1] x [j0,j1], rows first
+    template <typename F>
+    void ForEachCell( int i0, int i1, int j0, int j1, const F &fn ) const
+    {
+        for (int j=j0; j <= j1; ++j)
+            for (int i=i0; i <= i1; ++i)
+                fn( i, j );
+    }
+
+    // cells in [i0,i1] x [j0,j1] where (i+j) & 1 == color
+    template <typename F>
+    void ForEachCellOfColor( int color, int i0, int i1, int j0, int j1, const F &fn ) const
+    {
+        for (int j=j0; j <= j1; ++j)
+            for (int i=i0 + ((i0 + j + color) & 1); i <= i1; i += 2)
+                fn( i, j );
+    }
+
+    // fn( j, ri0, ri1, idx ) for the runs of contiguous cells in
+    //  [i0,i1] x [j0,j1], idx being the index of (ri0,j)
+    template <typename F>
+    void ForEachRun( int i0, int i1, int j0, int j1, const F &fn ) const
+    {
+        for (int j=j0; j <= j1; ++j)
+            fn( j, i0, i1, IX( i0, j ) );
+    }
+};
+
+//==================================================================
+/// The cells [c0,c1] x [r0,r1] of a tile of GridLayoutTiled, for the
+/// tile kernels of FluidKernels.h. Offsets are in cells, for the tile
+/// and the ones around it, so that a span serves all the fields.
+/// Cell (i,j) is in the tile ((i + ORG) / TILE, (j + ORG) / TILE)
+//==================================================================
+struct GridTileSpan
+{
+    static const int TILE_SHIFT = 5;
+    static const int TILE = 1 << TILE_SHIFT;
+    static const int ORG = TILE - 1;
+
+    int     off;
+    int     offN;   // j+1
+    int     offS;   // j-1
+    int     offW;   // i-1
+    int     offE;   // i+1
+    int     c0, c1;
+    int     r0, r1;
+    int     i, j;   // the cell at (0,0) of the tile
+};
+
+//==================================================================
+/// Square tiles of TILE x TILE cells, one after the other in rows of
+/// tiles, each stored by rows. The neighbors of a cell, and the taps
+/// of the bilinear fetches, are mostly in the same tile, so the
+/// stencils and the advection touch a few cache lines and pages
+/// rather than rows that are a whole grid row apart.
+/// The cells [1,TILE] start the first inner tile, so the padding
+/// takes a tile on each side, and partial tiles are stored whole.
+/// That's some 13% more memory at 1024^2, but near 4x at 64^2,
+/// the layout is meant for the large grids.
+/// A tile row of cells of slack follows the last tile, for the vector
+/// loads of the kernels that run past the end of a tile
+//==================================================================
+template <int NX_, int NY_>
+class GridLayoutTiled
+{
+public:
+    static constexpr FluidLayout TYPE = FLUIDLAYOUT_TILED;
+    static constexpr bool IS_LINEAR = false;
+
+    // a tile of floats is a 4 KB page. Smaller tiles spend more on the
+    //  rows' edges than they save in the cache
+    static constexpr int TILE_SHIFT = GridTileSpan::TILE_SHIFT;
+    static constexpr int TILE = GridTileSpan::TILE;
+    static constexpr int BAND_ROWS = TILE;
+
+private:
+    static constexpr int TILE_MASK = TILE - 1;
+    // offset of the cells in the tiles, cell 1 is at the start of one
+    static constexpr int ORG = GridTileSpan::ORG;
+
+    int mNX;
+    int mNY;
+    int mTilesX;
+    int mTilesY;
+
+    // with the padding
+    static constexpr int tilesN( int n ) { return (n + TILE) / TILE + 1; }
+
+    int tilesX() const { return NX_ ? tilesN( NX_ ) : mTilesX; }
+    int tilesY() const { return NY_ ? tilesN( NY_ ) : mTilesY; }
+
+public:
+    GridLayoutTiled( int nx = NX_, int ny = NY_ )
+        : mNX(nx), mNY(ny), mTilesX( tilesN( nx ) ), mTilesY( tilesN( ny ) ) {}
+
+    int NX() const { return NX_ ? NX_ : mNX; }
+    int NY() const { return NY_ ? NY_ : mNY; }
+
+    size_t GetCellsN() const { return (size_t)tilesX() * tilesY() * TILE * TILE + TILE; }
+    int GetTilesX() const { return tilesX(); }
+
+    int IX( int i, int j ) const
+    {
+        const int x = i + ORG;
+        const int y = j + ORG;
+        return (((y >> TILE_SHIFT) * tilesX() + (x >> TILE_SHIFT)) << (2 * TILE_SHIFT)) +
+               ((y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK);
+    }
+
+    // cells in [i0,i1] x [j0,j1], a tile at a time
+    template <typename F>
+    void ForEachCell( int i0, int i1, int j0, int j1, const F &fn ) const
+    {
+        ForEachRun( i0, i1, j0, j1, [&]( int j, int ri0, int ri1, int )
+        {
+            for (int i=ri0; i <= ri1; ++i)
+                fn( i, j );
+        });
+    }
+
+    // cells in [i0,i1] x [j0,j1] where (i+j) & 1 == color
+    template <typename F>
+    void ForEachCellOfColor( int color, int i0, int i1, int j0, int j1, const F &fn ) const
+    {
+        ForEachRun( i0, i1, j0, j1, [&]( int j, int ri0, int ri1, int )
+        {
+            for (int i=ri0 + ((ri0 + j + color) & 1); i <= ri1; i += 2)
+                fn( i, j );
+        });
+    }
+
+    // fn( j, ri0, ri1, idx ) for the runs of contiguous cells in
+    //  [i0,i1] x [j0,j1], idx being the index of (ri0,j). Runs are the
+    //  rows of the tiles, at most TILE cells
+    template <typename F>
+    void ForEachRun( int i0, int i1, int j0, int j1, const F &fn ) const
+    {
+        if ( i0 > i1 )
+            return;
+
+        ForEachTile( i0, i1, j0, j1, [&]( const GridTileSpan &t )
+        {
+            for (int r=t.r0; r <= t.r1; ++r)
+                fn( t.j + r, t.i + t.c0, t.i + t.c1, t.off + (r << TILE_SHIFT) + t.c0 );
+        });
+    }
+
+    // fn( span ) for the tiles with cells in [i0,i1] x [j0,j1], in
+    //  memory order
+    template <typename F>
+    void ForEachTile( int i0, int i1, int j0, int j1, const F &fn ) const
+    {
+        if ( i0 > i1 )
+            return;
+
+        const int tileCellsN = TILE * TILE;
+        const int rowCellsN  = tilesX() * tileCellsN;
+
+        GridTileSpan t;
+        for (int ty=(j0 + ORG) >> TILE_SHIFT; ty <= (j1 + ORG) >> TILE_SHIFT; ++ty)
+        {
+            t.j  = ty * TILE - ORG;
+            t.r0 = j0 > t.j ? j0 - t.j : 0;
+            t.r1 = j1 < t.j + TILE_MASK ? j1 - t.j : TILE_MASK;
+            for (int tx=(i0 + ORG) >> TILE_SHIFT; tx <= (i1 + ORG) >> TILE_SHIFT; ++tx)
+            {
+                t.i  = tx * TILE - ORG;
+                t.c0 = i0 > t.i ? i0 - t.i : 0;
+                t.c1 = i1 < t.i + TILE_MASK ? i1 - t.i : TILE_MASK;
+
+                t.off  = (ty * tilesX() + tx) * tileCellsN;
+                t.offN = t.off + rowCellsN;
+                t.offS = t.off - rowCellsN;
+                t.offW = t.off - tileCellsN;
+                t.offE = t.off + tileCellsN;
+                fn( t );
+            }
+        }
+    }
+};
+
+//==================================================================
+// cells of a grid of a layout known at runtime
+inline size_t FluidLayoutCellsN( FluidLayout layout, int nx, int ny )
+{
+    return layout == FLUIDLAYOUT_TILED ? GridLayoutTiled<0,0>( nx, ny ).GetCellsN()
+                                       : GridLayoutLinear<0,0>( nx, ny ).GetCellsN();
+}
+
+#endif
+
@@ -11,6 +11,7 @@
 #include <assert.h>
 #include <stdexcept>
 #include <GL/glew.h>
+#include "FluidTrace.h"
 #include "ImmGL.h"
 
 #undef  c_auto
@@ -365,6 +366,8 @@ void ImmGL::ResetStates()
 //==================================================================
 void ImmGL::FlushPrims()
 {
+    FLUID_TRACE_SCOPE( "ImmGL::FlushPrims" );
+
     c_auto n = (GLsizei)((mModeFlags & FLG_TEX) ? mVtxPCT.size() : mVtxPC.size());
     if NOT( n )
         return;
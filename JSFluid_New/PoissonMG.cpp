@@ -0,0 +1,346 @@
+//==================================================================
+/// PoissonMG.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <algorithm>
+#include <math.h>
+#include "FluidTrace.h"
+#include "ThreadPool.h"
+#include "PoissonMG.h"
+
+// coarsening stops below this size, or when a side is odd
+static const int MIN_COARSE_N = 4;
+// coarsest levels with more cells than this are solved with PCG
+static const int MAX_RELAX_COARSE_CELLS = 16 * 16;
+// relative tolerance of the PCG of a coarsest level below the finest,
+//  as the correction it gives needs not be exact
+static const float COARSE_PCG_TOLERANCE = 0.1f;
+// border cells of the coarse levels, without doBound, as a multiple of
+//  their interior neighbor (see setBorder())
+static const float COARSE_BORDER_SCA = -1.f/3;
+
+//==================================================================
+static inline int IX( const int nx, const int i, const int j )
+{
+    return i + (nx+2) * j;
+}
+
+//==================================================================
+PoissonMG::PoissonMG( int nx, int ny, bool doBound )
+    : mDoBound(doBound)
+{
+    for (;;)
+    {
+        Level lev;
+        lev.nx = nx;
+        lev.ny = ny;
+
+        const auto size = (size_t)(nx+2) * (ny+2);
+        lev.res.resize( size );
+        // the finest level solves on the caller's buffers, but for pure
+        //  Neumann it needs its own copy of the right-hand side
+        if ( mLevels.empty() && doBound )
+        {
+            lev.rhs.resize( size );
+        }
+        else
+        if ( !mLevels.empty() )
+        {
+            lev.p.resize( size );
+            lev.rhs.resize( size );
+            lev.pP   = lev.p.data();
+            lev.pRhs = lev.rhs.data();
+        }
+        mLevels.push_back( std::move( lev ) );
+
+        if ( (nx & 1) || (ny & 1) || nx/2 < MIN_COARSE_N || ny/2 < MIN_COARSE_N )
+            break;
+
+        nx /= 2;
+        ny /= 2;
+    }
+
+    const auto &coarsest = mLevels.back();
+    if ( coarsest.nx * coarsest.ny > MAX_RELAX_COARSE_CELLS )
+    {
+        // the border of the levels, fixed if it's the finest one
+        moCoarsePCG = std::make_unique<PoissonPCG>( coarsest.nx, coarsest.ny, doBound,
+                                                    mLevels.size() > 1 ? COARSE_BORDER_SCA : 0.f );
+    }
+}
+
+//==================================================================
+int PoissonMG::Solve( float *p, const float *rhs, const Params &par )
+{
+    FLUID_TRACE_SCOPE( "PoissonMG::Solve" );
+
+    mPar = par;
+
+    auto &fine = mLevels[0];
+    fine.pP   = p;
+    fine.pRhs = rhs;
+
+    const int nx = fine.nx;
+    const int ny = fine.ny;
+
+    // pure Neumann: remove the mean, or the system has no solution
+    if ( mDoBound )
+    {
+        double sum = 0;
+        for (int j=1; j <= ny; ++j)
+            for (int i=1; i <= nx; ++i)
+                sum += rhs[IX(nx,i,j)];
+
+        const auto mean = (float)(sum / ((double)nx * ny));
+
+        for (int j=1; j <= ny; ++j)
+            for (int i=1; i <= nx; ++i)
+                fine.rhs[IX(nx,i,j)] = rhs[IX(nx,i,j)] - mean;
+
+        fine.pRhs = fine.rhs.data();
+    }
+
+    double rhsNorm2 = 0;
+    for (int j=1; j <= ny; ++j)
+        for (int i=1; i <= nx; ++i)
+            rhsNorm2 += (double)fine.pRhs[IX(nx,i,j)] * fine.pRhs[IX(nx,i,j)];
+
+    const auto rhsNorm = std::max( (float)sqrt( rhsNorm2 ), 1e-20f );
+
+    setBorder( fine, p, true );
+
+    mLastCyclesN = 0;
+    mLastRelResidual = calcResidual( fine ) / rhsNorm;
+
+    while ( mLastCyclesN < par.maxCycles && mLastRelResidual > par.tolerance )
+    {
+        cycle( 0, par.cycle );
+        ++mLastCyclesN;
+        mLastRelResidual = calcResidual( fine ) / rhsNorm;
+    }
+
+    fine.pP   = nullptr;
+    fine.pRhs = nullptr;
+
+    return mLastCyclesN;
+}
+
+//==================================================================
+void PoissonMG::cycle( int li, CycleType type )
+{
+    auto &lev = mLevels[li];
+
+    // coarsest level: solved to the tolerance of the cycles, or relaxed
+    //  until it's about solved
+    if ( li == (int)mLevels.size()-1 )
+    {
+        if ( moCoarsePCG )
+        {
+            PoissonPCG::Params par;
+            par.tolerance = li == 0 ? mPar.tolerance : COARSE_PCG_TOLERANCE;
+            par.maxIters  = lev.nx + lev.ny;
+            moCoarsePCG->Solve( lev.pP, lev.pRhs, par );
+            setBorder( lev, lev.pP, li == 0 );
+        }
+        else
+        {
+            smooth( lev, std::max( 20, 2 * std::max( lev.nx, lev.ny ) ) );
+        }
+        return;
+    }
+
+    smooth( lev, mPar.preSmoothN );
+
+    auto &coarse = mLevels[li+1];
+    calcResidual( lev );
+    restrictResidual( lev, coarse );
+
+    std::fill( coarse.p.begin(), coarse.p.end(), 0.f );
+
+    cycle( li+1, type );
+    if ( type == CYCLE_F )
+        cycle( li+1, CYCLE_V );
+
+    prolongAndCorrect( coarse, lev );
+
+    smooth( lev, mPar.postSmoothN );
+}
+
+//==================================================================
+void PoissonMG::setBorder( Level &lev, float *x, bool isFinest )
+{
+    const int nx = lev.nx;
+    const int ny = lev.ny;
+
+    if ( mDoBound )
+    {
+        // BTYPE_EXPAND, as in FluidSolver::setBoundary()
+        for (int j=1; j <= ny; ++j)
+        {
+            x[IX(nx,0   ,j)] = x[IX(nx,1 ,j)];
+            x[IX(nx,nx+1,j)] = x[IX(nx,nx,j)];
+        }
+        for (int i=1; i <= nx; ++i)
+        {
+            x[IX(nx,i,0   )] = x[IX(nx,i,1 )];
+            x[IX(nx,i,ny+1)] = x[IX(nx,i,ny)];
+        }
+        x[IX(nx,0   ,0   )] = 0.5f * (x[IX(nx,1 ,0   )] + x[IX(nx,0   ,1 )]);
+        x[IX(nx,0   ,ny+1)] = 0.5f * (x[IX(nx,1 ,ny+1)] + x[IX(nx,0   ,ny)]);
+        x[IX(nx,nx+1,0   )] = 0.5f * (x[IX(nx,nx,0   )] + x[IX(nx,nx+1,1 )]);
+        x[IX(nx,nx+1,ny+1)] = 0.5f * (x[IX(nx,nx,ny+1)] + x[IX(nx,nx+1,ny)]);
+    }
+    else
+    if ( !isFinest )
+    {
+        // the error is zero at the centers of the finest border cells,
+        //  which sit 1/3 of the way from a coarse border cell to the
+        //  first coarse interior cell
+        for (int j=0; j <= ny+1; ++j)
+        {
+            x[IX(nx,0   ,j)] = COARSE_BORDER_SCA * x[IX(nx,1,j)];
+            x[IX(nx,nx+1,j)] = COARSE_BORDER_SCA * x[IX(nx,nx,j)];
+        }
+        for (int i=0; i <= nx+1; ++i)
+        {
+            x[IX(nx,i,0   )] = COARSE_BORDER_SCA * x[IX(nx,i,1)];
+            x[IX(nx,i,ny+1)] = COARSE_BORDER_SCA * x[IX(nx,i,ny)];
+        }
+    }
+}
+
+//==================================================================
+void PoissonMG::smooth( Level &lev, int sweepsN )
+{
+    const int nx = lev.nx;
+    const int ny = lev.ny;
+    const bool isFinest = (&lev == &mLevels[0]);
+
+    auto *x = lev.pP;
+    const auto *b = lev.pRhs;
+
+    for (int k=0; k < sweepsN; ++k)
+    {
+        for (int color=0; color < 2; ++color)
+        {
+            auto relaxRows = [&]( int jBegin, int jEnd )
+            {
+                for (int j=jBegin; j < jEnd; ++j)
+                {
+                    for (int i=1 + ((1 + j + color) & 1); i <= nx; i += 2)
+                    {
+                        x[IX(nx,i,j)] = (b[IX(nx,i,j)] +
+                                         x[IX(nx,i-1,j  )] +
+                                         x[IX(nx,i+1,j  )] +
+                                         x[IX(nx,i  ,j-1)] +
+                                         x[IX(nx,i  ,j+1)]) * 0.25f;
+                    }
+                }
+            };
+
+            if ( mpPool )
+                mpPool->ParallelFor( 1, ny+1, relaxRows );
+            else
+                relaxRows( 1, ny+1 );
+        }
+        setBorder( lev, x, isFinest );
+    }
+}
+
+//==================================================================
+float PoissonMG::calcResidual( Level &lev )
+{
+    const int nx = lev.nx;
+    const int ny = lev.ny;
+
+    const auto *x = lev.pP;
+    const auto *b = lev.pRhs;
+    auto *r = lev.res.data();
+
+    double sum = 0;
+    for (int j=1; j <= ny; ++j)
+    {
+        for (int i=1; i <= nx; ++i)
+        {
+            r[IX(nx,i,j)] = b[IX(nx,i,j)] - (4 * x[IX(nx,i  ,j  )] -
+                                                 x[IX(nx,i-1,j  )] -
+                                                 x[IX(nx,i+1,j  )] -
+                                                 x[IX(nx,i  ,j-1)] -
+                                                 x[IX(nx,i  ,j+1)]);
+            sum += r[IX(nx,i,j)];
+        }
+    }
+
+    // pure Neumann: constants are in the null space, so the part of the
+    //  residual that no pressure can remove is its mean
+    const auto mean = mDoBound ? (float)(sum / ((double)nx * ny)) : 0.f;
+
+    double norm2 = 0;
+    for (int j=1; j <= ny; ++j)
+    {
+        for (int i=1; i <= nx; ++i)
+        {
+            r[IX(nx,i,j)] -= mean;
+            norm2 += (double)r[IX(nx,i,j)] * r[IX(nx,i,j)];
+        }
+    }
+
+    return (float)sqrt( norm2 );
+}
+
+//==================================================================
+void PoissonMG::restrictResidual( const Level &fine, Level &coarse )
+{
+    // full weighting of the 4 children, times 4 for the doubled spacing,
+    //  as the equation is scaled by h^2
+    const int fnx = fine.nx;
+    const int cnx = coarse.nx;
+    const auto *r = fine.res.data();
+    auto *b = coarse.rhs.data();
+
+    for (int J=1; J <= coarse.ny; ++J)
+    {
+        const int j = 2*J - 1;
+        for (int I=1; I <= cnx; ++I)
+        {
+            const int i = 2*I - 1;
+            b[IX(cnx,I,J)] = r[IX(fnx,i,j  )] + r[IX(fnx,i+1,j  )] +
+                             r[IX(fnx,i,j+1)] + r[IX(fnx,i+1,j+1)];
+        }
+    }
+}
+
+//==================================================================
+void PoissonMG::prolongAndCorrect( Level &coarse, Level &fine )
+{
+    // bilinear interpolation of the cell-centered coarse error
+    const auto *e = coarse.pP;
+    setBorder( coarse, coarse.pP, false );
+
+    const int fnx = fine.nx;
+    const int cnx = coarse.nx;
+    auto *x = fine.pP;
+
+    for (int j=1; j <= fine.ny; ++j)
+    {
+        const int J  = (j + 1) / 2;
+        const int Jn = (j & 1) ? J-1 : J+1;
+        for (int i=1; i <= fnx; ++i)
+        {
+            const int I  = (i + 1) / 2;
+            const int In = (i & 1) ? I-1 : I+1;
+
+            x[IX(fnx,i,j)] += (9.f/16) * e[IX(cnx,I ,J )] +
+                              (3.f/16) * e[IX(cnx,In,J )] +
+                              (3.f/16) * e[IX(cnx,I ,Jn)] +
+                              (1.f/16) * e[IX(cnx,In,Jn)];
+        }
+    }
+
+    setBorder( fine, x, &fine == &mLevels[0] );
+}
+
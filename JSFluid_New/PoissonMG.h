@@ -0,0 +1,92 @@
+//==================================================================
+/// PoissonMG.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef POISSONMG_H
+#define POISSONMG_H
+
+#include <memory>
+#include <vector>
+#include "PoissonPCG.h"
+
+class ThreadPool;
+
+//==================================================================
+/// Geometric multigrid for the pressure equation of FluidSolver:
+///
+///   4 p(i,j) - p(i-1,j) - p(i+1,j) - p(i,j-1) - p(i,j+1) = rhs(i,j)
+///
+/// Fields use the same (nx+2) x (ny+2) padded layout as the solver.
+/// With doBound the border follows BTYPE_EXPAND (pure Neumann),
+/// otherwise the border values of the finest level are kept fixed.
+/// Levels halve while both sides are even. A coarsest level that is
+/// still large, as with odd sizes, is solved with PCG rather than by
+/// relaxation, which would take sweeps in the order of its cells.
+//==================================================================
+class PoissonMG
+{
+public:
+    enum CycleType
+    {
+        CYCLE_V,
+        CYCLE_F
+    };
+
+    struct Params
+    {
+        CycleType   cycle        = CYCLE_V;
+        float       tolerance    = 1e-3f;   // relative to |rhs|
+        int         maxCycles    = 8;
+        int         preSmoothN   = 2;
+        int         postSmoothN  = 2;
+    };
+
+private:
+    struct Level
+    {
+        int                 nx {};
+        int                 ny {};
+        std::vector<float>  p;      // solution (error on coarse levels)
+        std::vector<float>  rhs;
+        std::vector<float>  res;
+        float               *pP {};
+        const float         *pRhs {};
+    };
+
+    std::vector<Level>  mLevels;
+    // solver of the coarsest level, if too large to relax
+    std::unique_ptr<PoissonPCG> moCoarsePCG;
+    bool                mDoBound {};
+    ThreadPool          *mpPool {};
+
+    Params              mPar;
+    int                 mLastCyclesN {};
+    float               mLastRelResidual {};
+
+public:
+    PoissonMG( int nx, int ny, bool doBound );
+
+    void SetThreadPool( ThreadPool *pPool ) { mpPool = pPool; }
+
+    // p holds the initial guess, returns the number of cycles used
+    int Solve( float *p, const float *rhs, const Params &par );
+
+    int   GetLevelsN() const        { return (int)mLevels.size(); }
+    int   GetLastCyclesN() const    { return mLastCyclesN; }
+    float GetLastRelResidual() const { return mLastRelResidual; }
+
+private:
+    void cycle( int li, CycleType type );
+    void smooth( Level &lev, int sweepsN );
+    void setBorder( Level &lev, float *x, bool isFinest );
+    float calcResidual( Level &lev );
+    void restrictResidual( const Level &fine, Level &coarse );
+    void prolongAndCorrect( Level &coarse, Level &fine );
+};
+
+#endif
+
@@ -0,0 +1,271 @@
+//==================================================================
+/// PoissonPCG.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <algorithm>
+#include <math.h>
+#include "FluidTrace.h"
+#include "PoissonPCG.h"
+
+// MIC(0) blending and safety factors, see Bridson's "Fluid Simulation
+//  for Computer Graphics", sec. 4.3.5
+static const float MIC_TAU   = 0.97f;
+static const float MIC_SIGMA = 0.25f;
+
+//==================================================================
+PoissonPCG::PoissonPCG( int nx, int ny, bool doBound, float borderSca )
+    : mNX(nx)
+    , mNY(ny)
+    , mDoBound(doBound)
+    , mBorderSca(doBound ? 0.f : borderSca)
+{
+    const auto size = (size_t)(nx+2) * (ny+2);
+    mR.resize( size );
+    mZ.resize( size );
+    mS.resize( size );
+    mAS.resize( size );
+    mDiag.resize( size );
+    mPrecon.resize( size );
+
+    // with BTYPE_EXPAND a border cell mirrors its interior neighbor,
+    //  which cancels out one unit of the diagonal, and a border cell
+    //  that is a multiple of it takes out that much
+    const float borderDiag = doBound ? 1.f : mBorderSca;
+    for (int j=1; j <= ny; ++j)
+    {
+        for (int i=1; i <= nx; ++i)
+        {
+            float d = 4;
+            d -= borderDiag * (float)((i == 1) + (i == nx) + (j == 1) + (j == ny));
+
+            mDiag[ix(i,j)] = d;
+        }
+    }
+
+    // the off-diagonals are -1 between interior cells and 0 otherwise
+    //  (the fixed border values go into the right-hand side)
+    for (int j=1; j <= ny; ++j)
+    {
+        for (int i=1; i <= nx; ++i)
+        {
+            const auto diag = mDiag[ix(i,j)];
+
+            const auto pi = (i > 1) ? mPrecon[ix(i-1,j)] : 0.f;
+            const auto pj = (j > 1) ? mPrecon[ix(i,j-1)] : 0.f;
+
+            // coupling of the left cell with its upper neighbor and of
+            //  the lower cell with its right neighbor
+            const auto ci = (i > 1 && j < ny) ? 1.f : 0.f;
+            const auto cj = (j > 1 && i < nx) ? 1.f : 0.f;
+
+            auto e = diag - pi*pi - pj*pj - MIC_TAU * (ci * pi*pi + cj * pj*pj);
+
+            if ( e < MIC_SIGMA * diag )
+                e = diag;
+
+            mPrecon[ix(i,j)] = e > 0 ? 1.f / sqrtf( e ) : 0.f;
+        }
+    }
+}
+
+//==================================================================
+void PoissonPCG::applyA( float *out, const float *x ) const
+{
+    const int nx = mNX;
+    const int ny = mNY;
+
+    for (int j=1; j <= ny; ++j)
+    {
+        for (int i=1; i <= nx; ++i)
+        {
+            float sum = mDiag[ix(i,j)] * x[ix(i,j)];
+            if ( i > 1  ) sum -= x[ix(i-1,j)];
+            if ( i < nx ) sum -= x[ix(i+1,j)];
+            if ( j > 1  ) sum -= x[ix(i,j-1)];
+            if ( j < ny ) sum -= x[ix(i,j+1)];
+
+            out[ix(i,j)] = sum;
+        }
+    }
+}
+
+//==================================================================
+void PoissonPCG::applyPrecond( Precond pc, float *z, const float *r )
+{
+    const int nx = mNX;
+    const int ny = mNY;
+
+    if ( pc == PRECOND_JACOBI )
+    {
+        for (int j=1; j <= ny; ++j)
+            for (int i=1; i <= nx; ++i)
+                z[ix(i,j)] = mDiag[ix(i,j)] > 0 ? r[ix(i,j)] / mDiag[ix(i,j)] : 0.f;
+        return;
+    }
+
+    const auto *pc0 = mPrecon.data();
+
+    // solve L q = r
+    for (int j=1; j <= ny; ++j)
+    {
+        for (int i=1; i <= nx; ++i)
+        {
+            float t = r[ix(i,j)];
+            if ( i > 1 ) t += pc0[ix(i-1,j)] * z[ix(i-1,j)];
+            if ( j > 1 ) t += pc0[ix(i,j-1)] * z[ix(i,j-1)];
+
+            z[ix(i,j)] = t * pc0[ix(i,j)];
+        }
+    }
+
+    // solve L^T z = q
+    for (int j=ny; j >= 1; --j)
+    {
+        for (int i=nx; i >= 1; --i)
+        {
+            float t = z[ix(i,j)];
+            if ( i < nx ) t += pc0[ix(i,j)] * z[ix(i+1,j)];
+            if ( j < ny ) t += pc0[ix(i,j)] * z[ix(i,j+1)];
+
+            z[ix(i,j)] = t * pc0[ix(i,j)];
+        }
+    }
+}
+
+//==================================================================
+double PoissonPCG::dot( const float *a, const float *b ) const
+{
+    double sum = 0;
+    for (int j=1; j <= mNY; ++j)
+        for (int i=1; i <= mNX; ++i)
+            sum += (double)a[ix(i,j)] * b[ix(i,j)];
+
+    return sum;
+}
+
+//==================================================================
+void PoissonPCG::removeMean( float *x ) const
+{
+    double sum = 0;
+    for (int j=1; j <= mNY; ++j)
+        for (int i=1; i <= mNX; ++i)
+            sum += x[ix(i,j)];
+
+    const auto mean = (float)(sum / ((double)mNX * mNY));
+
+    for (int j=1; j <= mNY; ++j)
+        for (int i=1; i <= mNX; ++i)
+            x[ix(i,j)] -= mean;
+}
+
+//==================================================================
+int PoissonPCG::Solve( float *p, const float *rhs, const Params &par )
+{
+    FLUID_TRACE_SCOPE( "PoissonPCG::Solve" );
+
+    const int nx = mNX;
+    const int ny = mNY;
+
+    auto *r  = mR.data();
+    auto *z  = mZ.data();
+    auto *s  = mS.data();
+    auto *as = mAS.data();
+
+    // effective right-hand side
+    for (int j=1; j <= ny; ++j)
+    {
+        for (int i=1; i <= nx; ++i)
+        {
+            float b = rhs[ix(i,j)];
+            if ( !mDoBound && !mBorderSca )
+            {
+                if ( i == 1  ) b += p[ix(0   ,j)];
+                if ( i == nx ) b += p[ix(nx+1,j)];
+                if ( j == 1  ) b += p[ix(i,0   )];
+                if ( j == ny ) b += p[ix(i,ny+1)];
+            }
+            r[ix(i,j)] = b;
+        }
+    }
+
+    // pure Neumann: keep the system consistent
+    if ( mDoBound )
+        removeMean( r );
+
+    const auto bNorm = std::max( sqrt( dot( r, r ) ), 1e-20 );
+
+    applyA( as, p );
+    for (int j=1; j <= ny; ++j)
+        for (int i=1; i <= nx; ++i)
+            r[ix(i,j)] -= as[ix(i,j)];
+
+    mLastItersN = 0;
+    mLastRelResidual = (float)(sqrt( dot( r, r ) ) / bNorm);
+
+    if ( mLastRelResidual > par.tolerance )
+    {
+        applyPrecond( par.precond, z, r );
+        std::copy( mZ.begin(), mZ.end(), mS.begin() );
+
+        auto sigma = dot( r, z );
+
+        while ( mLastItersN < par.maxIters && sigma > 0 )
+        {
+            applyA( as, s );
+
+            const auto sAs = dot( s, as );
+            if ( sAs <= 0 )
+                break;
+
+            const auto alpha = (float)(sigma / sAs);
+
+            for (int j=1; j <= ny; ++j)
+            {
+                for (int i=1; i <= nx; ++i)
+                {
+                    p[ix(i,j)] += alpha * s[ix(i,j)];
+                    r[ix(i,j)] -= alpha * as[ix(i,j)];
+                }
+            }
+            ++mLastItersN;
+
+            mLastRelResidual = (float)(sqrt( dot( r, r ) ) / bNorm);
+            if ( mLastRelResidual <= par.tolerance )
+                break;
+
+            applyPrecond( par.precond, z, r );
+
+            const auto sigmaNew = dot( r, z );
+            const auto beta = (float)(sigmaNew / sigma);
+            sigma = sigmaNew;
+
+            for (int j=1; j <= ny; ++j)
+                for (int i=1; i <= nx; ++i)
+                    s[ix(i,j)] = z[ix(i,j)] + beta * s[ix(i,j)];
+        }
+    }
+
+    // BTYPE_EXPAND border, for the gradient that follows, or the one
+    //  relative to the interior cells
+    if ( mDoBound || mBorderSca )
+    {
+        const float sca = mDoBound ? 1.f : mBorderSca;
+        for (int j=1; j <= ny; ++j)
+        {
+            p[ix(0   ,j)] = sca * p[ix(1 ,j)];
+            p[ix(nx+1,j)] = sca * p[ix(nx,j)];
+        }
+        for (int i=1; i <= nx; ++i)
+        {
+            p[ix(i,0   )] = sca * p[ix(i,1 )];
+            p[ix(i,ny+1)] = sca * p[ix(i,ny)];
+        }
+    }
+
+    return mLastItersN;
+}
+
@@ -0,0 +1,74 @@
+//==================================================================
+/// PoissonPCG.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef POISSONPCG_H
+#define POISSONPCG_H
+
+#include <vector>
+
+//==================================================================
+/// Preconditioned conjugate gradient for the pressure equation of
+/// FluidSolver (same equation and border rules as PoissonMG).
+/// Scratch vectors are owned, one (nx+2) x (ny+2) field each, like
+/// the fields of the solver's temp buffer.
+//==================================================================
+class PoissonPCG
+{
+public:
+    enum Precond
+    {
+        PRECOND_JACOBI,
+        PRECOND_MIC0,   // modified incomplete Cholesky, zero fill-in
+    };
+
+    struct Params
+    {
+        Precond     precond     = PRECOND_MIC0;
+        float       tolerance   = 1e-3f;    // relative to |rhs|
+        int         maxIters    = 100;
+    };
+
+private:
+    int                 mNX {};
+    int                 mNY {};
+    bool                mDoBound {};
+    float               mBorderSca {};
+
+    std::vector<float>  mR;         // residual
+    std::vector<float>  mZ;         // preconditioned residual
+    std::vector<float>  mS;         // search direction
+    std::vector<float>  mAS;        // A * search direction
+    std::vector<float>  mDiag;      // A diagonal
+    std::vector<float>  mPrecon;    // MIC(0) factor
+
+    int                 mLastItersN {};
+    float               mLastRelResidual {};
+
+public:
+    // without doBound, the border cells are the fixed values in p, or
+    //  borderSca times their interior neighbor if not 0. PoissonMG
+    //  solves its coarsest level with that (see PoissonMG::setBorder())
+    PoissonPCG( int nx, int ny, bool doBound, float borderSca = 0 );
+
+    // p holds the initial guess, returns the number of iterations used
+    int Solve( float *p, const float *rhs, const Params &par );
+
+    int   GetLastItersN() const      { return mLastItersN; }
+    float GetLastRelResidual() const { return mLastRelResidual; }
+
+private:
+    int ix( int i, int j ) const { return i + (mNX+2) * j; }
+
+    void applyA( float *out, const float *x ) const;
+    void applyPrecond( Precond pc, float *z, const float *r );
+    double dot( const float *a, const float *b ) const;
+    void removeMean( float *x ) const;
+};
+
+#endif
+
@@ -0,0 +1,116 @@
+//==================================================================
+/// SPSCQueue.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <assert.h>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+//==================================================================
+/// Bounded lock-free queue from one producer thread to one consumer
+/// thread.
+/// A ring of a power of 2 slots, indexed by two counters that only
+/// grow: the producer owns the tail and the consumer the head, each
+/// only reading the other's. The counters sit on cache lines of
+/// their own, and each side keeps a copy of the other's last value,
+/// so that it only reloads it when the ring looks full or empty.
+//==================================================================
+template <typename T>
+class SPSCQueue
+{
+    static const size_t CACHE_LINE = 64;
+
+    std::vector<T>  mSlots;
+    const size_t    mMask;
+
+    // consumer side
+    alignas(CACHE_LINE) std::atomic<size_t> mHead {0};
+    size_t                                  mTailCache {0};
+
+    // producer side
+    alignas(CACHE_LINE) std::atomic<size_t> mTail {0};
+    size_t                                  mHeadCache {0};
+
+public:
+    // capacity is rounded up to a power of 2
+    explicit SPSCQueue( size_t capacity )
+        : mSlots( roundUpPow2( capacity ) )
+        , mMask( mSlots.size() - 1 )
+    {
+    }
+
+    SPSCQueue( const SPSCQueue & ) = delete;
+    SPSCQueue &operator=( const SPSCQueue & ) = delete;
+
+    size_t GetCapacity() const { return mSlots.size(); }
+
+    //==================================================================
+    // producer side. False if full, the item is then dropped
+    bool TryPush( const T &item )
+    {
+        const auto tail = mTail.load( std::memory_order_relaxed );
+        if ( tail - mHeadCache == mSlots.size() )
+        {
+            mHeadCache = mHead.load( std::memory_order_acquire );
+            if ( tail - mHeadCache == mSlots.size() )
+                return false;
+        }
+
+        mSlots[ tail & mMask ] = item;
+        mTail.store( tail + 1, std::memory_order_release );
+        return true;
+    }
+
+    //==================================================================
+    // consumer side. fn( const T & ) for the items pushed so far, in
+    //  order. Returns their count
+    template <typename F>
+    size_t PopAll( const F &fn )
+    {
+        auto head = mHead.load( std::memory_order_relaxed );
+        mTailCache = mTail.load( std::memory_order_acquire );
+
+        const auto n = mTailCache - head;
+        for (; head != mTailCache; ++head)
+            fn( std::as_const( mSlots[ head & mMask ] ) );
+
+        // the slots go back to the producer all at once
+        mHead.store( head, std::memory_order_release );
+        return n;
+    }
+
+    bool TryPop( T &out_item )
+    {
+        const auto head = mHead.load( std::memory_order_relaxed );
+        if ( head == mTailCache )
+        {
+            mTailCache = mTail.load( std::memory_order_acquire );
+            if ( head == mTailCache )
+                return false;
+        }
+
+        out_item = mSlots[ head & mMask ];
+        mHead.store( head + 1, std::memory_order_release );
+        return true;
+    }
+
+private:
+    static size_t roundUpPow2( size_t n )
+    {
+        assert( n > 0 );
+        size_t p = 1;
+        while ( p < n )
+            p <<= 1;
+        return p;
+    }
+};
+
+#endif
@@ -0,0 +1,127 @@
+//==================================================================
+/// ThreadPool.cpp
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include "ThreadPool.h"
+
+// spins before blocking, to keep the back-to-back phases of a solver
+// from paying for a kernel wake-up each time
+static const int SPIN_COUNT = 4000;
+
+//==================================================================
+ThreadPool::ThreadPool( int threadsN )
+{
+    if ( threadsN <= 0 )
+        threadsN = (int)std::thread::hardware_concurrency();
+
+    for (int i=1; i < threadsN; ++i)
+        mThreads.emplace_back( [this](){ workerMain(); } );
+}
+
+//==================================================================
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mQuit = true;
+    }
+    mWakeCV.notify_all();
+
+    for (auto &t : mThreads)
+        t.join();
+}
+
+//==================================================================
+bool &ThreadPool::isWorkerThread()
+{
+    thread_local bool sIsWorker = false;
+    return sIsWorker;
+}
+
+//==================================================================
+void ThreadPool::run( JobFn pFn, const void *pCtx, int begin, int end )
+{
+    std::lock_guard<std::mutex> runLock( mRunMutex );
+
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mpJobFn     = pFn;
+        mpJobCtx    = pCtx;
+        mJobBegin   = begin;
+        mJobEnd     = end;
+        mPendingBands = GetThreadsN();
+        // a stale grab from the previous job is always >= the bands count,
+        //  so it can't steal a band before this reset publishes the job
+        mNextBand   = 0;
+        ++mGeneration;
+    }
+    mWakeCV.notify_all();
+
+    // the caller works too, as a worker for the duration of the job
+    isWorkerThread() = true;
+    doBands();
+    isWorkerThread() = false;
+
+    for (int i=0; i < SPIN_COUNT && mPendingBands.load() != 0; ++i)
+        std::this_thread::yield();
+
+    if ( mPendingBands.load() != 0 )
+    {
+        std::unique_lock<std::mutex> lock( mMutex );
+        mDoneCV.wait( lock, [this](){ return mPendingBands.load() == 0; } );
+    }
+}
+
+//==================================================================
+void ThreadPool::doBands()
+{
+    const int bandsN = GetThreadsN();
+
+    for (;;)
+    {
+        const int bandIdx = mNextBand.fetch_add( 1 );
+        if ( bandIdx >= bandsN )
+            break;
+
+        const int len = mJobEnd - mJobBegin;
+        const int b = mJobBegin + (int)((long long)len * bandIdx / bandsN);
+        const int e = mJobBegin + (int)((long long)len * (bandIdx+1) / bandsN);
+        if ( b < e )
+            mpJobFn( mpJobCtx, b, e );
+
+        if ( mPendingBands.fetch_sub( 1 ) == 1 )
+        {
+            std::lock_guard<std::mutex> lock( mMutex );
+            mDoneCV.notify_one();
+        }
+    }
+}
+
+//==================================================================
+void ThreadPool::workerMain()
+{
+    isWorkerThread() = true;
+
+    unsigned seenGen = 0;
+    for (;;)
+    {
+        for (int i=0; i < SPIN_COUNT && mGeneration.load() == seenGen; ++i)
+            std::this_thread::yield();
+
+        if ( mGeneration.load() == seenGen )
+        {
+            std::unique_lock<std::mutex> lock( mMutex );
+            mWakeCV.wait( lock, [&](){ return mQuit || mGeneration.load() != seenGen; } );
+            if ( mQuit )
+                return;
+        }
+        seenGen = mGeneration.load();
+
+        doBands();
+    }
+}
+
@@ -0,0 +1,81 @@
+//==================================================================
+/// ThreadPool.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//==================================================================
+/// Persistent pool of worker threads for fork-join loops.
+/// The calling thread takes part in the work, and a ParallelFor()
+/// issued from inside a worker runs serially, so nesting is safe.
+//==================================================================
+class ThreadPool
+{
+    using JobFn = void (*)( const void *pCtx, int begin, int end );
+
+    std::vector<std::thread>    mThreads;
+
+    std::mutex                  mRunMutex;
+    std::mutex                  mMutex;
+    std::condition_variable     mWakeCV;
+    std::condition_variable     mDoneCV;
+
+    // current job, published under mMutex and by bumping mGeneration
+    JobFn                       mpJobFn {};
+    const void                  *mpJobCtx {};
+    int                         mJobBegin {};
+    int                         mJobEnd {};
+
+    std::atomic<unsigned>       mGeneration {0};
+    std::atomic<int>            mNextBand {0};
+    std::atomic<int>            mPendingBands {0};
+    bool                        mQuit {};
+
+public:
+    explicit ThreadPool( int threadsN = 0 );
+    ~ThreadPool();
+
+    ThreadPool( const ThreadPool & ) = delete;
+    ThreadPool &operator=( const ThreadPool & ) = delete;
+
+    // total threads doing work, including the caller
+    int GetThreadsN() const { return (int)mThreads.size() + 1; }
+
+    // calls func( bandBegin, bandEnd ) over [begin, end) split in bands
+    template <typename F>
+    void ParallelFor( int begin, int end, const F &func )
+    {
+        if ( begin >= end )
+            return;
+
+        if ( mThreads.empty() || isWorkerThread() || (end - begin) < 2 )
+        {
+            func( begin, end );
+            return;
+        }
+
+        run( []( const void *pCtx, int b, int e ) { (*(const F *)pCtx)( b, e ); },
+             &func, begin, end );
+    }
+
+private:
+    static bool &isWorkerThread();
+
+    void run( JobFn pFn, const void *pCtx, int begin, int end );
+    void workerMain();
+    void doBands();
+};
+
+#endif
+
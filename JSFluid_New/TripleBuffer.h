@@ -0,0 +1,67 @@
+//==================================================================
+/// TripleBuffer.h
+///
+/// Created by Davide Pasca - 2022/05/26
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <atomic>
+
+//==================================================================
+/// Lock-free hand-over of the latest value from one writer thread to
+/// one reader thread.
+/// The writer fills the back buffer and publishes it, swapping it
+/// with the middle one. The reader takes the middle one in exchange
+/// for its front one when a new one was published. Neither side ever
+/// waits, the writer may publish several times between two reads,
+/// and the front buffer stays untouched until the reader lets it go.
+//==================================================================
+template <typename T>
+class TripleBuffer
+{
+    // index of the middle buffer, and whether it's newer than the front
+    static const unsigned IDX_MASK  = 3;
+    static const unsigned FRESH_BIT = 4;
+
+    T                       mBuffs[3] {};
+    std::atomic<unsigned>   mMiddle { 1 };
+    unsigned                mBack  = 2; // of the writer
+    unsigned                mFront = 0; // of the reader
+
+public:
+    TripleBuffer() = default;
+    TripleBuffer( const TripleBuffer & ) = delete;
+    TripleBuffer &operator=( const TripleBuffer & ) = delete;
+
+    //==================================================================
+    // writer side
+    T &GetBack() { return mBuffs[ mBack ]; }
+
+    // the back buffer becomes the latest, and the writer gets a stale
+    //  one to fill next
+    void Publish()
+    {
+        mBack = mMiddle.exchange( mBack | FRESH_BIT, std::memory_order_acq_rel ) & IDX_MASK;
+    }
+
+    //==================================================================
+    // reader side
+    const T &GetFront() const { return mBuffs[ mFront ]; }
+
+    // moves the front to the latest published buffer, if there's a new
+    //  one. Returns false if the front is already the latest
+    bool Acquire()
+    {
+        if ( !(mMiddle.load( std::memory_order_relaxed ) & FRESH_BIT) )
+            return false;
+
+        mFront = mMiddle.exchange( mFront, std::memory_order_acq_rel ) & IDX_MASK;
+        return true;
+    }
+};
+
+#endif
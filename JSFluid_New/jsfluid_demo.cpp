@@ -10,20 +10,23 @@
 #include <stdio.h>
 #include <vector>
 #include <array>
+#include <memory>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
 #include <GL/glew.h>
 #include <GL/freeglut.h>
 #include "ImmGL.h"
-#include "FluidSolver.h"
+#include "FluidDomain.h"
+#include "TripleBuffer.h"
 
 #define c_auto  const auto
 
 using vec2 = std::array<float,2>;
 
-template <typename T, int ROWS, int COLS>
-using mtxNM = std::array< std::array<T,COLS>, ROWS>;
-
-static const int N = 64;
+static int N = 64;
 static float TIME_DELTA = 0.1f;
 static float DIFFUSION_RATE;
 static float VISCOSITY = 0.f;
@@ -38,16 +41,56 @@ enum DispMode : int {
 };
 static DispMode _dispMode = DISPMODE_SMOOTH;
 
-static std::vector<char>   _tmpBuff;
-
-using Solver = FluidSolver<N,false>;
+using Solver = FluidSolverBase;
 
 static const int GRID_NX = 1;
 static const int GRID_NY = 1;
-static mtxNM<Solver,GRID_NY,GRID_NY> _solvers;
+// tiles of N x N, stepped as one domain
+static std::unique_ptr<FluidDomain> _oDomain;
 
 static ImmGL    *_pIGL;
 
+//==================================================================
+/// Copy of the fields of a tile that the display reads, (N+2)^2 cells
+/// with the borders
+//==================================================================
+struct TileSnapshot
+{
+    std::vector<float>  vel[2];
+    std::vector<float>  den;
+
+    int IX( int i, int j ) const { return i + (N+2) * j; }
+
+    template <int DIM_IDX>
+    float SMPVel( int i, int j ) const { return vel[DIM_IDX][ IX(i,j) ]; }
+    float SMPDen( int i, int j ) const { return den[ IX(i,j) ]; }
+};
+
+//==================================================================
+struct DomainSnapshot
+{
+    std::vector<TileSnapshot>   tiles;
+
+    const TileSnapshot &GetTile( int tx, int ty ) const { return tiles[ tx + GRID_NX * ty ]; }
+};
+
+// the domain is stepped on a thread of its own, which publishes a
+//  snapshot after each step, for the display to draw the latest one.
+//  A step is made for each snapshot that the display takes, counted
+//  by _framesN, so that the simulation goes at the frame rate
+static std::thread                  _simThread;
+static std::atomic<uint32_t>        _framesN;
+static std::atomic<bool>            _simQuit;
+static std::atomic<bool>            _simClear;
+// held by the simulation thread over a step, and taken between two
+//  steps by the UI when asked with _simHold
+static std::mutex                   _simStepMutex;
+static std::atomic<bool>            _simHold;
+static TripleBuffer<DomainSnapshot> _snapshots;
+
+// input of the UI to the domain, drained by the simulation thread
+static FluidEventQueue              _eventQueue { 1024 };
+
 //==================================================================
 struct Env
 {
@@ -64,7 +107,7 @@ struct Env
 
 //==================================================================
 static void drawSolverLines(
-        const Solver &solv,
+        const TileSnapshot &solv,
         const vec2 &sca,
         const vec2 &off,
         float vsca )
@@ -91,7 +134,7 @@ static void drawSolverLines(
 
 //==================================================================
 static void drawSolverFill(
-        const Solver &solv,
+        const TileSnapshot &solv,
         const vec2 &sca,
         const vec2 &off,
         bool doSmooth )
@@ -146,7 +189,7 @@ static void drawSolverFill(
 }
 
 //==================================================================
-static void draw_velocity()
+static void draw_velocity( const DomainSnapshot &snap )
 {
     vec2 sca { 1.f / (N+2) / GRID_NX,
                1.f / (N+2) / GRID_NY };
@@ -156,7 +199,7 @@ static void draw_velocity()
         for (int j=0; j != GRID_NX; ++j)
         {
             drawSolverLines(
-                _solvers[i][j],
+                snap.GetTile( j, i ),
                 sca,
                 {(float)j/GRID_NX,
                  (float)i/GRID_NY},
@@ -166,7 +209,7 @@ static void draw_velocity()
 }
 
 //==================================================================
-static void draw_density( bool doSmooth )
+static void draw_density( const DomainSnapshot &snap, bool doSmooth )
 {
     vec2 sca { 1.f / (N+2) / GRID_NX,
                1.f / (N+2) / GRID_NY };
@@ -180,7 +223,7 @@ static void draw_density( bool doSmooth )
             //if ( i!=1 || j!=1 ) continue;
 
             drawSolverFill(
-                _solvers[i][j],
+                snap.GetTile( j, i ),
                 sca,
                 {(float)j/GRID_NX,
                  (float)i/GRID_NY},
@@ -203,9 +246,6 @@ static void get_from_UI()
 	c_auto mouseX_WS = (             _env.mx) / (float)_env.win_x;
 	c_auto mouseY_WS = (_env.win_y - _env.my) / (float)_env.win_y;
 
-    c_auto cellW_WS = 1.f / GRID_NX;
-    c_auto cellH_WS = 1.f / GRID_NY;
-
     if ( mouseX_WS < 0 || mouseX_WS > 1.f || mouseY_WS < 0 || mouseY_WS > 1.f )
     {
         _env.omx = _env.mx;
@@ -218,37 +258,67 @@ static void get_from_UI()
     c_auto cell_IX = std::min( (int)cell_X, GRID_NX-1 );
     c_auto cell_IY = std::min( (int)cell_Y, GRID_NY-1 );
 
-    auto &solv = _solvers[cell_IY][cell_IX];
-
-    c_auto samp_IX = (int)((mouseX_WS * GRID_NX - cell_IX) * (N+2));
-    c_auto samp_IY = (int)((mouseY_WS * GRID_NY - cell_IY) * (N+2));
+    // in cells of the tile, with the borders
+    c_auto samp_X = (mouseX_WS * GRID_NX - cell_IX) * (N+2);
+    c_auto samp_Y = (mouseY_WS * GRID_NY - cell_IY) * (N+2);
 
     // don't apply to the borders
-    if ( samp_IX < 1 || samp_IX > N || samp_IY < 1 || samp_IY > N )
+    if ( samp_X < 1 || samp_X >= N+1 || samp_Y < 1 || samp_Y >= N+1 )
     {
         _env.omx = _env.mx;
         _env.omy = _env.my;
         return;
     }
 
+    // to the simulation thread, which applies it before its next step
+    FluidEvent e;
+    e.pos[0] = cell_IX * N + samp_X - 1;
+    e.pos[1] = cell_IY * N + samp_Y - 1;
+    e.timestamp = glutGet( GLUT_ELAPSED_TIME ) * 0.001;
+
     // draw density if CTRL is pressed or it's right button, otherwise do velocity
     if ( !!(_env.modifiers & GLUT_ACTIVE_CTRL) || _env.mouse_down[GLUT_RIGHT_BUTTON] )
     {
-        solv.SMPDen( samp_IX, samp_IY ) += SOURCE_DENSITY * dt;
+        e.type = FluidEvent::TYPE_SOURCE;
+        e.amount[0] = SOURCE_DENSITY * dt;
     }
     else
     {
         vec2 vel { (float)_env.mx  - _env.omx,
                    (float)_env.omy - _env.my };
 
-        solv.SMPVel<0>( samp_IX, samp_IY ) += FORCE * vel[0] * dt;
-        solv.SMPVel<1>( samp_IX, samp_IY ) += FORCE * vel[1] * dt;
+        e.type = FluidEvent::TYPE_FORCE;
+        e.amount[0] = FORCE * vel[0] * dt;
+        e.amount[1] = FORCE * vel[1] * dt;
     }
 
+    // dropped if the simulation is that far behind
+    _eventQueue.TryPush( e );
+
     _env.omx = _env.mx;
     _env.omy = _env.my;
 }
 
+static void logErr( const char *fmt, ... );
+static void logMsg( const char *fmt, ... );
+
+//==================================================================
+// the trace is read while no thread records, so it's written between
+//  two steps, the threads of the pool being idle, and from the UI
+//  thread, which draws with trace scopes of its own
+static void write_trace()
+{
+    _simHold = true;
+    {
+        std::lock_guard<std::mutex> lock( _simStepMutex );
+        if ( FluidTraceWriteChrome( "jsfluid_trace.json" ) )
+            logMsg( "Wrote jsfluid_trace.json" );
+        else
+            logErr( "Could not write the trace (built with JSFLUID_ENABLE_TRACE ?)" );
+    }
+    _simHold = false;
+}
+
 //==================================================================
 static void key_func( unsigned char key, int x, int y )
 {
@@ -256,9 +326,7 @@ static void key_func( unsigned char key, int x, int y )
 	{
 		case 'c':
 		case 'C':
-            for (int i=0; i != GRID_NY; ++i)
-                for (int j=0; j != GRID_NX; ++j)
-                    _solvers[i][j].Clear();
+            _simClear = true;
 			break;
 
 		case 'q':
@@ -272,6 +340,11 @@ static void key_func( unsigned char key, int x, int y )
             if ( _dispMode == DISPMODE_N )
                 _dispMode = (DispMode)0;
 			break;
+
+		case 't':
+		case 'T':
+            write_trace();
+			break;
 	}
 }
 
@@ -300,18 +373,84 @@ static void reshape_func( int width, int height )
 	_env.win_y = height;
 }
 
-static void idle_func()
+//==================================================================
+static void take_snapshot( DomainSnapshot &snap )
 {
-	get_from_UI();
+    FLUID_TRACE_SCOPE( "take_snapshot" );
+
+    snap.tiles.resize( GRID_NX * GRID_NY );
 
     for (int i=0; i != GRID_NY; ++i)
     {
         for (int j=0; j != GRID_NX; ++j)
         {
-        	_solvers[i][j].vel_step( _tmpBuff.data(), VISCOSITY, TIME_DELTA );
-        	_solvers[i][j].dens_step( _tmpBuff.data(), DIFFUSION_RATE, TIME_DELTA );
+            c_auto &solv = _oDomain->GetTile( j, i );
+            auto &tile = snap.tiles[ j + GRID_NX * i ];
+
+            auto copy = [&]( Solver::Field f, std::vector<float> &dst )
+            {
+                dst.resize( (size_t)(N+2) * (N+2) );
+                solv.CopyCellsOut( f, 0, N+1, 0, N+1, dst.data() );
+            };
+            copy( Solver::FIELD_VEL0, tile.vel[0] );
+            copy( Solver::FIELD_VEL1, tile.vel[1] );
+            copy( Solver::FIELD_DEN,  tile.den );
         }
     }
+}
+
+//==================================================================
+static void simulation_main()
+{
+    auto frameN = _framesN.load();
+    while ( !_simQuit.load( std::memory_order_relaxed ) )
+    {
+        std::unique_lock<std::mutex> lock( _simStepMutex );
+
+        if ( _simClear.exchange( false ) )
+            _oDomain->Clear();
+
+        _oDomain->Step( VISCOSITY, DIFFUSION_RATE, TIME_DELTA );
+
+        take_snapshot( _snapshots.GetBack() );
+        _snapshots.Publish();
+
+        // let the UI take the mutex, see write_trace()
+        lock.unlock();
+        while ( _simHold.load() )
+            std::this_thread::yield();
+
+        // the next step once this one is taken by the display
+        _framesN.wait( frameN );
+        frameN = _framesN.load();
+    }
+}
+
+//==================================================================
+static void stop_simulation()
+{
+    _simQuit = true;
+    _framesN.fetch_add( 1 );
+    _framesN.notify_one();
+    if ( _simThread.joinable() )
+        _simThread.join();
+}
+
+//==================================================================
+static void idle_func()
+{
+    // redraw only for a new step, and don't spin while waiting for one
+    if ( !_snapshots.Acquire() )
+    {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+        return;
+    }
+
+    // the input since the last frame, for the next step, which it lets
+    //  go. So the sources and forces go by steps, not by idle calls
+	get_from_UI();
+    _framesN.fetch_add( 1 );
+    _framesN.notify_one();
 
 	glutSetWindow( _env.win_id );
 	glutPostRedisplay();
@@ -333,12 +472,17 @@ static void display_func()
     // do render
     _pIGL->ResetStates();
 
-    switch ( _dispMode )
+    // the latest snapshot, or none before the first step
+    c_auto &snap = _snapshots.GetFront();
+    if ( !snap.tiles.empty() )
     {
-    case DISPMODE_FLAT:   draw_density( false ); break;
-    case DISPMODE_SMOOTH: draw_density( true ); break;
-    case DISPMODE_VEL:    draw_velocity(); break;
-    default: break;
+        switch ( _dispMode )
+        {
+        case DISPMODE_FLAT:   draw_density( snap, false ); break;
+        case DISPMODE_SMOOTH: draw_density( snap, true ); break;
+        case DISPMODE_VEL:    draw_velocity( snap ); break;
+        default: break;
+        }
     }
 
     _pIGL->FlushPrims();
@@ -375,7 +519,7 @@ static void logMsg( const char *fmt, ...)
 //==================================================================
 int main( int argc, char ** argv )
 {
-	if ( argc != 1 && argc != 6 ) {
+	if ( argc != 1 && argc != 7 ) {
 		logErr( "usage : %s N dt diff visc force source", argv[0] );
 		logErr( "where:" );
 		logErr( "\t N      : grid resolution" );
@@ -388,7 +532,7 @@ int main( int argc, char ** argv )
 	}
 
 	if ( argc == 1 ) {
-		//N = 64;
+		N = 64;
 		TIME_DELTA      = 0.1f;
 		DIFFUSION_RATE  = 0.0f;
 		VISCOSITY       = 0.0f;
@@ -397,7 +541,7 @@ int main( int argc, char ** argv )
 		logMsg( "Using defaults : N=%d dt=%g diff=%g visc=%g force = %g source=%g",
 			N, TIME_DELTA, DIFFUSION_RATE, VISCOSITY, FORCE, SOURCE_DENSITY );
 	} else {
-		//N = atoi(argv[1]);
+		N = atoi(argv[1]);
 		TIME_DELTA      = (float)atof(argv[2]);
 		DIFFUSION_RATE  = (float)atof(argv[3]);
 		VISCOSITY       = (float)atof(argv[4]);
@@ -410,9 +554,29 @@ int main( int argc, char ** argv )
 	logMsg( "\t Add velocities: move the mouse while pressing left-button" );
 	logMsg( "\t Toggle density/velocity display with the 'v' key" );
 	logMsg( "\t Clear the simulation by pressing the 'c' key" );
+	logMsg( "\t Save a trace of the solver timings with the 't' key" );
 	logMsg( "\t Quit by pressing the 'q' key" );
 
-    _tmpBuff.resize( _solvers[0][0].GetTempBuffMaxSize() );
+    if ( N < 1 )
+    {
+        logErr( "Invalid grid resolution %d", N );
+        exit( 1 );
+    }
+
+    // leave out the stages that the parameters don't use
+    unsigned policy = 0;
+    if ( VISCOSITY == 0 )      policy |= FluidSolverBase::POLICY_INVISCID;
+    if ( DIFFUSION_RATE == 0 ) policy |= FluidSolverBase::POLICY_NO_DIFFUSION;
+
+    ThreadPool threadPool;
+    _oDomain = std::make_unique<FluidDomain>( GRID_NX, GRID_NY, N, N, false, policy );
+    _oDomain->SetThreadPool( &threadPool );
+    _oDomain->SetEventQueue( &_eventQueue );
+    for (int i=0; i != GRID_NY; ++i)
+    {
+        for (int j=0; j != GRID_NX; ++j)
+            _oDomain->GetTile( j, i ).SetRelaxMode( Solver::RELAX_RED_BLACK );
+    }
 
 	_env.win_x = 512;
 	_env.win_y = 512;
@@ -444,6 +608,10 @@ int main( int argc, char ** argv )
     ImmGL immGL;
     _pIGL = &immGL;
 
+    // exit() is how the demo quits, so the thread is stopped from there
+    _simThread = std::thread( simulation_main );
+    atexit( stop_simulation );
+
 	glutMainLoop();
 
 	exit( 0 );